@@ -16,20 +16,42 @@
 
 // Temperature limits are defined in celsius and converted later
 #define MAX_TEMP_ERROR 2            // Max error for stability
+#define RECOVERY_BAND 5             // Band around the target in which a recovery after a door opening is over
+#define RAMP_BLEND_TIME 4           // [min] blend of the setpoint into the target, at the end of a ramp (0 = sharp corner)
+#define RAMP_SCURVE_BLEND           // comment out for a parabolic blend: lower peak acceleration, but steps of acceleration at its ends
 #define MAX_TEMPERATURE 1100        // Max input temperature
 #define MIN_TEMPERATURE 0           // Min input temperature
 #define ERROR_TEMP 1200             // Upper temperature to trigger error
 #define MIN_STABLE_CYCLES 10        // Number of PWM cycles to consider the temperature stable
 #define POLL_PROBE_INTERVAL 5000    // Polling interval for temp reading when not firing
+#define PROBE_SAMPLE_SLOT 250       // [ms] Round-robin sampling slot while firing: one probe is read per slot
 
 
 // PWM cycle time
 #define CYCLE_TIME 5 * SECOND
 
+// Minimum duty cycle [%] of a single heater stage: shorter pulses are skipped,
+// longer ones that would leave the stage off for less than this are extended to a full cycle
+#define MIN_STAGE_DUTY 5
+
+// Power of the heaters of all the zones at full duty [W], for the energy used by a firing
+#define HEATER_POWER_W 3000
+
+// Zone balancing: each zone's error is corrected by this fraction of its deviation
+// from the mean temperature of all the zones, to even out the chamber. Set to 0 to disable.
+#define ZONE_BALANCE_GAIN 0.5
+
 // Maximum number of allowed consecutives temperature reading errors
 // before considering the temperature probe faulty and stop the system
 #define MAX_N_ERROR_READINGS 10
 
+// Redundant probes voting (PROBES_PER_ZONE > 1)
+// A probe is dropped when it can't be read, or when it disagrees with the median of
+// the zone by more than PROBE_AGREEMENT_TOL for PROBE_MAX_STRIKES consecutive readings.
+// The zone keeps firing in degraded mode as long as at least one probe is left.
+#define PROBE_AGREEMENT_TOL 10      // [C] Max difference between agreeing probes, converted to the system unit
+#define PROBE_MAX_STRIKES 5         // Consecutive disagreements before dropping a probe
+
 // Placeholder values for untuned systems
 // TODO find a SIMPLE way to eyeball the default values from
 // TODO the system characteristics (outside this code)
@@ -50,6 +72,8 @@
 #define EEPROM_ADDR_KI EEPROM_ADDR_KP + sizeof(double)
 #define EEPROM_ADDR_KD EEPROM_ADDR_KP + 2*sizeof(double)
 #define EEPROM_DEFAULT_UNIT EEPROM_KP + 3*sizeof(double)
+#define EEPROM_ADDR_OVEN_MODEL 32     // learned oven model (OvenModel::Data)
+#define EEPROM_ADDR_LOG_SEQUENCE 96   // sequence number of the next log (LogSequence)
 
 // Autotune parameters 
 #define TARGET_TEMP_FOR_AUTOTUNE 800  // Target setpoint
@@ -58,15 +82,84 @@
 #define PID_N_OSCILLATIONS 10         // Number of oscillations required for tuning
 
 
+// ===== ESTIMATORS ======
+// Time constant of the workpiece per mm of thickness, for the core temperature estimator.
+// ~20 s/mm fits steel blades in an electric oven, tune it to your loads.
+#define LOAD_TAU_PER_MM 20      // [s/mm]
+
+// Kalman filter of the chamber temperature. The model constants are given in C,
+// they are only a prior: the process noise absorbs the mismatch (i.e. in F or K).
+#define KALMAN_HEAT_RATE 0.1    // [C/s] heating rate at full power, near ambient
+#define KALMAN_COOLING 0.0005   // [1/s] heat loss coefficient, toward ambient
+#define KALMAN_RATE_TAU 60      // [s] lag of the heating rate after a power change
+#define KALMAN_Q_TEMP 0.01      // [C^2/s] process noise on the temperature
+#define KALMAN_Q_RATE 0.00001   // [(C/s)^2/s] process noise on the heating rate
+#define KALMAN_R 0.25           // [C^2] variance of a MAX31855 reading
+#define KALMAN_AMBIENT 20       // [C] temperature the oven cools toward, the constants above are converted to the system unit
+
+// Heatwork integration, for the firings to a cone
+#define HEATWORK_ACTIVATION 36000   // [K] activation energy over the gas constant (E/R)
+#define HEATWORK_REF_RATE 60        // [C/h] final heating rate of the cone table
+
+// Learned oven model: heating rate at full power and natural cooling rate, by temperature bin.
+// A sample is taken once the heaters have been at full power (or off) long enough for the
+// filtered rate to settle. Until a bin is learned, the default rates are assumed.
+#define OVEN_MODEL_BINS 12              // bins of OVEN_MODEL_BIN_WIDTH from 0 C
+#define OVEN_MODEL_BIN_WIDTH 100        // [C]
+#define OVEN_MODEL_SETTLE 120000        // [ms] full power (or off) before the first sample
+#define OVEN_MODEL_SAMPLE_INTERVAL 10000    // [ms] between two samples
+#define OVEN_MODEL_GAIN 0.1             // weight of a new sample
+#define OVEN_MODEL_MAGIC 0x4F4D         // marks a model saved in the EEPROM
+#define OVEN_DEFAULT_HEAT_RATE 5        // [C/min] assumed heating rate at full power
+#define OVEN_DEFAULT_COOL_RATE 2        // [C/min] assumed natural cooling rate
+#define ETA_UPDATE_INTERVAL 1000        // [ms] refresh of the remaining time of the program
+
+
 // ===== GRAPHICS ========
 #define MIN_TIME_BETWEEN_SCREEN_UPDATES 3000 //  [ms]
+#define HOLD_SCREEN_UPDATE_INTERVAL 10000    //  [ms] slower refresh while holding
 #define MAX_FILES 30            // max number of files fetched from the sd card
 
 // ====== FILES =========== 
 #define MAX_INSTRUCTIONS_PER_PROGRAM 20 // Maximum number of instructions in a program
+#define MAX_REPEAT_BLOCKS 4             // Maximum number of repeat blocks in a program
+#define PREFETCH_GUARD 100              // [ms] no SD read for a streamed program closer than this to a heater edge
 #define MAX_FILENAME_LENGTH 50          // max length of a filename
 #define MAX_FILES_ON_SCREEN 5           // max number of files displayed on the screen 
 #define MAX_INSTR_NAME_LENGHT 30        // max length of an instruction name
+#define INSTR_NAME_POOL_SIZE 240        // bytes shared by the names of the instructions of a program
+#define LOG_SECTOR_SIZE 512             // [B] the log is written to the SD card a whole sector at a time
+#define LOG_BUFFER_SLACK 64             // [B] room for the records that arrive while the card is busy
+#define LOG_SYNC_INTERVAL 30000         // [ms] max time between two updates of the directory entry of the log
+#define LOG_SEQUENCE_MAGIC 0x4C53        // marks a log sequence number saved in the EEPROM
+#define LOG_SEQUENCE_FILE "sequence.bin" // in /logs, the sequence number of the next log on the card
+#define LOG_NAME_PROGRAM_CHARS 20       // characters of the program name in the name of a log
+#define LOG_PATH_LENGTH 48              // "/logs/004/00421_" + program name + extension
+#define LOG_SHARD_SIZE 100              // logs per subfolder of /logs, by sequence number
+#define LOG_MAX_COUNT 500               // max number of logs kept, the oldest are removed
+#define LOG_MAX_BYTES 67108864UL        // [B] 64 MB, max size of the logs kept
+#define LOG_MIN_FREE_KB 1024            // [kB] free space left on the card besides the new log
+#define LOG_DEADBAND_TEMP 1.0           // [deg] change of the temperature that triggers a record
+#define LOG_DEADBAND_TARGET 1.0         // [deg] change of the target that triggers a record
+#define LOG_DEADBAND_DUTY 10.0          // [%] change of the duty cycle that triggers a record
+#define LOG_MIN_INTERVAL 1000           // [ms] min time between two records, during fast events
+#define LOG_MAX_INTERVAL 60000          // [ms] max time between two records, during stable soaks
+#define LOG_CSV_RECORD_BYTES 80         // [B] estimated size of a CSV record, to preallocate the log
+#define LOG_PREALLOCATE_MARGIN 1.5      // the estimated runtime counts no wait, hold or door opening
+#define LOG_MAX_PREALLOCATE 16777216UL  // [B] 16 MB, preallocation limit of a log
+#define BLACKBOX_SAMPLES 120            // probe samples kept for a crash dump, 10 B of RAM each: the last 30 s while firing
+#define BLACKBOX_MAX_DUMPS 100          // max number of crash dumps on the card, /logs/crash_1.bin to crash_100.bin
+
+// ===== LOG FORMAT =====
+// uncomment to write binary logs (.tkl, see TEEK_logFormat.h) instead of CSV ones.
+// tools/tkl2csv.cpp converts them to CSV on a PC
+//#define BINARY_LOG
+// uncomment, with BINARY_LOG, to compress the records: delta/varint coded, in sector blocks
+// (see TEEK_logFormat.h). For the logs of the very long firings
+//#define COMPRESSED_LOG
+#if defined(COMPRESSED_LOG) && !defined(BINARY_LOG)
+    #define BINARY_LOG  // the compressed log is a binary log
+#endif
 
 // ===== SERIAL =====
 // comment out to disable serial communications
@@ -0,0 +1,279 @@
+#include "TEEK_csv.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// ==== CSV TOKENIZER CLASS =====
+
+// Start tokenizing a line
+void CsvTokenizer::begin(char* l){
+  line = ptr = l;
+  count = 0;
+  position = 0;
+  badQuote = false;
+}
+
+// Blanks around a field. At the end of the line, the end of line of CRLF files is a blank too
+static inline bool isBlank(char c){ return c == ' ' || c == '\t'; }
+static inline bool isEndOfLine(char c){ return c == '\r' || c == '\n'; }
+
+// Get the next field, terminated in place, in a single pass over its characters.
+// Returns false at the end of the line
+bool CsvTokenizer::next(char*& value){
+  if(ptr == nullptr) return false;
+
+  while(isBlank(*ptr)) ptr++;
+  position = ptr - line + 1;
+  count++;
+
+  // quoted field: the text is moved back over the quotes, "" is an escaped quote
+  if(*ptr == '"'){
+    char* out = ++ptr;
+    value = out;
+    while(true){
+      if(*ptr == '\0' || (isEndOfLine(*ptr) && ptr[1] == '\0')){ badQuote = true; break; }
+      if(*ptr == '"'){
+        if(ptr[1] != '"'){ ptr++; break; }
+        ptr++;
+      }
+      *out++ = *ptr++;
+    }
+    *out = '\0';
+
+    // nothing but blanks after the closing quote
+    while(isBlank(*ptr) || isEndOfLine(*ptr)) ptr++;
+    if(*ptr != ',' && *ptr != '\0'){
+      badQuote = true;
+      while(*ptr != ',' && *ptr != '\0') ptr++;
+    }
+    ptr = (*ptr == ',') ? ptr + 1 : nullptr;
+    return true;
+  }
+
+  // plain field, trimmed: end follows the last kept character, endOfLine the last one
+  // that is not an end of line, for the last field of the line
+  value = ptr;
+  char* end = ptr;
+  char* endOfLine = ptr;
+  for(; *ptr != ',' && *ptr != '\0'; ptr++){
+    if(isBlank(*ptr)) continue;
+    if(!isEndOfLine(*ptr)) endOfLine = ptr + 1;
+    end = ptr + 1;
+  }
+  if(*ptr == ','){
+    *end = '\0';
+    ptr++;
+  }
+  else{
+    *endOfLine = '\0';
+    ptr = nullptr;
+  }
+  return true;
+}
+
+// True for a blank line or a comment
+bool CsvTokenizer::isSkippable(const char* line){
+  while(*line == ' ' || *line == '\t') line++;
+  return *line == '\0' || *line == '\r' || *line == '\n' || *line == '#';
+}
+
+
+// ==== CSV LAYOUT CLASS =====
+
+// header names of the columns, matched on their start. Two names per column, "" if unused
+static const char* const columnNames[CSV_COLUMNS][2] = {
+  {"name", "instr"}, {"target", "temp"}, {"hold", "soak"}, {"rate", "ramp"},
+  {"door", ""}, {"button", ""}, {"unit", ""}
+};
+
+// Legacy order: name,target,hold,rate,door,button, without unit
+void CsvLayout::setDefault(){
+  for(uint8_t c = 0; c < CSV_COLUMNS; c++) fields[c] = c;
+  fields[CSV_UNIT] = CSV_NO_FIELD;
+}
+
+// Map the columns from the header line. Returns false if the header is not recognized,
+// and the legacy order is used
+bool CsvLayout::parseHeader(char* line){
+  for(uint8_t c = 0; c < CSV_COLUMNS; c++) fields[c] = CSV_NO_FIELD;
+
+  CsvTokenizer tok;
+  tok.begin(line);
+  char* value;
+  while(tok.next(value)){
+    for(uint8_t c = 0; c < CSV_COLUMNS; c++){
+      if(fields[c] != CSV_NO_FIELD) continue;
+      bool match = false;
+      for(uint8_t n = 0; n < 2; n++){
+        size_t len = strlen(columnNames[c][n]);
+        if(len > 0 && strncasecmp(value, columnNames[c][n], len) == 0) match = true;
+      }
+      if(match){
+        fields[c] = tok.Field();
+        break;
+      }
+    }
+  }
+
+  for(uint8_t c = CSV_NAME; c <= CSV_RATE; c++){
+    if(fields[c] == CSV_NO_FIELD){
+      setDefault();
+      return false;
+    }
+  }
+  return true;
+}
+
+// A decimal number, with an optional fraction and exponent ("-12.5", "1e3"), must use the whole
+// field. Lighter than strtod, which also reads "nan", "inf" and hex numbers: the digits after the
+// 9th significant one are dropped, beyond the resolution of the packed instructions anyway
+static bool parseNumber(const char* str, double& value){
+  const char* p = str;
+  bool negative = (*p == '-');
+  if(*p == '-' || *p == '+') p++;
+
+  uint32_t mantissa = 0;
+  int16_t scale = 0;            // power of ten of the mantissa
+  bool digits = false;
+  for(; isdigit((unsigned char) *p); p++){
+    digits = true;
+    if(mantissa < 100000000UL) mantissa = mantissa * 10 + (*p - '0');
+    else scale++;
+  }
+  if(*p == '.'){
+    for(p++; isdigit((unsigned char) *p); p++){
+      digits = true;
+      if(mantissa < 100000000UL){
+        mantissa = mantissa * 10 + (*p - '0');
+        scale--;
+      }
+    }
+  }
+  if(!digits) return false;
+
+  if(*p == 'e' || *p == 'E'){
+    p++;
+    bool negativeExponent = (*p == '-');
+    if(*p == '-' || *p == '+') p++;
+    if(!isdigit((unsigned char) *p)) return false;
+    int16_t exponent = 0;
+    for(; isdigit((unsigned char) *p); p++){
+      if(exponent < 1000) exponent = exponent * 10 + (*p - '0');
+    }
+    scale += negativeExponent ? -exponent : exponent;
+  }
+  if(*p != '\0') return false;
+
+  // powers of ten are exact up to 1e22: the common cases are correctly rounded
+  double power = 1;
+  for(int16_t s = (scale < 0 ? -scale : scale); s > 0 && power < 1e30; s--) power *= 10;
+  value = (scale < 0) ? mantissa / power : mantissa * power;
+  if(negative) value = -value;
+  return true;
+}
+
+// Parse an instruction row in place. The name must fit a nameSize buffer, and the values
+// the packed instruction (|temperature|, |rate| <= 3276.7, hold <= 65535 min)
+bool CsvLayout::parseRow(char* line, CsvRow& row, CsvError& error, size_t nameSize) const{
+  char* values[CSV_COLUMNS];
+  uint8_t positions[CSV_COLUMNS];
+  for(uint8_t c = 0; c < CSV_COLUMNS; c++) values[c] = nullptr;
+
+  CsvTokenizer tok;
+  tok.begin(line);
+  char* value;
+  while(tok.next(value)){
+    // a broken quote is reported on its field
+    if(tok.IsBadQuote()){
+      error.position = tok.Position();
+      error.message = "unterminated quote";
+      return false;
+    }
+    for(uint8_t c = 0; c < CSV_COLUMNS; c++){
+      if(fields[c] != tok.Field()) continue;
+      values[c] = value;
+      positions[c] = tok.Position();
+    }
+  }
+  error.position = tok.Position();
+  for(uint8_t c = CSV_NAME; c <= CSV_RATE; c++){
+    if(values[c] == nullptr){
+      error.message = "missing field";
+      return false;
+    }
+  }
+
+  // name
+  error.position = positions[CSV_NAME];
+  row.name = values[CSV_NAME];
+  if(strlen(row.name) >= nameSize){
+    error.message = "name too long";
+    return false;
+  }
+
+  // numeric fields
+  error.position = positions[CSV_TARGET];
+  if(!parseNumber(values[CSV_TARGET], row.target) || fabs(row.target) > INT16_MAX / 10){
+    error.message = "invalid target";
+    return false;
+  }
+  error.position = positions[CSV_HOLD];
+  double hold;
+  if(!parseNumber(values[CSV_HOLD], hold) || hold < 0 || hold > UINT16_MAX || hold != (unsigned long) hold){
+    error.message = "invalid hold, whole minutes";
+    return false;
+  }
+  row.hold = hold;
+  error.position = positions[CSV_RATE];
+  if(!parseNumber(values[CSV_RATE], row.rate) || fabs(row.rate) > INT16_MAX / 10){
+    error.message = "invalid rate";
+    return false;
+  }
+
+  // optional flags, "" is 0
+  bool* flags[2] = {&row.waitForDoorOpen, &row.waitForButtonPress};
+  for(uint8_t f = 0; f < 2; f++){
+    const char* v = values[CSV_DOOR + f];
+    *flags[f] = false;
+    if(v == nullptr || v[0] == '\0') continue;
+    error.position = positions[CSV_DOOR + f];
+    if((v[0] != '0' && v[0] != '1') || v[1] != '\0'){
+      error.message = "invalid flag, 0 or 1";
+      return false;
+    }
+    *flags[f] = (v[0] == '1');
+  }
+
+  // optional unit, "" is the unit of the program
+  row.unit = CSV_NO_UNIT;
+  const char* u = values[CSV_UNIT];
+  if(u != nullptr && u[0] != '\0'){
+    const char* units = "CFK";
+    const char* found = (u[1] == '\0') ? strchr(units, toupper((unsigned char) u[0])) : nullptr;
+    error.position = positions[CSV_UNIT];
+    if(found == nullptr){
+      error.message = "invalid unit, C, F or K";
+      return false;
+    }
+    row.unit = found - units;
+  }
+  return true;
+}
+
+
+// ==== UNITS =====
+
+// Convert a temperature, or a temperature difference (i.e. a rate), between units (0 C, 1 F, 2 K)
+double convertTemperature(double value, uint8_t from, uint8_t to, bool difference){
+  if(from == to) return value;
+
+  // to Celsius
+  if(from == 1) value = difference ? value * 5.0 / 9.0 : (value - 32) * 5.0 / 9.0;
+  else if(from == 2 && !difference) value -= 273.15;
+
+  // from Celsius
+  if(to == 1) return difference ? value * 9.0 / 5.0 : value * 9.0 / 5.0 + 32;
+  if(to == 2 && !difference) return value + 273.15;
+  return value;
+}
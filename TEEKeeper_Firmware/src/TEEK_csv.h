@@ -0,0 +1,121 @@
+#ifndef TEEK_CSV_H
+#define TEEK_CSV_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// ===== CSV PARSING =====================================================
+// Tokenizer and row parser of the CSV programs, shared by the firmware and by the host
+// compiler (tools/tkpc.cpp): no Arduino dependency here.
+// The fields are parsed in place, in the line buffer: no copy, and no length limit on a field
+// other than the one of the line.
+
+// columns of a program, in the legacy order used when the header is not recognized
+enum CsvColumn : uint8_t {CSV_NAME, CSV_TARGET, CSV_HOLD, CSV_RATE, CSV_DOOR, CSV_BUTTON, CSV_UNIT, CSV_COLUMNS};
+#define CSV_NO_FIELD 0xFF
+
+// units of the unit column, in the order of TemperatureUnit
+#define CSV_NO_UNIT -1
+
+
+//* CLASS CsvTokenizer
+/**
+ * @class CsvTokenizer
+ * @brief Splits a CSV line in place into its fields.
+ *
+ * Each field is terminated in the line buffer, trimmed of the surrounding blanks, and unquoted
+ * ("a, ""b""" -> a, "b"). A trailing '\r' (CRLF files) is ignored.
+ *
+ * @private
+ * - char* line: Start of the line, for the positions.
+ * - char* ptr: Next character to read, nullptr at the end of the line.
+ * - uint8_t count: Number of fields returned.
+ * - uint8_t position: Position (from 1) of the last field returned in the line.
+ * - bool badQuote: Set if a quoted field was not terminated.
+ *
+ * @public
+ * - void begin(char* line): Start tokenizing a line.
+ * - bool next(char*& value): Get the next field. Returns false at the end of the line.
+ * - uint8_t Field(): Index (from 0) of the last field returned.
+ * - uint8_t Position(): Position (from 1) of the last field in the line, for the error messages.
+ * - bool IsBadQuote(): True if a quoted field was not terminated.
+ * - static bool isSkippable(const char* line): True for a blank line or a comment ('#').
+ */
+class CsvTokenizer {
+    private:
+        char* line = nullptr;
+        char* ptr = nullptr;
+        uint8_t count = 0;
+        uint8_t position = 0;
+        bool badQuote = false;
+
+    public:
+        void begin(char* l);
+        bool next(char*& value);
+
+        uint8_t Field() const { return count - 1; }
+        uint8_t Position() const { return position; }
+        bool IsBadQuote() const { return badQuote; }
+        static bool isSkippable(const char* line);
+};
+
+
+//* STRUCT CsvRow
+// fields of an instruction row, the name points into the line buffer
+struct CsvRow {
+    char* name = nullptr;
+    double target = 0;          // [C/F/K]
+    unsigned long hold = 0;     // [min]
+    double rate = 0;            // [/min]
+    bool waitForDoorOpen = false;
+    bool waitForButtonPress = false;
+    int8_t unit = CSV_NO_UNIT;  // unit of the row, if the program has a unit column
+};
+
+
+//* STRUCT CsvError
+// where and why a line was rejected
+struct CsvError {
+    uint8_t position = 0;       // position (from 1) of the field in the line
+    const char* message = "";
+};
+
+
+//* CLASS CsvLayout
+/**
+ * @class CsvLayout
+ * @brief Maps the columns of a program to the fields of its rows, from the header line.
+ *
+ * The header names are matched without case on their start, so "Target [C]" is the target:
+ * name, target | temp, hold | soak, rate | ramp, door, button, unit.
+ * The name, target, hold and rate columns are required. A header missing any of them
+ * is taken as a plain title, and the legacy fixed order is used.
+ *
+ * @private
+ * - uint8_t fields[CSV_COLUMNS]: Field of each column, CSV_NO_FIELD if absent.
+ *
+ * @public
+ * - void setDefault(): Use the legacy order: name,target,hold,rate,door,button.
+ * - bool parseHeader(char* line): Map the columns from a header line. Returns false if the legacy order is used.
+ * - bool HasUnit(): True if the rows carry their unit.
+ * - bool parseRow(char* line, CsvRow& row, CsvError& error, size_t nameSize): Parse an instruction row in place.
+ */
+class CsvLayout {
+    private:
+        uint8_t fields[CSV_COLUMNS];
+
+    public:
+        CsvLayout() { setDefault(); }
+        void setDefault();
+        bool parseHeader(char* line);
+        bool HasUnit() const { return fields[CSV_UNIT] != CSV_NO_FIELD; }
+        bool parseRow(char* line, CsvRow& row, CsvError& error, size_t nameSize) const;
+};
+
+
+// Convert a temperature, or a temperature difference (i.e. a rate), between units (0 C, 1 F, 2 K)
+double convertTemperature(double value, uint8_t from, uint8_t to, bool difference);
+
+
+#endif
@@ -10,6 +10,7 @@
 // ==== TEMPERATURE PROBE CLASS =====
 TemperatureProbe::TemperatureProbe() : sensor(PIN_SPI_SCK, PIN_PROBE_CS, PIN_SPI_MISO) {unit = CELSIUS;};
 TemperatureProbe::TemperatureProbe(TemperatureUnit u) : sensor(PIN_SPI_CLK, PIN_PROBE_CS, PIN_SPI_MISO) {unit = u;};
+TemperatureProbe::TemperatureProbe(uint8_t pin, TemperatureUnit u) : sensor(PIN_SPI_CLK, pin, PIN_SPI_MISO) {unit = u;};
 
 
 
@@ -40,6 +41,7 @@ double TemperatureProbe::readTemp(){
       if(errCount > MAX_N_ERROR_READINGS){
         sprintf(errorStreamChar, "Can't measure the temperature, check the wiring. Shutting off...");
         Serial.println(errorStreamChar);
+        fault = PROBE_NO_READING;
         return NAN;
       }
       delay(5); // delay to avoid reading too fast
@@ -51,15 +53,18 @@ double TemperatureProbe::readTemp(){
   if(temp > ERROR_TEMP){
     sprintf(errorStreamChar,"Temperature is too high. Shutting off to prevent damage...");
     Serial.println(errorStreamChar);
+    fault = PROBE_OVER_TEMP;
     return NAN;
   }
   else if(temp < MIN_TEMPERATURE){
     sprintf(errorStreamChar,"Temperature is too low. Possible damage to the probe. Shutting off...");
     Serial.println(errorStreamChar);
+    fault = PROBE_UNDER_TEMP;
     return NAN;
   }
 
   // temperture is within boundaries
+  fault = PROBE_OK;
   Serial.println("Temp reading complete.");
   if(unit == FAHRENHEIT) return toFarhenheit(temp);
   else if(unit == KELVIN) return temp + 273.15;
@@ -76,8 +81,25 @@ double TemperatureProbe::readTemp(){
 
 // ==== CORESYSTEM CLASS =====
 
-CoreSystem::CoreSystem(TemperatureProbe& _probe){
-  probe = _probe;
+// Probe chip select pins and heater stage pins of each zone, in firing order
+static const uint8_t probeCSPins[][3] = PROBE_CS_PINS;
+static const uint8_t heaterStagePins[][2] = HEATER_STAGE_PINS;
+static_assert(N_ZONES >= 1 && N_ZONES <= sizeof(probeCSPins) / sizeof(probeCSPins[0]), "N_ZONES does not match the probe pins");
+static_assert(PROBES_PER_ZONE >= 1 && PROBES_PER_ZONE <= sizeof(probeCSPins[0]), "PROBES_PER_ZONE does not match the probe pins");
+static_assert(N_ZONES <= sizeof(heaterStagePins) / sizeof(heaterStagePins[0]), "N_ZONES does not match the heater pins");
+static_assert(HEATER_STAGES >= 1 && HEATER_STAGES <= sizeof(heaterStagePins[0]), "HEATER_STAGES does not match the heater pins");
+// every probe must be sampled at least once per PWM cycle
+static_assert((unsigned long) N_ZONES * PROBES_PER_ZONE * PROBE_SAMPLE_SLOT <= CYCLE_TIME, "Too many probes for the PWM cycle time");
+// the black box keeps the heater stages in a byte, and the sample times in 16 bits
+static_assert(N_ZONES * HEATER_STAGES <= 8, "Too many heater stages for the black box");
+static_assert((CYCLE_TIME) <= UINT16_MAX && POLL_PROBE_INTERVAL <= UINT16_MAX, "Probe samples too far apart for the black box");
+#define ALL_PROBES ((1 << PROBES_PER_ZONE) - 1)
+
+CoreSystem::CoreSystem(){
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    for(uint8_t p = 0; p < PROBES_PER_ZONE; p++) zones[z].probes[p] = TemperatureProbe(probeCSPins[z][p], CELSIUS);
+  }
+  nextProbe = 0;
   status = IDLE;
   unit = CELSIUS;
   mode = NORMAL;
@@ -88,10 +110,7 @@ CoreSystem::CoreSystem(TemperatureProbe& _probe){
   ki = PWM_DEFAULT_KI;
   kd = PWM_DEFAULT_KD;
   PWMPeriod = CYCLE_TIME;
-  last_error = 0;
-  integral = 0;
   nextPWMCycle = 0;
-  dutyEnd = 0;
   allowFiringHeater = false;
   fireHeater = false;
   stabilityCounter = 0;
@@ -101,8 +120,11 @@ CoreSystem::CoreSystem(TemperatureProbe& _probe){
   isTuning = false;
 };
 
-CoreSystem::CoreSystem(TemperatureProbe& _probe, double _kp, double _ki, double _kd){
-  probe = _probe;
+CoreSystem::CoreSystem(double _kp, double _ki, double _kd){
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    for(uint8_t p = 0; p < PROBES_PER_ZONE; p++) zones[z].probes[p] = TemperatureProbe(probeCSPins[z][p], CELSIUS);
+  }
+  nextProbe = 0;
   status = IDLE;
   unit = CELSIUS;
   mode = NORMAL;
@@ -113,10 +135,7 @@ CoreSystem::CoreSystem(TemperatureProbe& _probe, double _kp, double _ki, double
   ki = _ki;
   kd = _kd;
   PWMPeriod = CYCLE_TIME;
-  last_error = 0;
-  integral = 0;
   nextPWMCycle = 0;
-  dutyEnd = 0;
   allowFiringHeater = false;
   fireHeater = false;
   stabilityCounter = 0;
@@ -126,19 +145,121 @@ CoreSystem::CoreSystem(TemperatureProbe& _probe, double _kp, double _ki, double
   isTuning = false;
 };
 
+// Initialize the probes and the heater pins (heaters are normally off)
+bool CoreSystem::begin(){
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    for(uint8_t i = 0; i < HEATER_STAGES; i++){
+      pinMode(heaterStagePins[z][i], OUTPUT);
+      digitalWrite(heaterStagePins[z][i], LOW);
+    }
+    for(uint8_t p = 0; p < PROBES_PER_ZONE; p++){
+      if(!zones[z].probes[p].begin()){
+        sprintf(errorStreamChar, "Could not initialize the temperature probe %c of zone %d.\n", 'A' + p, z + 1);
+        return false;
+      }
+    }
+  }
 
-double CoreSystem::PID(const double error){
-  integral += error;
-  double derivative = error - last_error;
-  dutyCycle = kp * error + ki * integral + kd * derivative;
+  // the learned oven model, if one has been saved (otherwise the defaults are kept)
+  OvenModel::Data saved;
+  EEPROM.get(EEPROM_ADDR_OVEN_MODEL, saved);
+  oven.load(saved);
+  return true;
+}
 
-  if(dutyCycle > 95){
-    dutyCycle = 100;
+// Save the learned oven model, only if it changed (the EEPROM wears out)
+void CoreSystem::saveOvenModel(){
+  if(oven.IsChanged()) EEPROM.put(EEPROM_ADDR_OVEN_MODEL, oven.Raw());
+}
+
+
+double CoreSystem::PID(ControlZone& zone, const double error){
+  zone.integral += error;
+  double derivative = error - zone.last_error;
+  zone.dutyCycle = kp * error + ki * zone.integral + kd * derivative;
+
+  if(zone.dutyCycle > 95){
+    zone.dutyCycle = 100;
   }
-  else if(dutyCycle < 5){
-    dutyCycle = 0;
+  else if(zone.dutyCycle < 5){
+    zone.dutyCycle = 0;
+  }
+  return zone.dutyCycle;
+}
+
+
+// Distribute the duty cycle of a zone over its heater stages and turn them on.
+// The duty cycle is a percentage of the total installed power, and the stages are filled in order:
+// small requests (fine control near the setpoint) are served by the lead bank alone, modulated over
+// the whole PWM period, while large requests (fast ramps) switch on the following banks too.
+void CoreSystem::fireStages(uint8_t z, unsigned long time){
+  ControlZone& zone = zones[z];
+  double power = zone.dutyCycle * HEATER_STAGES;   // requested power, in % of a single stage
+  zone.activeStages = 0;
+
+  for(uint8_t i = 0; i < HEATER_STAGES; i++){
+    double stageDuty = constrain(power - 100.0 * i, 0.0, 100.0);
+
+    // avoid pulses too short to be useful, they only wear the relays
+    if(stageDuty < MIN_STAGE_DUTY) stageDuty = 0;
+    else if(stageDuty > 100 - MIN_STAGE_DUTY) stageDuty = 100;
+
+    zone.stageDutyEnd[i] = time + (stageDuty * PWMPeriod / 100);
+    if(stageDuty > 0){
+      digitalWrite(heaterStagePins[z][i], HIGH);
+      zone.activeStages++;
+    }
+  }
+}
+
+// Turn off the heater stages whose duty cycle has ended
+void CoreSystem::releaseStages(){
+  unsigned long time = millis();
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    for(uint8_t i = 0; i < HEATER_STAGES; i++){
+      if(time > zones[z].stageDutyEnd[i]){
+        digitalWrite(heaterStagePins[z][i], LOW);
+      }
+    }
+  }
+}
+
+// Drive all the heater stages to the same level
+void CoreSystem::writeAllStages(uint8_t level){
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    for(uint8_t i = 0; i < HEATER_STAGES; i++){
+      digitalWrite(heaterStagePins[z][i], level);
+    }
+  }
+}
+
+// Turn off all the heater stages
+void CoreSystem::switchOffHeaters(){
+  writeAllStages(LOW);
+  for(uint8_t z = 0; z < N_ZONES; z++) zones[z].activeStages = 0;
+}
+
+// Number of heater stages fired in the current PWM cycle, over all the zones
+uint8_t CoreSystem::ActiveStages() const{
+  uint8_t stages = 0;
+  for(uint8_t z = 0; z < N_ZONES; z++) stages += zones[z].activeStages;
+  return stages;
+}
+
+// Set the temperature unit of the system and of all the probes.
+// On a change the readings are in the old unit: they are forgotten, and the probes read again
+// to restart the zones, the mean temperature and the filter in the new unit
+void CoreSystem::setUnit(TemperatureUnit _unit){
+  bool changed = _unit != unit;
+  unit = _unit;
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    for(uint8_t p = 0; p < PROBES_PER_ZONE; p++) zones[z].probes[p].setUnit(_unit);
+    if(changed){
+      zones[z].readProbes = 0;
+      for(uint8_t p = 0; p < PROBES_PER_ZONE; p++) zones[z].strikes[p] = 0;
+    }
   }
-  return dutyCycle;
+  if(changed) ReadTemperature();
 }
 
 
@@ -201,15 +322,58 @@ void CoreSystem::Clear(){
   currentTemperature = 0;
   dutyCycle = 0;
   lastTempReading = 0;
-  last_error = 0;
-  integral = 0;
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    zones[z].dutyCycle = 0;
+    zones[z].last_error = 0;
+    zones[z].integral = 0;
+    for(uint8_t i = 0; i < HEATER_STAGES; i++) zones[z].stageDutyEnd[i] = 0;
+    zones[z].activeStages = 0;
+  }
   nextPWMCycle = 0;
-  dutyEnd = 0;
   fireHeater = false;
   stabilityCounter = 0;
   isStable = false;
   lastDoorOpenTime = 0;
   isTuning = false;
+  recovering = false;
+  recoveryStart = 0;
+  holding = false;
+  load.clear();
+  kalman.clear();
+  heatwork.clear();
+}
+
+// True if no heater edge (start of the PWM cycle, end of the duty of a stage) is due within
+// PREFETCH_GUARD, so that a slow operation (i.e. an SD read) can't delay it
+bool CoreSystem::IsQuietWindow() const{
+  if(!IsOn()) return true;
+
+  unsigned long now = millis();
+  if((long)(nextPWMCycle - now) < PREFETCH_GUARD) return false;
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    for(uint8_t i = 0; i < HEATER_STAGES; i++){
+      long toEdge = (long)(zones[z].stageDutyEnd[i] - now);
+      if(toEdge >= 0 && toEdge < PREFETCH_GUARD) return false;
+    }
+  }
+  return true;
+}
+
+// Reset the statistics of the run, for its summary in the run index
+void CoreSystem::startRunStats(){
+  peakTemperature = FilteredTemperature();
+  maxOvershoot = 0;
+  lastCycleTarget = targetTemperature;
+  energy = 0;
+}
+
+// Hold the current target, under the regular PID control, and reset the hold statistics
+void CoreSystem::startHold(){
+  holding = true;
+  holdStart = millis();
+  lastHoldCheck = holdStart;
+  holdInBand = 0;
+  holdMaxDeviation = 0;
 }
 
 void CoreSystem::setTarget(double target, bool newInstruction){
@@ -223,18 +387,236 @@ void CoreSystem::setTarget(double target, bool newInstruction){
   }
 }
 
-void CoreSystem::ReadTemperature(){
-  double temp = probe.readTemp();
+// Read a probe of a zone and update the vote of the zone.
+// Returns false if the zone has no working probe left, or if the probe detected an over temperature.
+bool CoreSystem::readProbe(uint8_t z, uint8_t p){
+  ControlZone& zone = zones[z];
+  double temp = zone.probes[p].readTemp();
 
   // check if the temperature is a NaN
-  if(!isnan(temp)){
-    currentTemperature = temp;
-    lastTempReading = millis();
-    return;
+  if(isnan(temp)){
+    // an over temperature must stop the system, whatever the other probes say
+    if(zone.probes[p].Fault() == PROBE_OVER_TEMP) return false;
+
+    dropProbe(z, p, "no valid reading");
+    voteZone(z, PROBES_PER_ZONE);
+    return zone.failedProbes != ALL_PROBES;
+  }
+
+  zone.readings[p] = temp;
+  zone.readProbes |= (1 << p);
+  voteZone(z, p);
+  zone.lastReading = millis();
+  return true;
+}
+
+// Exclude a failing probe from the vote, and report it
+void CoreSystem::dropProbe(uint8_t z, uint8_t p, const char* reason){
+  ControlZone& zone = zones[z];
+  zone.failedProbes |= (1 << p);
+  zone.readProbes &= ~(1 << p);
+
+  // with a single probe there is nothing to degrade to, the caller will stop the system
+  if(zone.failedProbes == ALL_PROBES) return;
+
+  char message[64];
+  snprintf(message, sizeof(message), "EVENT: Zone %d probe %c dropped (%s), degraded mode", z + 1, 'A' + p, reason);
+  #ifdef SERIAL_COMMS
+      Serial.println(message);
+  #endif
+  logEvent(message);
+}
+
+// Vote the temperature of a zone from the readings of its working probes:
+// - 3 probes: the median, probes far from it for PROBE_MAX_STRIKES readings in a row are dropped
+// - 2 probes: the mean if they agree, otherwise the highest reading, so the zone is never overheated
+// - 1 probe:  its reading
+// Only the probe just read (p, PROBES_PER_ZONE for none) is checked against the vote: the strikes
+// count its own readings, not the votes triggered by the other probes of the zone
+void CoreSystem::voteZone(uint8_t z, uint8_t p){
+  ControlZone& zone = zones[z];
+  double values[PROBES_PER_ZONE];
+  double tolerance = convertTemperature(PROBE_AGREEMENT_TOL, CELSIUS, unit, true);
+  uint8_t n = 0;
+
+  // collect the readings, sorted (insertion sort, at most 3 values)
+  for(uint8_t q = 0; q < PROBES_PER_ZONE; q++){
+    if(!(zone.readProbes & (1 << q))) continue;
+    uint8_t i = n++;
+    while(i > 0 && values[i - 1] > zone.readings[q]){
+      values[i] = values[i - 1];
+      i--;
+    }
+    values[i] = zone.readings[q];
+  }
+
+  if(n == 0) return;
+  else if(n == 1) zone.temperature = values[0];
+  else if(n == 2){
+    if(values[1] - values[0] <= tolerance) zone.temperature = (values[0] + values[1]) / 2;
+    else zone.temperature = values[1];
+  }
+  else zone.temperature = values[1];
+
+  // with a reliable median, strike out the probe just read if it disagrees with it
+  if(n < 3 || p >= PROBES_PER_ZONE || !(zone.readProbes & (1 << p))) return;
+  if(fabs(zone.readings[p] - zone.temperature) > tolerance){
+    if(++zone.strikes[p] >= PROBE_MAX_STRIKES) dropProbe(z, p, "disagreement");
+  }
+  else zone.strikes[p] = 0;
+}
+
+// True if any probe has been dropped
+bool CoreSystem::IsDegraded() const{
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    if(zones[z].failedProbes) return true;
   }
+  return false;
+}
+
+// Report an event on the log file, if a program is running
+void CoreSystem::logEvent(const char* message){
+  extern ProgramManager __program;
+  extern LogWriter __logWriter;
+  if(__program.IsSelected() && keepLog && __logWriter.IsOpen()){
+    updateLog(__logWriter, message, __program.elapsedTime());
+  }
+}
+
+// Write a log record, if the log policy finds one due: while a program runs, also when the
+// heaters are off (door open, hold, error), with the state of the heaters in the flags
+void CoreSystem::logSample(unsigned long time){
+  extern ProgramManager __program;
+  if(!keepLog || mode != NORMAL || !__program.IsSelected() || status == IDLE || status == END) return;
+
+  uint16_t instruction = __program.InstructionIndex();
+  uint8_t flags = (IsOn() ? TKL_HEATER_ON : 0) | (isStable ? TKL_STABLE : 0) |
+                  (__program.IsSoaking() ? TKL_SOAKING : 0) | (holding ? TKL_HOLDING : 0);
+  if(__logPolicy.isDue(currentTemperature, targetTemperature, dutyCycle, instruction, flags, time)){
+    updateLog(__logWriter, __program.CurrentInstructionName(), time, currentTemperature, targetTemperature, dutyCycle);
+    __logPolicy.recorded(currentTemperature, targetTemperature, dutyCycle, instruction, flags, time);
+  }
+}
+
+// Add the last sample of a probe to the black box, with the state of the heaters:
+// the stages are fired in order, a stage is on until the end of its duty cycle
+void CoreSystem::recordBlackBox(uint8_t z, uint8_t p, bool measured){
+  unsigned long time = millis();
+  uint8_t heaters = 0;
+  for(uint8_t zz = 0; zz < N_ZONES; zz++){
+    for(uint8_t i = 0; i < zones[zz].activeStages; i++){
+      if(time <= zones[zz].stageDutyEnd[i]) heaters |= 1 << (zz * HEATER_STAGES + i);
+    }
+  }
+  __blackBox.record(time, z * PROBES_PER_ZONE + p, measured ? zones[z].readings[p] : NAN,
+                    FilteredTemperature(), IsOn() ? dutyCycle : 0, heaters, status);
+}
+
+// Write the black box to a crash dump, with the error and the log of the run.
+// Only the first call writes, the following samples are not recorded anymore
+bool CoreSystem::dumpBlackBox(){
+  extern LogManager __logManager;
+  extern LogWriter __logWriter;
+  return __blackBox.dump(errorStreamChar, __logWriter.IsOpen() ? __logManager.CurrentSequence() : 0, unit);
+}
+
+// The control temperature is the mean temperature of the zones
+void CoreSystem::updateMeanTemperature(){
+  double sum = 0;
+  for(uint8_t z = 0; z < N_ZONES; z++) sum += zones[z].temperature;
+  currentTemperature = sum / N_ZONES;
+}
+
+// Read all the probes at once (i.e. at startup)
+void CoreSystem::ReadTemperature(){
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    for(uint8_t p = 0; p < PROBES_PER_ZONE; p++){
+      if(zones[z].failedProbes & (1 << p)) continue;
+      // if the zone can't be measured anymore, a critical error occurred
+      if(!readProbe(z, p)) CriticalError();
+    }
+  }
+  updateMeanTemperature();
+  lastTempReading = millis();
+  startFilter();
+}
+
+// Start the Kalman filter from the mean temperature. Its model is in C: the ambient toward which
+// the oven cools is a constant, not the first reading, so that a restart on a hot oven (i.e. at
+// the end of a program, or after a change of unit) still predicts the cooling
+void CoreSystem::startFilter(){
+  kalman.begin(currentTemperature, lastTempReading, convertTemperature(KALMAN_AMBIENT, CELSIUS, unit, false),
+               convertTemperature(1, CELSIUS, unit, true));
+}
+
+// Round-robin sampler: the probes share the SPI bus, so a single probe is read in each time slot,
+// skipping the dropped ones. While firing each probe is sampled every N_ZONES * PROBES_PER_ZONE *
+// PROBE_SAMPLE_SLOT ms, which is bounded by the PWM cycle time, otherwise the whole chamber is
+// polled every POLL_PROBE_INTERVAL ms. On hold, the probes are only sampled once per PWM cycle.
+// Each slot also steps the Kalman filter, which coasts on its model when the reading is missing.
+void CoreSystem::sampleProbes(){
+  const uint8_t nProbes = N_ZONES * PROBES_PER_ZONE;
+  unsigned long slot = IsOn() ? PROBE_SAMPLE_SLOT : POLL_PROBE_INTERVAL / nProbes;
+  if(holding) slot = PWMPeriod / nProbes;
+  if(millis() - lastTempReading < slot) return;
+
+  // find the next working probe
+  bool measured = false;
+  uint8_t probe = nProbes;
+  for(uint8_t i = 0; i < nProbes; i++){
+    uint8_t z = nextProbe / PROBES_PER_ZONE;
+    uint8_t p = nextProbe % PROBES_PER_ZONE;
+    nextProbe = (nextProbe + 1) % nProbes;
+    if(zones[z].failedProbes & (1 << p)) continue;
+
+    // if the zone can't be measured anymore, a critical error occurred: the failing sample
+    // is the last one of the black box
+    if(!readProbe(z, p)){
+      recordBlackBox(z, p, false);
+      CriticalError();
+    }
+    measured = zones[z].readProbes & (1 << p);
+    probe = z * PROBES_PER_ZONE + p;
+    break;
+  }
+
+  updateMeanTemperature();
+  lastTempReading = millis();
+
+  // every sample goes in the window of the log, a fast change is logged at once
+  if(keepLog){
+    __logPolicy.sample(currentTemperature);
+    logSample(lastTempReading);
+  }
+
+  // step the filter
+  bool stepped = kalman.IsInitialized();
+  if(stepped){
+    kalman.predict(IsOn() ? dutyCycle / 100.0 : 0, lastTempReading);
+    if(measured) kalman.update(currentTemperature);
+  }
+  else if(measured) startFilter();
+
+  // every sample goes in the black box, with the filtered temperature it led to
+  if(probe < nProbes) recordBlackBox(probe / PROBES_PER_ZONE, probe % PROBES_PER_ZONE, measured);
+  if(!stepped) return;
 
-  // if the temperature is a NaN, a critical error occurred
-  CriticalError();
+  // the heatwork keeps accumulating with the heaters off (i.e. door open)
+  heatwork.update(toKelvin(FilteredTemperature()), lastTempReading);
+
+  // learn the capability of the oven (in C), an open door says nothing about it
+  if(IsDoorOpen()) oven.interrupt();
+  else oven.learn(toKelvin(FilteredTemperature()) - 273.15, convertTemperature(HeatingRate(), unit, CELSIUS, true),
+                  IsOn() ? dutyCycle / 100.0 : 0, lastTempReading);
+}
+
+// Convert a temperature from the system unit to Kelvin
+double CoreSystem::toKelvin(double temp) const{
+  switch(unit){
+    case FAHRENHEIT:  return (temp - 32) * 5.0/9.0 + 273.15;
+    case KELVIN:      return temp;
+    default:          return temp + 273.15;
+  }
 }
 
 void CoreSystem::CriticalError(){
@@ -243,15 +625,18 @@ void CoreSystem::CriticalError(){
   status = ERROR;
 
   // turn off the heater
-  digitalWrite(PIN_HEATER, LOW);
+  switchOffHeaters();
   allowFiringHeater = false;
 
+  // the last samples, before the log is closed: the error stream still holds the error
+  dumpBlackBox();
+
   // if we are running a program, log the critical error
   extern ProgramManager __program;
   if(__program.IsSelected() && keepLog){
-    extern File *__file;  // log file
-    updateLog(*__file, errorStreamChar, __program.elapsedTime()); 
-    closeLog(*__file, __program);
+    extern LogWriter __logWriter;  // log file
+    updateLog(__logWriter, errorStreamChar, __program.elapsedTime()); 
+    closeLog(__logWriter, __program, ERROR);
   };
 
   // display error screen
@@ -268,15 +653,76 @@ void CoreSystem::CriticalError(){
 
 // ===================================================================================
 
+// ==== RAMP GENERATOR CLASS =====
+
+// Start a ramp from a temperature to a target. A null rate means a step to the target.
+void RampGenerator::start(double f, double t, double r, unsigned long time){
+  from = f;
+  to = t;
+  startTime = time;
+  pausedTime = 0;
+  pauseStart = 0;
+
+  // the ramp always moves toward the target, whatever the sign in the program
+  r = abs(r);
+  if(r == 0 || f == t){
+    rate = 0;
+    return;
+  }
+  rate = (t > f) ? r : -r;
+  duration = (t - f) / rate;
+  blend = min((double) RAMP_BLEND_TIME, 2 * duration);
+}
+
+void RampGenerator::resume(unsigned long time){
+  if(pauseStart == 0) return;
+  pausedTime += time - pauseStart;
+  pauseStart = 0;
+}
+
+// Time elapsed in the ramp, pauses excluded [min]
+double RampGenerator::elapsed(unsigned long time) const{
+  if(pauseStart != 0) time = pauseStart;
+  return (time - startTime - pausedTime) / 60000.0;
+}
+
+// Setpoint of the ramp: linear, then a blend into the target.
+// S-curve: the speed falls as 1 - (3s^2 - 2s^3) over the blend (s from 0 to 1), so the acceleration
+// is 0 at both ends and the jerk is bounded (6 rate / blend^2); its peak is 1.5 rate / blend.
+// Parabola: constant acceleration rate / blend, which steps at both ends of the blend.
+// Both cover the same distance, the blend ends at the target
+double RampGenerator::Setpoint(unsigned long time) const{
+  if(rate == 0) return to;
+
+  double t = elapsed(time);
+  double blendStart = duration - blend / 2;
+  double blendEnd = duration + blend / 2;
+
+  if(t < blendStart) return from + rate * t;
+  if(t < blendEnd){
+#ifdef RAMP_SCURVE_BLEND
+    double s = (t - blendStart) / blend;
+    return from + rate * blendStart + rate * blend * (s - s * s * s + s * s * s * s / 2);
+#else
+    return to - rate * (blendEnd - t) * (blendEnd - t) / (2 * blend);
+#endif
+  }
+  return to;
+}
+
 // ==== PROGRAM MANAGER CLASS =====
 
+static_assert(sizeof(Instruction) == sizeof(TkpRecord), "Instruction must match the compiled program records");
+
 ProgramManager::ProgramManager(){
   strncpy(programName, "", MAX_FILENAME_LENGTH);
+  namePool[0] = '\0';
   numOfInstructions = 0;
   instructionIndex = 0;
   progStartTime = 0;
   instrStartTime = 0;
   soakTimeStart = 0;
+  soakPauseStart = 0;
   soakTimeEnd = 0;
   isSoaking = false;
   targetReached = false;
@@ -284,7 +730,7 @@ ProgramManager::ProgramManager(){
 };
 
 // Add an instruction to the program
-bool ProgramManager::addInstruction(Instruction instr) {
+bool ProgramManager::addInstruction(const Instruction& instr) {
   if(numOfInstructions < MAX_INSTRUCTIONS_PER_PROGRAM) {
     instructions[numOfInstructions] = instr;
     numOfInstructions++;
@@ -297,7 +743,9 @@ bool ProgramManager::addInstruction(Instruction instr) {
 };
 // --------------------------------------------------------------------------------------------
 
-// Parse the CSV file and load the program into the program manager
+// Parse the CSV file and load the program into the program manager.
+// Programs longer than MAX_INSTRUCTIONS_PER_PROGRAM are streamed: the file is kept open, and only
+// the current and the next instruction are kept in RAM, with the offsets of the repeat blocks.
 bool ProgramManager::loadProgram(File& file) {
     // Check if the file is valid
     if (!file) {
@@ -313,145 +761,486 @@ bool ProgramManager::loadProgram(File& file) {
     file.getName(fileName, MAX_FILENAME_LENGTH - 1);
     setName(fileName);
 
-    // Skip the CSV header
-    skipLine(file);
+    // compiled programs have their own loader, any other file is read as CSV
+    size_t nameLength = strlen(fileName);
+    if (nameLength > 4 && strcasecmp(fileName + nameLength - 4, TKP_EXTENSION) == 0) return loadCompiled(file);
 
-    // Buffers and variables for parsing
+    // Buffers for parsing
     char lineBuffer[128];            // Buffer for a single CSV line
-    char name[MAX_INSTR_NAME_LENGHT]; // Instruction name buffer
-    double target = 0, rampRate = 0;
-    unsigned long holdTime = 0;
-    bool waitForDoorOpen = false, waitForButtonPress = false;
-
-    // Read and parse each line until the end of the file or max instructions reached
-    while (file.available() && numOfInstructions < MAX_INSTRUCTIONS_PER_PROGRAM) {
+    char name[MAX_INSTR_NAME_LENGHT];
+    Instruction instr;
+    CsvError error;
+    unsigned int lineNumber = 1;
+
+    // The header maps the columns, a header without the known column names is skipped
+    if (!readLine(file, lineBuffer, sizeof(lineBuffer))) {
+        sprintf(errorStreamChar, "ERROR: Line 1 too long.\n");
+        file.close();
+        return false;
+    }
+    layout.parseHeader(lineBuffer);
+    dataStart = file.curPosition();
+
+    // Read and parse each line until the end of the file. The instructions that fit are kept.
+    // A full name pool is only an error if the program fits in RAM: a streamed program
+    // discards these names, each slot of its window gets its own area of the pool
+    unsigned int count = 0;
+    bool namesOverflow = false;
+    while (file.available()) {
         // Read a line from the CSV
+        lineNumber++;
         if (!readLine(file, lineBuffer, sizeof(lineBuffer))) {
-            sprintf(errorStreamChar, "ERROR: Malformed CSV file.\n");
+            sprintf(errorStreamChar, "ERROR: Line %u too long.\n", lineNumber);
             file.close();
             return false;
         }
+        if (CsvTokenizer::isSkippable(lineBuffer)) continue;
+
+        // Program options are given as "@key,value" lines
+        if (lineBuffer[0] == '@') {
+            if (!parseOption(lineBuffer)) {
+                sprintf(errorStreamChar, "ERROR: Line %u: invalid option.\n", lineNumber);
+                file.close();
+                return false;
+            }
+            continue;
+        }
 
-        // Parse the CSV line into individual fields
-        if (!parseCSVLine(
-                lineBuffer, name, sizeof(name),
-                &target, &holdTime, &rampRate,
-                &waitForDoorOpen, &waitForButtonPress)) {
-            sprintf(errorStreamChar, "ERROR: Invalid data in line: %s\n", lineBuffer);
+        // Parse the CSV line into an instruction
+        if (!parseInstruction(lineBuffer, instr, name, error)) {
+            sprintf(errorStreamChar, "ERROR: Line %u col %u: %s.\n", lineNumber, error.position, error.message);
             file.close();
             return false;
         }
 
-        // Add the instruction to the program
-        if (!addInstruction(name, holdTime * MINUTE, target, rampRate, waitForDoorOpen, waitForButtonPress)) {
-            sprintf(errorStreamChar, "ERROR: Could not add instruction.\n");
+        // Add the instruction to the program, as long as it fits
+        if (count < MAX_INSTRUCTIONS_PER_PROGRAM) {
+            if (!namesOverflow && !internName(name, instr.nameOffset)) namesOverflow = true;
+            addInstruction(instr);
+        }
+        count++;
+    }
+    numOfInstructions = count;
+
+    // the repeat blocks can only be checked once all the instructions are known
+    if (numOfInstructions == 0) {
+        sprintf(errorStreamChar, "ERROR: Empty program.\n");
+        file.close();
+        return false;
+    }
+    if (!checkRepeats()) {
+        sprintf(errorStreamChar, "ERROR: Invalid repeat block.\n");
+        file.close();
+        return false;
+    }
+
+    // the program fits in RAM, the file is not needed anymore
+    if (numOfInstructions <= MAX_INSTRUCTIONS_PER_PROGRAM) {
+        if (namesOverflow) {
+            sprintf(errorStreamChar, "ERROR: Instruction names too long.\n");
             file.close();
             return false;
         }
+        file.close();
+        isSelected = true;
+        return true;
+    }
+
+    // streamed program: remember where the repeat blocks start
+    streaming = true;
+    file.seekSet(dataStart);
+    count = 0;
+    while (file.available()) {
+        uint32_t offset = file.curPosition();
+        readLine(file, lineBuffer, sizeof(lineBuffer));
+        if (lineBuffer[0] == '@' || CsvTokenizer::isSkippable(lineBuffer)) continue;
+        for (uint8_t i = 0; i < numOfRepeats; i++) {
+            if (repeats[i].first == count) repeats[i].offset = offset;
+        }
+        count++;
     }
 
-    // Close the file and return success
-    file.close();
+    // keep the file, and fill the window with the first two instructions.
+    // Each slot of the window gets its own area of the name pool.
+    source = file;
+    streamIndex = numOfInstructions;    // force a seek at the first read
+    namePoolUsed = 1;
+    if (!readInstruction(0, 0)) return false;
+    windowIndex[0] = 0;
+    windowIndex[1] = numOfInstructions;     // empty slot
+    prefetchPending = true;
+    prefetch();
+
     isSelected = true;
     return true;
 }
 
-// Skip a line
-void ProgramManager::skipLine(File& file) {
-    while (file.available()) {
-        if (file.read() == '\n') break;
+// Load a compiled program (see TEEK_programFormat.h).
+// The records that fit in RAM are read in a single block, the rest of a longer program is only
+// checksummed, and streamed later with a seek per record.
+bool ProgramManager::loadCompiled(File& file) {
+    TkpHeader header;
+    if (file.read(&header, sizeof(header)) != sizeof(header) || memcmp(header.magic, TKP_MAGIC, 3) != 0) {
+        sprintf(errorStreamChar, "ERROR: Not a compiled program.\n");
+        file.close();
+        return false;
     }
+    if (header.version != TKP_VERSION) {
+        sprintf(errorStreamChar, "ERROR: Unsupported program version %d.\n", header.version);
+        file.close();
+        return false;
+    }
+    if (header.numOfInstructions == 0 || header.numOfRepeats > MAX_REPEAT_BLOCKS || header.unit > KELVIN ||
+        header.nameBytes == 0 || header.nameBytes > INSTR_NAME_POOL_SIZE) {
+        sprintf(errorStreamChar, "ERROR: Invalid program header.\n");
+        file.close();
+        return false;
+    }
+
+    uint32_t crc = 0;
+    bool complete = true;
+
+    // repeat blocks
+    for (uint8_t i = 0; i < header.numOfRepeats; i++) {
+        TkpRepeat block;
+        complete &= file.read(&block, sizeof(block)) == sizeof(block);
+        crc = tkpCrc32(crc, &block, sizeof(block));
+        repeats[i].first = block.first;
+        repeats[i].last = block.last;
+        repeats[i].times = block.times;
+    }
+    numOfRepeats = header.numOfRepeats;
+
+    // name pool
+    complete &= file.read(namePool, header.nameBytes) == header.nameBytes;
+    crc = tkpCrc32(crc, namePool, header.nameBytes);
+    namePoolUsed = header.nameBytes;
+
+    // records, straight into the program
+    numOfInstructions = header.numOfInstructions;
+    dataStart = file.curPosition();
+    size_t size = min(numOfInstructions, (unsigned int) MAX_INSTRUCTIONS_PER_PROGRAM) * sizeof(Instruction);
+    complete &= file.read(instructions, size) == (int) size;
+    crc = tkpCrc32(crc, instructions, size);
+
+    // the records of a streamed program that don't fit are only checksummed
+    uint32_t rest = (uint32_t) numOfInstructions * sizeof(Instruction) - size;
+    uint8_t buffer[32];
+    while (complete && rest > 0) {
+        size_t n = min(rest, (uint32_t) sizeof(buffer));
+        complete = file.read(buffer, n) == (int) n;
+        crc = tkpCrc32(crc, buffer, n);
+        rest -= n;
+    }
+
+    if (!complete || file.available() || crc != header.crc) {
+        sprintf(errorStreamChar, "ERROR: Corrupted program (CRC).\n");
+        file.close();
+        return false;
+    }
+
+    // a CRC only proves the file is intact, not that it is valid: a stale or hand made program
+    // is checked like any input, the records in RAM here, the streamed ones as they are read
+    programUnit = (TemperatureUnit) header.unit;
+    HeatworkIntegrator check;
+    bool valid = namePool[0] == '\0' && namePool[header.nameBytes - 1] == '\0' && checkRepeats() &&
+                 (header.cone == 0 || check.begin(header.cone, 0));
+    for (unsigned int i = 0; valid && i < min(numOfInstructions, (unsigned int) MAX_INSTRUCTIONS_PER_PROGRAM); i++) {
+        valid = validRecord(instructions[i]);
+    }
+    if (!valid) {
+        sprintf(errorStreamChar, "ERROR: Invalid compiled program.\n");
+        file.close();
+        return false;
+    }
+
+    hasUnit = true;
+    loadThickness = header.thickness / 10.0;
+    coreSoak = header.coreSoak;
+    cone = header.cone;
+    compiled = true;
+
+    if (numOfInstructions <= MAX_INSTRUCTIONS_PER_PROGRAM) {
+        file.close();
+        isSelected = true;
+        return true;
+    }
+
+    // streamed program: the first two records are already in the window
+    streaming = true;
+    source = file;
+    windowIndex[0] = 0;
+    windowIndex[1] = 1;
+    prefetchPending = false;
+    isSelected = true;
+    return true;
 }
 
-// get a line from a file
-bool ProgramManager::readLine(File& file, char* buffer, size_t bufferSize) {
-    size_t i = 0;
-    while (file.available() && i < bufferSize - 1) {
-        char c = file.read();
-        if (c == '\n') break; // End of line
-        buffer[i++] = c;
+// Check a record of a compiled program: the name starts in the pool, the target and the rate
+// are within the range of the CSV loader, and the target is not below the absolute zero.
+// A target above MAX_TEMPERATURE is left to the preflight, which reports it as for a CSV program
+bool ProgramManager::validRecord(const Instruction& instr) const {
+    return instr.nameOffset < namePoolUsed &&
+           instr.target != INT16_MIN && instr.rate != INT16_MIN &&
+           convertTemperature(instr.Target(), programUnit, KELVIN, false) >= 0;
+}
+
+// Parse a CSV line (in place) into an instruction. The name (MAX_INSTR_NAME_LENGHT buffer) is
+// returned apart, the caller decides where to keep it.
+bool ProgramManager::parseInstruction(char* line, Instruction& instr, char* name, CsvError& error) {
+    CsvRow row;
+    if (!layout.parseRow(line, row, error, MAX_INSTR_NAME_LENGHT)) return false;
+
+    // with a unit column, the program takes the unit of its first row, the others are converted
+    if (layout.HasUnit()) {
+        if (!hasUnit) {
+            programUnit = (row.unit == CSV_NO_UNIT) ? CELSIUS : (TemperatureUnit) row.unit;
+            hasUnit = true;
+        }
+        if (row.unit != CSV_NO_UNIT) {
+            row.target = convertTemperature(row.target, row.unit, programUnit, false);
+            row.rate = convertTemperature(row.rate, row.unit, programUnit, true);
+            if (abs(row.target) > INT16_MAX / 10 || abs(row.rate) > INT16_MAX / 10) {
+                error.message = "value out of range";
+                return false;
+            }
+        }
     }
-    buffer[i] = '\0'; // Null-terminate the line
-    return (i > 0);   // Return true if any data was read
+
+    strcpy(name, row.name);
+    instr.target = lround(row.target * 10);
+    instr.rate = lround(row.rate * 10);
+    instr.soak = row.hold;
+    instr.flags = (row.waitForDoorOpen ? Instruction::WAIT_DOOR_OPEN : 0) | (row.waitForButtonPress ? Instruction::WAIT_BUTTON_PRESS : 0);
+    instr.nameOffset = 0;
+    return true;
 }
 
-// Parse a line and extract the instruction fields
-bool ProgramManager::parseCSVLine(
-    const char* line,
-    char* name, size_t nameSize,
-    double* target, unsigned long* holdTime, double* rampRate,
-    bool* waitForDoorOpen, bool* waitForButtonPress) {
-    
-    // Temporary buffer for numeric fields
-    char tempBuffer[16];
-    size_t tempIndex = 0;
-
-    // Pointers for traversing the line
-    const char* ptr = line;
-    const char* start = ptr;
-
-    // Parse the instruction name
-    tempIndex = 0;
-    while (*ptr != ',' && *ptr != '\0') {
-        if (tempIndex < nameSize - 1) {
-            name[tempIndex++] = *ptr++;
-        } else {
-            return false; // Name too long
+// Store a name in the pool, sharing the copy of an identical name (i.e. repeated "Soak" steps).
+// Returns false if the pool is full.
+bool ProgramManager::internName(const char* name, uint8_t& offset) {
+    if (name[0] == '\0') {
+        offset = 0;
+        return true;
+    }
+    for (uint8_t i = 1; i < namePoolUsed; i += strlen(namePool + i) + 1) {
+        if (strcmp(namePool + i, name) == 0) {
+            offset = i;
+            return true;
         }
     }
-    name[tempIndex] = '\0'; // Null-terminate the name
-    if (*ptr++ != ',') return false; // Move past ',' or fail
 
-    // Parse the target temperature
-    start = ptr;
-    ptr = extractField(ptr, tempBuffer, sizeof(tempBuffer));
-    *target = atof(tempBuffer);
+    size_t len = strlen(name) + 1;
+    if (namePoolUsed + len > INSTR_NAME_POOL_SIZE) return false;
+    memcpy(namePool + namePoolUsed, name, len);
+    offset = namePoolUsed;
+    namePoolUsed += len;
+    return true;
+}
 
-    // Parse the hold time
-    start = ptr;
-    ptr = extractField(ptr, tempBuffer, sizeof(tempBuffer));
-    *holdTime = atol(tempBuffer);
+// Read an instruction of a streamed program from the file, into a slot of the window.
+// The instructions are read in sequence, a jump is only possible to the start of a repeat block.
+bool ProgramManager::readInstruction(unsigned int index, uint8_t slot) {
+    // compiled program: fixed size records, the names are all in the pool
+    if (compiled) {
+        source.seekSet(dataStart + (uint32_t) index * sizeof(Instruction));
+        if (source.read(&instructions[slot], sizeof(Instruction)) == sizeof(Instruction) &&
+            validRecord(instructions[slot])) return true;
 
-    // Parse the ramp rate
-    start = ptr;
-    ptr = extractField(ptr, tempBuffer, sizeof(tempBuffer));
-    *rampRate = atof(tempBuffer);
+        sprintf(errorStreamChar, "ERROR: Program file read failed.\n");
+        return false;
+    }
 
-    // Parse the waitForDoorOpen flag
-    *waitForDoorOpen = (*ptr == '1');
-    ptr += 2; // Move past the flag and comma
+    char lineBuffer[128];
+    char* name = namePool + 1 + slot * MAX_INSTR_NAME_LENGHT;
+    CsvError error;
 
-    // Parse the waitForButtonPress flag
-    *waitForButtonPress = (*ptr == '1');
+    if (index != streamIndex) {
+        // jump back to the start of a repeat block, or read forward from the current position.
+        // Anything else means rewinding the file.
+        int8_t block = -1;
+        for (uint8_t i = 0; i < numOfRepeats; i++) {
+            if (repeats[i].first == index) block = i;
+        }
+        if (block >= 0) {
+            source.seekSet(repeats[block].offset);
+            streamIndex = index;
+        }
+        else if (index < streamIndex) {
+            source.seekSet(dataStart);
+            streamIndex = 0;
+        }
+    }
 
-    return true; // Parsing successful
+    // read forward up to the requested instruction, skipping the options
+    while (source.available()) {
+        if (!readLine(source, lineBuffer, sizeof(lineBuffer))) break;
+        if (lineBuffer[0] == '@' || CsvTokenizer::isSkippable(lineBuffer)) continue;
+        if (streamIndex++ != index) continue;
+        if (!parseInstruction(lineBuffer, instructions[slot], name, error)) break;
+        instructions[slot].nameOffset = name - namePool;
+        return true;
+    }
+
+    sprintf(errorStreamChar, "ERROR: Program file read failed.\n");
+    return false;
+}
+
+// Read the next instruction of a streamed program in the free slot of the window
+bool ProgramManager::prefetch() {
+    // if the prefetch didn't happen in time, the current instruction is read first
+    if (!IsWindowReady()) {
+        if (!readInstruction(instructionIndex, 0)) return false;
+        windowIndex[0] = instructionIndex;
+    }
+    if (!prefetchPending) return true;
+    prefetchPending = false;
+
+    unsigned int next = followingInstruction();
+    if (next >= numOfInstructions) return true;     // last instruction, nothing to read
+
+    uint8_t slot = (windowIndex[0] == instructionIndex) ? 1 : 0;
+    if (!readInstruction(next, slot)) return false;
+    windowIndex[slot] = next;
+    return true;
 }
 
-// Extract a field from a CSV line into a buffer
-const char* ProgramManager::extractField(const char* line, char* buffer, size_t bufferSize) {
+// Repeat block ending on the current instruction with executions left, the innermost one. -1 if none
+int8_t ProgramManager::pendingRepeat() const {
+    int8_t block = -1;
+    for (uint8_t i = 0; i < numOfRepeats; i++) {
+        const RepeatBlock& b = repeats[i];
+        if (b.last != instructionIndex || b.iteration + 1 >= b.times) continue;
+        if (block < 0 || b.first > repeats[block].first) block = i;
+    }
+    return block;
+}
+
+// Index of the instruction that follows the current one, numOfInstructions if none
+unsigned int ProgramManager::followingInstruction() const {
+    int8_t block = pendingRepeat();
+    if (block >= 0) return repeats[block].first;
+    return instructionIndex + 1;
+}
+
+// The current instruction, in the array or in the window of a streamed program
+const Instruction& ProgramManager::current() const {
+    if (!streaming) return instructions[instructionIndex];
+    return (windowIndex[1] == instructionIndex) ? instructions[1] : instructions[0];
+}
+
+// Get a line from a file, without its end of line.
+// Returns false if the line doesn't fit the buffer, the rest of the line is skipped.
+bool ProgramManager::readLine(File& file, char* buffer, size_t bufferSize) {
     size_t i = 0;
-    while (*line != ',' && *line != '\0' && i < bufferSize - 1) {
-        buffer[i++] = *line++;
+    bool fits = true;
+    while (file.available()) {
+        char c = file.read();
+        if (c == '\n') break; // End of line
+        if (i < bufferSize - 1) buffer[i++] = c;
+        else fits = false;
     }
-    buffer[i] = '\0'; // Null-terminate the buffer
-    if (*line == ',') line++; // Consume the comma
-    return line;
+    buffer[i] = '\0'; // Null-terminate the line
+    return fits;
 }
 
+// Parse a program option line, in the "@key,value" format:
+// - @thickness,<mm>  thickness of the workpiece, enables the core temperature estimator
+// - @coresoak,<0|1>  time the soaks on the estimated core temperature, instead of the chamber's: a soak
+//                    starts once the core reaches the target, and its timer stops while the core is out of band
+// - @cone,<cone>     fire to an Orton cone (i.e. 06), the last soak ends when its heatwork is reached
+// - @repeat,<first>,<last>,<times>  execute the instructions first..last (from 1) the given times
+bool ProgramManager::parseOption(char* line) {
+    CsvTokenizer tok;
+    char* key = nullptr;
+    char* value = nullptr;
+    char* last = nullptr;
+    char* times = nullptr;
+
+    tok.begin(line + 1);
+    if (!tok.next(key) || !tok.next(value)) return false;
+
+    if (strcmp(key, "thickness") == 0) {
+        loadThickness = atof(value);
+        return loadThickness >= 0;
+    }
+    else if (strcmp(key, "coresoak") == 0) {
+        coreSoak = (value[0] == '1');
+        return true;
+    }
+    else if (strcmp(key, "cone") == 0) {
+        cone = HeatworkIntegrator::parseCone(value);
+        HeatworkIntegrator check;
+        return check.begin(cone, 0);
+    }
+    else if (strcmp(key, "repeat") == 0) {
+        if (numOfRepeats >= MAX_REPEAT_BLOCKS) return false;
+        RepeatBlock& block = repeats[numOfRepeats];
+
+        if (!tok.next(last) || !tok.next(times)) return false;
+
+        int f = atoi(value), l = atoi(last), t = atoi(times);
+        if (f < 1 || l < f || t < 1 || t > 255) return false;
+        block.first = f - 1;
+        block.last = l - 1;
+        block.times = t;
+        block.iteration = 0;
+        numOfRepeats++;
+        return true;
+    }
+    return false;
+}
+
+// Check that the repeat blocks are within the program, and nested or disjoint
+bool ProgramManager::checkRepeats() {
+    for (uint8_t i = 0; i < numOfRepeats; i++) {
+        if (repeats[i].last >= numOfInstructions) return false;
+        for (uint8_t j = 0; j < i; j++) {
+            const RepeatBlock& a = repeats[i];
+            const RepeatBlock& b = repeats[j];
+            bool disjoint = a.last < b.first || b.last < a.first;
+            bool nested = (a.first >= b.first && a.last <= b.last) || (b.first >= a.first && b.last <= a.last);
+            if (!disjoint && !nested) return false;
+        }
+    }
+    return true;
+}
+
+// True if no instruction follows the current one, repeats included
+bool ProgramManager::IsLastInstruction() const {
+    if (instructionIndex + 1 < numOfInstructions) return false;
+    for (uint8_t i = 0; i < numOfRepeats; i++) {
+        if (repeats[i].iteration + 1 < repeats[i].times) return false;
+    }
+    return true;
+}
+
+// Innermost repeat block containing the current instruction, nullptr if none
+const RepeatBlock* ProgramManager::innermostRepeat() const {
+    const RepeatBlock* inner = nullptr;
+    for (uint8_t i = 0; i < numOfRepeats; i++) {
+        const RepeatBlock& b = repeats[i];
+        if (instructionIndex < b.first || instructionIndex > b.last) continue;
+        if (inner == nullptr || b.last - b.first < inner->last - inner->first) inner = &b;
+    }
+    return inner;
+}
 
 // --------------------------------------------------------------------------------------------
 
 // Add an instruction to the program
+// (soakTime in [ms], rounded down to the minute)
 bool ProgramManager::addInstruction(char* name, unsigned long soakTime, double target, double tempVariationRate, bool waitForDoorOpen, bool waitForButtonPress) {
   if(numOfInstructions < MAX_INSTRUCTIONS_PER_PROGRAM) {
-    sprintf(instructions[numOfInstructions].name, "%s", name); // copy instruction name
-    // ensure null termination
-    instructions[numOfInstructions].name[MAX_INSTR_NAME_LENGHT - 1] = '\0';
-    instructions[numOfInstructions].soakTime = soakTime;
-    instructions[numOfInstructions].target = target;
-    instructions[numOfInstructions].tempVariationRate = tempVariationRate;
-    instructions[numOfInstructions].waitForDoorOpen = waitForDoorOpen;
-    instructions[numOfInstructions].waitForButtonPress = waitForButtonPress;
+    Instruction& instr = instructions[numOfInstructions];
+    if(!internName(name, instr.nameOffset)) {
+      sprintf(errorStreamChar,"Instruction names too long.\n");
+      return false;
+    }
+    instr.soak = soakTime / (MINUTE);
+    instr.target = lround(target * 10);
+    instr.rate = lround(tempVariationRate * 10);
+    instr.flags = (waitForDoorOpen ? Instruction::WAIT_DOOR_OPEN : 0) | (waitForButtonPress ? Instruction::WAIT_BUTTON_PRESS : 0);
 
     numOfInstructions++;
     return true;
@@ -464,20 +1253,48 @@ bool ProgramManager::addInstruction(char* name, unsigned long soakTime, double t
 
 // --------------------------------------------------------------------------------------------
 
-// Move to the next instruction
+// Move to the next instruction.
+// At the end of a repeat block with executions left, jump back to its first instruction.
+// With nested blocks ending on the same instruction the inner one is repeated first, and its
+// counter is reset once it is over, so that it starts again at the next execution of the outer one.
 bool ProgramManager::nextInstruction(){
-  if(instructionIndex < numOfInstructions) {
+  int8_t jump = pendingRepeat();
+  double target = current().Target();
+
+  if(jump >= 0){
+    RepeatBlock& block = repeats[jump];
+    block.iteration++;
+    instructionIndex = block.first;
+    // the inner blocks of the repeated one start again from scratch
+    for(uint8_t i = 0; i < numOfRepeats; i++){
+      RepeatBlock& b = repeats[i];
+      if(i != jump && b.first >= block.first && b.last <= block.last) b.iteration = 0;
+    }
+  }
+  else if(instructionIndex + 1 < numOfInstructions) {
     instructionIndex++;
-    // reset control fields
-    instrStartTime = millis();
-    soakTimeStart = 0;
-    soakTimeEnd = 0;
-    isSoaking = false;
-    targetReached = false;
-    return true;
-  } else {
-    return false;
   }
+  else {
+    return false;   // the last instruction is over
+  }
+
+  // streamed program: the new instruction is already in the window, the following one is read
+  // later, out of the critical timings (this can run in the door interrupt, no SD access here)
+  if(streaming) prefetchPending = true;
+
+  // the new instruction is taken off the plan of the remaining time, out of this call
+  previousTarget = target;
+  estimatePending = true;
+
+  // reset control fields
+  instrStartTime = millis();
+  soakTimeStart = 0;
+  soakTimeEnd = 0;
+  soakPauseStart = 0;
+  isSoaking = false;
+  targetReached = false;
+  rampPending = true;
+  return true;
 };
 
 // --------------------------------------------------------------------------------------------
@@ -502,7 +1319,7 @@ bool ProgramManager::removeInstruction(unsigned int index){
 // Check if the current instruction has been completed
 bool ProgramManager::isInstructionDone(){
   // check if the soak time has run out
-  if(isSoaking && millis() - soakTimeStart >= instructions[instructionIndex].soakTime) {
+  if(isSoaking && soakPauseStart == 0 && millis() - soakTimeStart >= current().SoakTime()) {
     if(soakTimeEnd == 0) soakTimeEnd = millis();  // set the end time of the soak time
     return true;
   } else {
@@ -513,21 +1330,32 @@ bool ProgramManager::isInstructionDone(){
 // --------------------------------------------------------------------------------------------
 
 // Get an instruction from the program
-Instruction ProgramManager::GetInstruction(unsigned int index) {
-  if (index > numOfInstructions) {
+// (for a streamed program, only the instructions in the window are available)
+// An empty instruction is returned for an unavailable index
+const Instruction& ProgramManager::GetInstruction(unsigned int index) const {
+  static const Instruction none;
+
+  if (index >= numOfInstructions) {
     //errorStream = "ERROR: instruction index out of bounds.\n";
     sprintf(errorStreamChar,"Instruction index out of bounds.\n");
-    return Instruction();
+    return none;
   }
 
+  if (streaming) {
+    if (windowIndex[0] == index) return instructions[0];
+    if (windowIndex[1] == index) return instructions[1];
+    return none;
+  }
   return instructions[index];
 };
 
 // --------------------------------------------------------------------------------------------
 
-// Get the current instruction
-Instruction ProgramManager::CurrentInstruction() {
-  return instructions[instructionIndex];
+// Start the ramp of the current instruction, from the given temperature
+void ProgramManager::startRamp(double temperature){
+  const Instruction& instr = current();
+  ramp.start(temperature, instr.Target(), instr.TempVariationRate(), millis());
+  rampPending = false;
 };
 
 // --------------------------------------------------------------------------------------------
@@ -535,10 +1363,18 @@ Instruction ProgramManager::CurrentInstruction() {
 // Start the soaking timer
 void ProgramManager::startSoakTimer(){
   soakTimeStart = millis();
+  soakPauseStart = 0;
   isSoaking = true;
   targetReached = false;
 };
 
+// Resume the soaking timer, the time spent in pause doesn't count in the soak
+void ProgramManager::resumeSoakTimer(){
+  if(soakPauseStart == 0) return;
+  soakTimeStart += millis() - soakPauseStart;
+  soakPauseStart = 0;
+};
+
 // --------------------------------------------------------------------------------------------
 
 
@@ -549,23 +1385,151 @@ void ProgramManager::clearProgram() {
   for (unsigned int i = 0; i < MAX_INSTRUCTIONS_PER_PROGRAM; i++) {
     instructions[i] = Instruction();
   }
+  namePool[0] = '\0';
+  namePoolUsed = 1;
   numOfInstructions = 0;
   instructionIndex = 0;
   instrStartTime = 0;
   soakTimeStart = 0;
+  soakPauseStart = 0;
   isSoaking = false;
   targetReached = false;
+  loadThickness = 0;
+  coreSoak = false;
+  cone = 0;
+  numOfRepeats = 0;
+  for (uint8_t i = 0; i < MAX_REPEAT_BLOCKS; i++) repeats[i] = RepeatBlock();
+  ramp = RampGenerator();
+  rampPending = true;
+  if (streaming) source.close();
+  streaming = false;
+  compiled = false;
+  hasUnit = false;
+  programUnit = CELSIUS;
+  layout.setDefault();
+  windowIndex[0] = windowIndex[1] = 0;
+  prefetchPending = false;
+  preflightReport = PreflightReport();
+  plannedRemaining = 0;
+  estimatePending = false;
+  remainingTime = 0;
   sprintf(errorStreamChar, " ");
 };
 
 // --------------------------------------------------------------------------------------------
 
+// Estimated duration of an instruction started from the given temperature [min]: the ramp,
+// limited by what the oven can follow, and the soak. Temperatures in the unit of the system.
+double ProgramManager::estimateTime(const Instruction& instr, double from, const OvenModel& oven, TemperatureUnit unit) const {
+  double fromC = convertTemperature(from, unit, CELSIUS, false);
+  double toC = convertTemperature(instr.Target(), unit, CELSIUS, false);
+  double rateC = convertTemperature(instr.TempVariationRate(), unit, CELSIUS, true);
+  return oven.rampTime(fromC, toC, rateC) + instr.soak;
+};
+
+// Analyse the program before its start, from the given temperature: estimated runtime, peak
+// target, fastest ramp, and the checks against MAX_TEMPERATURE and the learned oven model.
+// The instructions are walked in execution order, repeats included, with the same logic as
+// nextInstruction(). A streamed program is read through once, then its window is filled again.
+bool ProgramManager::preflight(const OvenModel& oven, TemperatureUnit unit, double temperature) {
+  PreflightReport& report = preflightReport;
+  report = PreflightReport();
+  double minutes = 0;
+  double first = -1;                // [min] the first instruction, estimated live at the start
+  double from = temperature;
+
+  instructionIndex = 0;
+  for (uint8_t i = 0; i < numOfRepeats; i++) repeats[i].iteration = 0;
+
+  while (instructionIndex < numOfInstructions) {
+    if (streaming && !readInstruction(instructionIndex, 0)) return false;
+    const Instruction& instr = streaming ? instructions[0] : instructions[instructionIndex];
+    double fromC = convertTemperature(from, unit, CELSIUS, false);
+    double toC = convertTemperature(instr.Target(), unit, CELSIUS, false);
+    double rate = fabs(instr.TempVariationRate());
+
+    double estimate = estimateTime(instr, from, oven, unit);
+    if (first < 0) first = estimate;
+    minutes += estimate;
+    if (instr.Target() > report.peakTarget) report.peakTarget = instr.Target();
+    if (rate > report.maxRate) report.maxRate = rate;
+    if (instr.WaitForDoorOpen() || instr.WaitForButtonPress()) report.hasWaits = true;
+    if (toC > MAX_TEMPERATURE && report.overTemperature == 0) report.overTemperature = instructionIndex + 1;
+    if (report.unreachableRamp == 0 && !oven.canFollow(fromC, toC, convertTemperature(rate, unit, CELSIUS, true)))
+      report.unreachableRamp = instructionIndex + 1;
+    if (oven.IsLearned(toC, toC > fromC)) report.modelLearned = true;
+    from = instr.Target();
+
+    // next instruction, as in nextInstruction()
+    int8_t jump = pendingRepeat();
+    if (jump < 0) {
+      instructionIndex++;
+      continue;
+    }
+    repeats[jump].iteration++;
+    instructionIndex = repeats[jump].first;
+    for (uint8_t i = 0; i < numOfRepeats; i++) {
+      RepeatBlock& b = repeats[i];
+      if (i != jump && b.first >= repeats[jump].first && b.last <= repeats[jump].last) b.iteration = 0;
+    }
+  }
+  report.runtime = minutes * 60;
+
+  // the plan of the remaining time, the first instruction is estimated live
+  plannedRemaining = minutes - first;
+  estimatePending = false;
+  remainingTime = report.runtime * 1000UL;
+  lastEstimate = 0;
+
+  // back to the start of the program
+  instructionIndex = 0;
+  for (uint8_t i = 0; i < numOfRepeats; i++) repeats[i].iteration = 0;
+  if (streaming) {
+    if (!readInstruction(0, 0)) return false;
+    windowIndex[0] = 0;
+    windowIndex[1] = numOfInstructions;     // empty slot
+    prefetchPending = true;
+    return prefetch();
+  }
+  return true;
+};
+
+// Update the estimated remaining time of the program, every ETA_UPDATE_INTERVAL.
+// At an instruction change its planned duration is taken off the plan of the preflight, so the
+// program is never simulated again: only the current instruction is estimated, from the current
+// temperature, or from the soak timer.
+void ProgramManager::updateEstimate(const OvenModel& oven, TemperatureUnit unit, double temperature) {
+  unsigned long now = millis();
+  if (!estimatePending && now - lastEstimate < ETA_UPDATE_INTERVAL) return;
+  if (!IsWindowReady()) return;     // the instruction is not read yet
+  lastEstimate = now;
+
+  const Instruction& instr = current();
+  if (estimatePending) {
+    plannedRemaining -= estimateTime(instr, previousTarget, oven, unit);
+    if (plannedRemaining < 0) plannedRemaining = 0;
+    estimatePending = false;
+  }
+
+  double minutes = 0;
+  if (isSoaking) {
+    unsigned long soaked = (soakPauseStart ? soakPauseStart : now) - soakTimeStart;
+    if (soaked < instr.SoakTime()) minutes = (instr.SoakTime() - soaked) / (double) (MINUTE);
+  }
+  else minutes = estimateTime(instr, temperature, oven, unit);
+
+  remainingTime = (plannedRemaining + minutes) * MINUTE;
+};
+
+// --------------------------------------------------------------------------------------------
+
 // Reset the timers and stability checks for the current instruction
 // Execution is reset to the beginning of the instruction
 void ProgramManager::resetCurrentInstruction(){
   instrStartTime = millis();
   soakTimeStart  = 0;
   soakTimeEnd  = 0;
+  soakPauseStart = 0;
   isSoaking = false;
   targetReached  = false;
 }
@@ -4,6 +4,9 @@
 
 #include "TEEK_pins.h"
 #include "TEEK_constants.h"
+#include "TEEK_estimators.h"
+#include "TEEK_programFormat.h"
+#include "TEEK_csv.h"
 #ifndef ADAFRUIT_MAX31855_H
     // So the IDE doesn't complain
     #include <Adafruit_MAX31855.h>
@@ -20,20 +23,54 @@
 enum SystemState {IDLE, BEGIN, EXECUTING, END, DOOR_OPEN, RECOVER, HOLD, ERROR, TUNING, USER_STOP};
 enum TemperatureUnit {CELSIUS, FAHRENHEIT, KELVIN};
 enum ControlMode {NORMAL, PID_AUTOTUNE};
+enum ProbeFault {PROBE_OK, PROBE_NO_READING, PROBE_OVER_TEMP, PROBE_UNDER_TEMP};
 
 
 // ===== Structs ===============================================
 
 
 //* STRUCT Instruction 
-// Container for the informations pertaining an instruction, corresponding to the input file definition
+// Container for the informations pertaining an instruction, corresponding to the input file definition.
+// Packed in 8 bytes: temperatures and rates in tenths of degree, soak in minutes, flags as bits.
+// The name is kept in the name pool of the ProgramManager, at nameOffset.
 struct Instruction {
-    char name[MAX_INSTR_NAME_LENGHT];   // name of the instruction for logging
-    unsigned long soakTime = 0;         // [min] defines for how long the target temperature should be maintained
-    double target = 0;                  // [C/F/K] target temperature
-    double tempVariationRate = 0;       // [C/min] rate at which the temperature should increase/decrease
-    bool waitForDoorOpen = false;       // Wait for the door to open before moving to the next instruction
-    bool waitForButtonPress = false;    // Wait for the encoder button to be pressed before moving to the next instruction
+    static const uint8_t WAIT_DOOR_OPEN    = 0x01; // Wait for the door to open before moving to the next instruction
+    static const uint8_t WAIT_BUTTON_PRESS = 0x02; // Wait for the encoder button to be pressed before moving to the next instruction
+
+    int16_t target = 0;         // [0.1 C/F/K] target temperature
+    int16_t rate = 0;           // [0.1 C/min] rate at which the temperature should increase/decrease
+    uint16_t soak = 0;          // [min] defines for how long the target temperature should be maintained
+    uint8_t nameOffset = 0;     // position of the name in the name pool
+    uint8_t flags = 0;          // WAIT_DOOR_OPEN | WAIT_BUTTON_PRESS
+
+    double Target() const { return target * 0.1; }
+    double TempVariationRate() const { return rate * 0.1; }
+    unsigned long SoakTime() const { return (unsigned long) soak * MINUTE; }   // [ms]
+    bool WaitForDoorOpen() const { return flags & WAIT_DOOR_OPEN; }
+    bool WaitForButtonPress() const { return flags & WAIT_BUTTON_PRESS; }
+};
+
+//*STRUCT RepeatBlock
+// a block of consecutive instructions executed more than once (i.e. double temper).
+// Blocks can be nested, but not partially overlapped.
+struct RepeatBlock {
+    uint16_t first = 0;     // index of the first instruction of the block
+    uint16_t last = 0;      // index of the last instruction of the block
+    uint8_t times = 1;      // number of executions of the block
+    uint8_t iteration = 0;  // current execution, from 0
+    uint32_t offset = 0;    // file offset of the first instruction (streamed programs only)
+};
+
+//*STRUCT PreflightReport
+// analysis of a program before its start, against the learned oven model
+struct PreflightReport {
+    unsigned long runtime = 0;          // [s] estimated runtime, waits excluded
+    double peakTarget = 0;              // [C/F/K] highest target
+    double maxRate = 0;                 // [/min] fastest requested ramp
+    unsigned int overTemperature = 0;   // first instruction (from 1) above MAX_TEMPERATURE, 0 if none
+    unsigned int unreachableRamp = 0;   // first instruction (from 1) faster than the oven can follow, 0 if none
+    bool hasWaits = false;              // the program waits for the door or the button
+    bool modelLearned = false;          // part of the program was checked against measured rates
 };
 
 //*STRUCT AutotuneParameters
@@ -63,15 +100,17 @@ struct AutotuneParameters {
  * @private
  * - TemperatureUnit unit: The unit of temperature measurement (Celsius, Fahrenheit, Kelvin).
  * - Adafruit_MAX31855 sensor: The sensor used for temperature readings.
+ * - ProbeFault fault: The outcome of the last reading.
  * 
  * @public
  * - TemperatureProbe(): Default constructor.
- * - TemperatureProbe(int _pin): Constructor with a specified pin.
  * - TemperatureProbe(TemperatureUnit _unit): Constructor with a specified temperature unit.
- * - TemperatureProbe(int _pin, TemperatureUnit _unit): Constructor with a specified pin and temperature unit.
+ * - TemperatureProbe(uint8_t _pin, TemperatureUnit _unit): Constructor with a specified chip select pin and temperature unit.
  * - void setUnit(TemperatureUnit unit): Set the temperature unit.
  * - TemperatureUnit Unit(): Get the current temperature unit.
  * - Adafruit_MAX31855 Sensor(): Get the sensor object.
+ * - ProbeFault Fault(): Get the outcome of the last reading.
+ * - bool begin(): Initialize the sensor.
  * - double readTemp(): Read the current temperature and implement security checks.
  */
 
@@ -79,23 +118,83 @@ class TemperatureProbe {
     private: 
         TemperatureUnit unit;
         Adafruit_MAX31855 sensor;
+        ProbeFault fault = PROBE_OK;
         double toFarhenheit(double celsius){return celsius * 9.0/5.0 + 32;};
 
     public: 
         // Constructor
         TemperatureProbe();
         TemperatureProbe(TemperatureUnit u);
+        TemperatureProbe(uint8_t pin, TemperatureUnit u);
 
         // Setters and Getters
-        void setUnit(TemperatureUnit unit){unit = unit;};
+        void setUnit(TemperatureUnit u){unit = u;};
 
         TemperatureUnit   Unit()   const {return unit;};
         Adafruit_MAX31855 Sensor() const {return sensor;};
+        ProbeFault        Fault()  const {return fault;};
         
         // Methods
+        bool begin(){return sensor.begin();};
         double readTemp();
 };
 
+//* CLASS RampGenerator
+/**
+ * @class RampGenerator
+ * @brief Generates the setpoint trajectory of a ramp, from the start of the instruction.
+ *
+ * The setpoint moves linearly from the temperature at the start of the instruction to its target,
+ * at the rate of the instruction, as a function of the time elapsed in the instruction only.
+ * The end of the ramp is blended over RAMP_BLEND_TIME (or twice the ramp, if shorter), so the
+ * setpoint slows down to the target instead of turning a sharp corner, and the kiln doesn't
+ * overshoot it. The blend is an S-curve with bounded jerk (RAMP_SCURVE_BLEND): the acceleration
+ * rises from 0 and falls back to 0, with a peak 1.5 times the one of a parabolic blend, the
+ * alternative when the option is off. The blend ends RAMP_BLEND_TIME/2 after the nominal ramp end.
+ * The time spent in pause (i.e. door open) is not counted, the ramp resumes where it left off.
+ *
+ * @private
+ * - double from: Setpoint at the start of the ramp.
+ * - double to: Target of the ramp.
+ * - double rate: Signed rate of the ramp [/min], 0 if there is no ramp.
+ * - double duration: Duration of the linear ramp [min].
+ * - double blend: Duration of the end blend [min].
+ * - unsigned long startTime: Start time of the ramp [ms].
+ * - unsigned long pausedTime: Total time spent in pause [ms].
+ * - unsigned long pauseStart: Start time of the current pause [ms], 0 if running.
+ * - double elapsed(unsigned long time): Time elapsed in the ramp, pauses excluded [min].
+ *
+ * @public
+ * - void start(double from, double to, double rate, unsigned long time): Start a ramp.
+ * - void pause(unsigned long time): Pause the ramp.
+ * - void resume(unsigned long time): Resume the ramp.
+ * - double Setpoint(unsigned long time): Get the setpoint at the given time.
+ * - bool IsDone(unsigned long time): Check if the setpoint has reached the target.
+ * - bool IsPaused(): Check if the ramp is paused.
+ */
+class RampGenerator {
+    private:
+        double from = 0;
+        double to = 0;
+        double rate = 0;                // [/min]
+        double duration = 0;            // [min]
+        double blend = 0;               // [min]
+        unsigned long startTime = 0;    // [ms]
+        unsigned long pausedTime = 0;   // [ms]
+        unsigned long pauseStart = 0;   // [ms]
+
+        double elapsed(unsigned long time) const;
+
+    public:
+        void start(double from, double to, double rate, unsigned long time);
+        void pause(unsigned long time) { if(pauseStart == 0) pauseStart = time; }
+        void resume(unsigned long time);
+
+        double Setpoint(unsigned long time) const;
+        bool IsDone(unsigned long time) const { return rate == 0 || elapsed(time) >= duration + blend / 2; }
+        bool IsPaused() const { return pauseStart != 0; }
+};
+
 //* CLASS ProgramManager
 /**
  * @class ProgramManager
@@ -109,21 +208,56 @@ class TemperatureProbe {
  * @private
  * - char programName[MAX_FILENAME_LENGTH]: Name of the program.
  * - Instruction instructions[MAX_INSTRUCTIONS_PER_PROGRAM]: Array of instructions in the program.
- * - TemperatureUnit programUnit: Unit of temperature used in the program.
+ *   For a streamed program, the first two elements are the window of the current and of the next instruction.
+ * - char namePool[INSTR_NAME_POOL_SIZE]: Names of the instructions, one copy per distinct name. The first byte is the empty name.
+ *   For a streamed program, each slot of the window has its own MAX_INSTR_NAME_LENGHT area after the empty name.
+ * - uint8_t namePoolUsed: Bytes used in the name pool.
+ * - TemperatureUnit programUnit: Unit of temperature used in the program, if it declares one.
+ * - bool hasUnit: Indicates if the program declares its unit (compiled programs, CSV programs with a unit column).
+ * - bool compiled: Indicates if the program was loaded from a compiled (.tkp) file.
+ * - CsvLayout layout: Columns of a CSV program, from its header.
  * - unsigned int numOfInstructions: Number of instructions in the program.
  * - unsigned int instructionIndex: Index of the current instruction.
  * - unsigned long progStartTime: Start time of the program in milliseconds.
  * - unsigned long instrStartTime: Start time of the current instruction in milliseconds.
  * - unsigned long soakTimeStart: Start time of the soak phase in milliseconds.
  * - unsigned long soakTimeEnd: End time of the soak phase in milliseconds.
+ * - unsigned long soakPauseStart: Start time of the current pause of the soak timer in milliseconds, 0 if running.
  * - bool isSoaking: Indicates if the program is in the soaking phase.
  * - bool targetReached: Indicates if the target has been reached in a stable way.
  * - bool isSelected: Indicates if a program has been loaded.
  * - bool buttonPressed: Indicates if the button has been pressed.
- * - void skipLine(File& file): Skips a line in the file.
- * - bool readLine(File& file, char* buffer, size_t bufferSize): Reads a line from the file.
- * - bool parseCSVLine(const char* line, char* name, size_t nameSize, double* target, unsigned long* soakTime, double* rampRate, bool* waitForDoorOpen, bool* waitForButtonPress): Parses a CSV line.
- * - const char* extractField(const char* line, char* buffer, size_t bufferSize): Extracts a field from a CSV line.
+ * - double loadThickness: Thickness of the workpiece [mm], 0 if no load model is requested.
+ * - bool coreSoak: Indicates if the soaks are timed on the estimated core temperature.
+ * - int cone: Target Orton cone of the firing, 0 if the program is not fired to a cone.
+ * - RepeatBlock repeats[MAX_REPEAT_BLOCKS]: Repeat blocks of the program.
+ * - uint8_t numOfRepeats: Number of repeat blocks in the program.
+ * - RampGenerator ramp: Setpoint trajectory of the current instruction.
+ * - bool rampPending: Indicates if the ramp of the current instruction has to be started.
+ * - bool streaming: Indicates if the program is too long for RAM, and is read from the SD card while running.
+ * - File source: Program file, kept open while a streamed program runs.
+ * - uint32_t dataStart: File offset of the first instruction line.
+ * - unsigned int windowIndex[2]: Index of the instruction held by each slot of the window.
+ * - unsigned int streamIndex: Index of the instruction at the current position of the file.
+ * - bool prefetchPending: Indicates if the next instruction has to be read in the window.
+ * - PreflightReport preflightReport: Analysis of the program, before its start.
+ * - double plannedRemaining: Estimated duration of the instructions after the current one [min], from the preflight.
+ * - double previousTarget: Target of the previous instruction, where the current one was planned to start from.
+ * - bool estimatePending: Indicates if the current instruction has to be taken off the plan.
+ * - unsigned long remainingTime: Estimated remaining time of the program [ms], waits excluded.
+ * - unsigned long lastEstimate: Timestamp of the last update of the remaining time [ms].
+ * - bool parseInstruction(char* line, Instruction& instr, char* name, CsvError& error): Parses a CSV line in place into an instruction, and its name.
+ * - bool readInstruction(unsigned int index, uint8_t slot): Reads an instruction of a streamed program in a slot of the window.
+ * - bool loadCompiled(File& file): Loads a compiled (.tkp) program, checking its CRC.
+ * - bool validRecord(const Instruction& instr): Checks a compiled record: name in the pool, target and rate in range.
+ * - bool internName(const char* name, uint8_t& offset): Stores a name in the pool, reusing an identical one. Returns false if the pool is full.
+ * - unsigned int followingInstruction(): Index of the instruction that follows the current one, repeats included.
+ * - int8_t pendingRepeat(): Repeat block ending on the current instruction with executions left, -1 if none.
+ * - const Instruction& current(): The current instruction, in the array or in the window.
+ * - bool readLine(File& file, char* buffer, size_t bufferSize): Reads a line from the file. Returns false if it doesn't fit the buffer.
+ * - bool parseOption(char* line): Parses a program option line ("@key,value") in place.
+ * - bool checkRepeats(): Checks that the repeat blocks are within the program, and nested or disjoint.
+ * - const RepeatBlock* innermostRepeat(): Returns the innermost repeat block containing the current instruction, if any.
  * 
  * @public
  * - ProgramManager(): Constructor.
@@ -136,9 +270,18 @@ class TemperatureProbe {
  * - const unsigned long SoakTimeEnd(): Returns the end time of the soak phase.
  * - const bool IsSoaking(): Returns true if the program is in the soaking phase.
  * - const bool IsTargetReached(): Returns true if the target has been reached in a stable way.
- * - const Instruction GetInstruction(unsigned int index): Returns the instruction at the specified index.
- * - const Instruction CurrentInstruction(): Returns the current instruction.
+ * - const Instruction& GetInstruction(unsigned int index): Returns the instruction at the specified index.
+ * - const Instruction& CurrentInstruction(): Returns the current instruction.
+ * - const char* InstructionName(const Instruction& instr): Returns the name of an instruction of the program.
+ * - const char* CurrentInstructionName(): Returns the name of the current instruction.
  * - const bool IsSelected() const: Returns true if a program has been selected and loaded.
+ * - double LoadThickness(): Returns the thickness of the workpiece [mm].
+ * - bool IsCoreSoak(): Returns true if the soaks are timed on the estimated core temperature.
+ * - int Cone(): Returns the target cone of the firing, 0 if none.
+ * - bool IsLastInstruction(): Returns true if the current instruction is the last one to be executed.
+ * - uint8_t NumOfRepeats(): Returns the number of repeat blocks of the program.
+ * - uint8_t RepeatIteration(): Returns the execution (from 1) of the innermost repeat block of the current instruction, 0 if none.
+ * - uint8_t RepeatTimes(): Returns the number of executions of the innermost repeat block of the current instruction, 0 if none.
  * - void setName(const char* name): Sets the name of the program.
  * - void setNumOfInstructions(unsigned int num): Sets the number of instructions in the program.
  * - void setInstructionIndex(unsigned int index): Sets the index of the current instruction.
@@ -147,9 +290,9 @@ class TemperatureProbe {
  * - void setIsSoaking(bool soaking): Sets the soaking state.
  * - void setTargetReached(bool stable): Sets the target reached state.
  * - void setProgStartTime(unsigned long time): Sets the start time of the program.
- * - bool addInstruction(Instruction instr): Adds an instruction to the program.
+ * - bool addInstruction(const Instruction& instr): Adds an instruction to the program.
  * - bool addInstruction(char* name, unsigned long soakTime, double target, double tempVariationRate, bool waitForDoorOpen, bool waitForButtonPress): Adds an instruction to the program with specified parameters.
- * - bool nextInstruction(): Moves to the next instruction.
+ * - bool nextInstruction(): Moves to the next instruction, jumping back to the start of a repeat block if it has executions left.
  * - bool removeInstruction(unsigned int index): Removes an instruction from the program.
  * - bool isInstructionDone(): Checks if the current instruction has been completed.
  * - bool hasButtonBeenPressed(): Returns true if the button has been pressed.
@@ -157,20 +300,46 @@ class TemperatureProbe {
  * - void ConfirmButtonPressed(): Confirms that the button has been pressed.
  * - unsigned long elapsedTime(): Returns the elapsed time since the program started.
  * - unsigned long remainingSoakTime(): Returns the remaining soak time.
- * - void rampCompleted(): Marks the ramp as completed.
+ * - void startRamp(double temperature): Starts the ramp of the current instruction from the given temperature.
+ * - bool IsRampPending(): Returns true if the ramp of the current instruction has not been started yet.
+ * - bool IsRamping(): Returns true if the setpoint has not reached the target of the instruction yet.
+ * - double Setpoint(): Returns the current setpoint of the instruction.
+ * - void pauseRamp(): Pauses the ramp (i.e. door open).
+ * - void resumeRamp(): Resumes the ramp.
  * - void startSoakTimer(): Starts the soak timer.
+ * - void endSoak(): Ends the current soak before its time.
+ * - void pauseSoakTimer(): Freezes the soak timer (i.e. door open, temperature out of band).
+ * - void resumeSoakTimer(): Resumes the soak timer, the pause is not counted in the soak.
  * - void resetCurrentInstruction(): Resets the current instruction.
  * - void resetCurrentInstruction(unsigned long time): Resets the current instruction from a given time.
  * - void resetProgStartTime(): Resets the program start time.
  * - void clearProgram(): Clears the program fields.
- * - bool loadProgram(File& file): Loads a program from a file.
+ * - bool loadProgram(File& file): Loads a program from a file, compiled (.tkp) or CSV.
+ * - const char* NamePool(), uint8_t NamePoolUsed(): Returns the name pool and its used bytes, i.e. to copy the names in a log.
+ * - bool IsCompiled(): Returns true if the program was loaded from a compiled (.tkp) file.
+ * - bool HasUnit(): Returns true if the program declares its unit of temperature.
+ * - TemperatureUnit Unit(): Returns the unit of temperature of the program, if it declares one.
+ * - bool IsStreaming(): Returns true if the program is read from the SD card while running.
+ * - bool IsPrefetchPending(): Returns true if the next instruction of a streamed program has to be read.
+ * - bool IsWindowReady(): Returns true if the current instruction of a streamed program is in the window.
+ * - bool prefetch(): Reads the next instruction of a streamed program in the window.
+ * - bool preflight(const OvenModel& oven, TemperatureUnit unit, double temperature): Analyses the program from the given temperature, before its start.
+ * - double estimateTime(const Instruction& instr, double from, const OvenModel& oven, TemperatureUnit unit): Estimated duration of an instruction [min], ramp and soak.
+ * - const PreflightReport& Preflight(): Returns the analysis of the program.
+ * - void updateEstimate(const OvenModel& oven, TemperatureUnit unit, double temperature): Updates the remaining time, every ETA_UPDATE_INTERVAL.
+ * - unsigned long RemainingTime(): Returns the estimated remaining time of the program [ms].
  */
 class ProgramManager {
     private: 
         // == 1. Program Information ===================================================================
         char            programName[MAX_FILENAME_LENGTH];
         Instruction     instructions[MAX_INSTRUCTIONS_PER_PROGRAM];
+        char            namePool[INSTR_NAME_POOL_SIZE];
+        uint8_t         namePoolUsed = 1;       // namePool[0] is the empty name
         TemperatureUnit programUnit = CELSIUS;
+        bool            hasUnit = false;
+        bool            compiled = false;
+        CsvLayout       layout;
 
         // == 2. Program Variables =====================================================================
         unsigned int    numOfInstructions   = 0;
@@ -181,6 +350,7 @@ class ProgramManager {
         // == 3. Instruction Variables ================================================================
         unsigned long   soakTimeStart   = 0;    // [ms]
         unsigned long   soakTimeEnd     = 0;    // [ms]
+        unsigned long   soakPauseStart  = 0;    // [ms] 0 if the soak timer is running
         bool isSoaking      = false;            // True if the program is in the soaking phase
         bool targetReached  = false;           // True if the target has been reached in a stable way
         bool isSelected     = false;           // True if a program has been loaded
@@ -188,11 +358,52 @@ class ProgramManager {
         // == 4. Button State ==========================================================================
         bool buttonPressed  = false;           // True if the button has been pressed
 
+        // == 4b. Program Options =====================================================================
+        double loadThickness = 0;               // [mm] workpiece thickness, 0 = no load model
+        bool coreSoak       = false;           // True if the soaks are timed on the core temperature
+        int cone            = 0;               // Target cone, 0 = none
+
+        // == 4c. Repeat Blocks ========================================================================
+        RepeatBlock repeats[MAX_REPEAT_BLOCKS];
+        uint8_t numOfRepeats = 0;
+
+        // == 4d. Setpoint Trajectory =================================================================
+        RampGenerator ramp;
+        bool rampPending    = true;            // True until the ramp of the instruction is started
+
+        // == 4e. Streaming ===========================================================================
+        bool streaming      = false;           // True if the program is read from the SD while running
+        File source;                            // Program file of a streamed program
+        uint32_t dataStart  = 0;               // File offset of the first instruction line
+        unsigned int windowIndex[2] = {0, 0};  // Instruction held by each slot of the window
+        unsigned int streamIndex = 0;          // Instruction at the current file position
+        bool prefetchPending = false;          // True if the next instruction has to be read
+
+        // == 4f. Preflight ===========================================================================
+        PreflightReport preflightReport;
+
+        // == 4g. Remaining Time ======================================================================
+        // The plan of the instructions still to come is only reduced at each instruction change,
+        // the current instruction is estimated live, from the current temperature
+        double plannedRemaining = 0;            // [min] instructions after the current one
+        double previousTarget = 0;              // [C/F/K] start of the current instruction in the plan
+        bool estimatePending = false;           // True if the current instruction is still in the plan
+        unsigned long remainingTime = 0;        // [ms]
+        unsigned long lastEstimate = 0;         // [ms]
+
         // == 5. CSV Parsing ===========================================================================
-        void skipLine(File& file);
         bool readLine(File& file, char* buffer, size_t bufferSize);
-        bool parseCSVLine(const char* line, char* name, size_t nameSize, double* target, unsigned long* soakTime, double* rampRate, bool* waitForDoorOpen, bool* waitForButtonPress);
-        const char* extractField(const char* line, char* buffer, size_t bufferSize);
+        bool parseOption(char* line);
+        bool checkRepeats();
+        const RepeatBlock* innermostRepeat() const;
+        bool parseInstruction(char* line, Instruction& instr, char* name, CsvError& error);
+        bool readInstruction(unsigned int index, uint8_t slot);
+        bool loadCompiled(File& file);
+        bool validRecord(const Instruction& instr) const;
+        bool internName(const char* name, uint8_t& offset);
+        unsigned int followingInstruction() const;
+        int8_t pendingRepeat() const;
+        const Instruction& current() const;
 
     public:
         // == 6. Constructor ===========================================================================
@@ -208,9 +419,20 @@ class ProgramManager {
         unsigned long SoakTimeEnd() const { return soakTimeEnd; }
         bool IsSoaking() const { return isSoaking; }
         bool IsTargetReached() const { return targetReached; }
-        Instruction GetInstruction(unsigned int index);
-        Instruction CurrentInstruction();
+        const Instruction& GetInstruction(unsigned int index) const;
+        const Instruction& CurrentInstruction() const { return current(); }
+        const char* InstructionName(const Instruction& instr) const { return namePool + instr.nameOffset; }
+        const char* CurrentInstructionName() const { return InstructionName(current()); }
+        const char* NamePool() const { return namePool; }
+        uint8_t NamePoolUsed() const { return namePoolUsed; }
         bool IsSelected() const { return isSelected; } // True if a program has been selected and loaded
+        double LoadThickness() const { return loadThickness; }
+        bool IsCoreSoak() const { return coreSoak; }
+        int Cone() const { return cone; }
+        bool IsLastInstruction() const;     // True if no instruction follows the current one
+        uint8_t NumOfRepeats() const { return numOfRepeats; }
+        uint8_t RepeatIteration() const { const RepeatBlock* b = innermostRepeat(); return b ? b->iteration + 1 : 0; }
+        uint8_t RepeatTimes() const { const RepeatBlock* b = innermostRepeat(); return b ? b->times : 0; }
 
         // == 8. Setters ===============================================================================
         void setName(const char* name) {
@@ -226,7 +448,7 @@ class ProgramManager {
         void setProgStartTime(unsigned long time) { progStartTime = time; }
 
         // == 9. Instruction Management ================================================================
-        bool addInstruction(Instruction instr);
+        bool addInstruction(const Instruction& instr);
         bool addInstruction(char* name, unsigned long soakTime, double target, double tempVariationRate, bool waitForDoorOpen, bool waitForButtonPress);
         bool nextInstruction(); // Move to the next instruction
         bool removeInstruction(unsigned int index); // Remove an instruction from the program (unused)
@@ -239,10 +461,19 @@ class ProgramManager {
 
         // == 11. Execution Control =====================================================================
         unsigned long elapsedTime() { return millis() - progStartTime; }
-        unsigned long remainingSoakTime() { return soakTimeStart + CurrentInstruction().soakTime - millis(); }
-        void rampCompleted() { instructions[instructionIndex].tempVariationRate = 0; } // if the ramp has been completed, erase the ramp rate
-        
+        unsigned long remainingSoakTime() { return soakTimeStart + current().SoakTime() - (soakPauseStart ? soakPauseStart : millis()); }
+
+        void startRamp(double temperature);  // Start the ramp of the current instruction
+        bool IsRampPending() const { return rampPending; }
+        bool IsRamping() const { return !ramp.IsDone(millis()); }
+        double Setpoint() const { return ramp.Setpoint(millis()); }
+        void pauseRamp() { ramp.pause(millis()); }
+        void resumeRamp() { ramp.resume(millis()); }
+
         void startSoakTimer();              // Start the soak timer
+        void endSoak() { soakTimeStart = millis() - current().SoakTime(); } // End the soak now
+        void pauseSoakTimer() { if(isSoaking && soakPauseStart == 0) soakPauseStart = millis(); }
+        void resumeSoakTimer();             // Resume the soak timer, shifting its start by the pause
         void resetCurrentInstruction();     // Reset the current instruction (unused)
         void resetCurrentInstruction(unsigned long time);   // Reset the current instruction, from a given time (unused)
         void resetProgStartTime() { progStartTime = millis(); } // Reset the program start time (unused)
@@ -250,6 +481,22 @@ class ProgramManager {
 
         // == 12. Program Loading ======================================================================
         bool loadProgram(File& file); // Defined in the TEEKeeper.cpp file!
+        bool IsCompiled() const { return compiled; }
+        bool HasUnit() const { return hasUnit; }
+        TemperatureUnit Unit() const { return programUnit; }
+
+        // == 13. Streaming ============================================================================
+        bool IsStreaming() const { return streaming; }
+        bool IsPrefetchPending() const { return prefetchPending; }
+        bool IsWindowReady() const { return !streaming || windowIndex[0] == instructionIndex || windowIndex[1] == instructionIndex; }
+        bool prefetch();    // Read the next instruction in the window, out of the critical timings
+
+        // == 14. Preflight ============================================================================
+        bool preflight(const OvenModel& oven, TemperatureUnit unit, double temperature);   // Analyse the program before its start
+        double estimateTime(const Instruction& instr, double from, const OvenModel& oven, TemperatureUnit unit) const;  // [min]
+        const PreflightReport& Preflight() const { return preflightReport; }
+        void updateEstimate(const OvenModel& oven, TemperatureUnit unit, double temperature);    // Update the remaining time
+        unsigned long RemainingTime() const { return remainingTime; }   // [ms] waits excluded
 };
 
 // TODO: all the functions marked by the "unused" comment are currently not used in the program, and can be removed if necessary.
@@ -260,28 +507,49 @@ class ProgramManager {
 // ------------------------------------------------
 
 
+//* STRUCT ControlZone
+// Probes, heater and PID state of an independently controlled zone of the chamber
+struct ControlZone {
+    TemperatureProbe probes[PROBES_PER_ZONE];       // zone thermocouples
+    double readings[PROBES_PER_ZONE] = {};          // last valid reading of each probe
+    uint8_t strikes[PROBES_PER_ZONE] = {};          // consecutive disagreements of each probe with the vote
+    uint8_t readProbes = 0;                         // bitmask of the probes with a valid reading
+    uint8_t failedProbes = 0;                       // bitmask of the dropped probes
+    double temperature = 0;                         // voted temperature
+    unsigned long lastReading = 0;                  // [ms] timestamp of the last valid reading
+    double dutyCycle = 0;                           // [%] duty cycle of the current PWM cycle
+    double last_error = 0;                          // last error, for the derivative term
+    double integral = 0;                            // integral term
+    unsigned long stageDutyEnd[HEATER_STAGES] = {}; // [ms] end of the duty cycle of each heater stage
+    uint8_t activeStages = 0;                       // heater stages fired in the current PWM cycle
+};
+
+
 /**
  * @class CoreSystem
  * @brief Manages the thermal control of the system using a PID controller.
  * 
  * The CoreSystem class is optimized for lightweight, fast, and basic control, ensuring time precision without relying on hardware timers.
  * It provides features such as heater control, stability monitoring, and optional logging for diagnostics.
+ * The chamber is split in N_ZONES zones, each with its own probe, heater and PID state, all following the same target.
+ * Each zone can have up to 3 redundant probes, voted by median (3 probes) or agreement (2 probes):
+ * a failing probe is dropped and the zone keeps firing in degraded mode, as long as a probe is left.
+ * The probes share the SPI bus and are sampled round-robin, one per time slot, so that each probe is
+ * sampled every N_ZONES * PROBES_PER_ZONE * PROBE_SAMPLE_SLOT ms while firing.
  * 
  * @private
- * - TemperatureProbe probe: The temperature probe used for reading temperatures.
+ * - ControlZone zones[N_ZONES]: The control zones (probes, heater stages and PID state).
+ * - uint8_t nextProbe: The probe to be sampled in the next slot of the round-robin sampler.
  * - SystemState status: The current state of the system.
  * - TemperatureUnit unit: The unit of temperature measurement (Celsius, Fahrenheit, Kelvin).
  * - ControlMode mode: The control mode (NORMAL, PID_AUTOTUNE).
  * - double targetTemperature: The target temperature to be achieved.
- * - double currentTemperature: The current temperature reading.
- * - unsigned long lastTempReading: The timestamp of the last temperature reading.
+ * - double currentTemperature: The current temperature, averaged over the zones.
+ * - unsigned long lastTempReading: The timestamp of the last sampling slot.
  * - double kp, ki, kd: PID controller parameters.
- * - double dutyCycle: The duty cycle for PWM control.
+ * - double dutyCycle: The duty cycle for PWM control, averaged over the zones.
  * - unsigned long PWMPeriod: The period of the PWM cycle.
- * - double last_error: The last error value for PID calculation.
- * - double integral: The integral term for PID calculation.
  * - unsigned long nextPWMCycle: The timestamp for the next PWM cycle.
- * - unsigned long dutyEnd: The timestamp when the current duty cycle ends.
  * - bool allowFiringHeater: Security flag to allow or deny heater operation.
  * - bool fireHeater: Flag to indicate if the heater is currently firing.
  * - short int stabilityCounter: Counter for temperature stability checks.
@@ -289,14 +557,42 @@ class ProgramManager {
  * - bool keepLog: Flag to indicate if logging is enabled.
  * - unsigned long lastDoorOpenTime: The timestamp of the last door opening event.
  * - bool isTuning: Flag to indicate if the system is in PID tuning mode.
- * - double PID(const double error): Calculate the PID control signal.
+ * - bool recovering: Flag to indicate if the heaters are boosted to recover from a door opening.
+ * - unsigned long recoveryStart: The timestamp of the start of the recovery.
+ * - bool holding: Flag to indicate if the program is on hold.
+ * - unsigned long holdStart: The timestamp of the start of the hold.
+ * - unsigned long holdInBand: Time spent within MAX_TEMP_ERROR of the target during the hold.
+ * - unsigned long lastHoldCheck: The timestamp of the last time-in-band check.
+ * - double holdMaxDeviation: Largest deviation from the target during the hold.
+ * - double peakTemperature: Highest filtered temperature of the run.
+ * - double maxOvershoot: Largest excess of the filtered temperature over a rising or steady target.
+ * - double lastCycleTarget: Target of the previous PWM cycle, to tell a falling target.
+ * - double energy: Energy fed to the heaters during the run [Wh].
+ * - LoadEstimator load: Core temperature estimator of the workpiece.
+ * - ThermalKalman kalman: Filtered estimate of the mean temperature and of the heating rate.
+ * - HeatworkIntegrator heatwork: Heatwork accumulated during the firing, toward the target cone.
+ * - OvenModel oven: Learned heating and cooling capability of the oven, saved in the EEPROM.
+ * - double toKelvin(double temp): Convert a temperature from the system unit to Kelvin.
+ * - double PID(ControlZone &zone, const double error): Calculate the PID control signal of a zone.
+ * - void fireStages(uint8_t z, unsigned long time): Distribute the duty cycle of a zone over its heater stages and turn them on.
+ * - void releaseStages(): Turn off the heater stages whose duty cycle has ended.
+ * - void writeAllStages(uint8_t level): Drive all the heater stages to the same level.
+ * - bool readProbe(uint8_t z, uint8_t p): Read a probe of a zone and update the vote of the zone.
+ * - void dropProbe(uint8_t z, uint8_t p, const char* reason): Exclude a failing probe from the vote.
+ * - void voteZone(uint8_t z, uint8_t p): Vote the temperature of a zone from its probes, and strike probe p (the one just read) if it disagrees.
+ * - void logEvent(const char* message): Report an event on the log file.
+ * - void logSample(unsigned long time): Write a log record, if the log policy finds one due.
+ * - void recordBlackBox(uint8_t z, uint8_t p, bool measured): Add the probe sample to the black box.
+ * - void updateMeanTemperature(): Update the mean temperature of the zones.
+ * - void startFilter(): Start the Kalman filter from the mean temperature, with its model in the system unit.
  * - void CriticalError(): Handle critical errors.
  * 
  * @public
- * - CoreSystem(TemperatureProbe &probe): Constructor with temperature probe.
- * - CoreSystem(TemperatureProbe &probe, double kp, double ki, double kd): Constructor with temperature probe and PID parameters.
+ * - CoreSystem(): Default constructor.
+ * - CoreSystem(double kp, double ki, double kd): Constructor with PID parameters.
+ * - bool begin(): Initialize the probes and the heater pins.
  * - void setTarget(double target, bool newInstruction = false): Set the target temperature.
- * - void setUnit(TemperatureUnit _unit): Set the temperature unit.
+ * - void setUnit(TemperatureUnit _unit): Set the temperature unit. On a change, the probes are read again and the filter restarts in the new unit.
  * - void updatePID(double _kp, double _ki, double _kd): Update the PID parameters.
  * - void setKeepLog(bool log): Enable or disable logging.
  * - void setCurrentTemperature(double temp): Set the current temperature.
@@ -305,6 +601,19 @@ class ProgramManager {
  * - ControlMode getControlMode(): Get the current control mode.
  * - double TargetTemperature(): Get the target temperature.
  * - double CurrentTemperature(): Get the current temperature.
+ * - double ZoneTemperature(uint8_t z): Get the temperature of a zone.
+ * - double ZoneDutyCycle(uint8_t z): Get the duty cycle of a zone.
+ * - double DutyCycle(): Get the mean duty cycle.
+ * - bool IsDegraded(): Check if any probe has been dropped.
+ * - double CoreTemperature(): Get the estimated core temperature of the workpiece.
+ * - bool HasLoadModel(): Check if the core temperature of the workpiece is being estimated.
+ * - double FilteredTemperature(): Get the filtered mean temperature.
+ * - double HeatingRate(): Get the filtered heating rate [/min].
+ * - bool HasHeatwork(): Check if the heatwork is being integrated.
+ * - double HeatworkProgress(): Get the heatwork, as a fraction of the one of the target cone.
+ * - bool IsConeReached(): Check if the heatwork of the target cone has been reached.
+ * - int Cone(): Get the target cone.
+ * - const OvenModel& Oven(): Get the learned model of the oven.
  * - bool KeepLog(): Check if logging is enabled.
  * - double getKp(): Get the Kp parameter of the PID controller.
  * - double getKi(): Get the Ki parameter of the PID controller.
@@ -316,23 +625,46 @@ class ProgramManager {
  * - bool IsDoorOpen(): Check if the door is open.
  * - bool IsTuning(): Check if the system is in PID tuning mode.
  * - bool IsOn(): Check if the heater is on.
+ * - uint8_t ActiveStages(): Get the number of heater stages fired in the current PWM cycle.
+ * - bool IsQuietWindow(): Check if no heater edge is due within PREFETCH_GUARD, so a slow operation can't delay it.
  * - unsigned long lastDoorOpening(): Get the timestamp of the last door opening event.
+ * - bool IsRecovering(): Check if the heaters are boosted to recover from a door opening.
+ * - unsigned long RecoveryStart(): Get the timestamp of the start of the recovery.
+ * - bool IsHolding(): Check if the program is on hold.
+ * - unsigned long HoldTime(): Get the time spent on hold.
+ * - unsigned long HoldInBandTime(): Get the time spent on hold within MAX_TEMP_ERROR of the target.
+ * - double HoldMaxDeviation(): Get the largest deviation from the target during the hold.
+ * - double PeakTemperature(): Get the highest temperature of the run.
+ * - double MaxOvershoot(): Get the largest overshoot of the run.
+ * - double Energy(): Get the energy fed to the heaters during the run [Wh].
  * - void allowFiring(): Allow the heater to turn on.
  * - void denyFiring(): Deny the heater to turn on.
  * - void startFiring(): Start the heater.
  * - void startFiring(double target): Start the heater with a target temperature.
  * - void stopFiring(): Stop the heater.
- * - void ReadTemperature(): Read the current temperature from the probe.
+ * - void switchOffHeaters(): Turn off all the heater stages immediately.
+ * - void ReadTemperature(): Read the current temperature from all the probes.
+ * - void sampleProbes(): Read the next probe in the round-robin schedule, if its slot has come.
  * - void recordDoorOpening(): Record the timestamp of the last door opening event.
+ * - void clearDoorOpening(): Forget the last door opening event, once the door has been closed.
+ * - void startRecovery(): Boost the heaters at full power to recover from a door opening.
+ * - void startHold(): Start holding the current target, and reset the hold statistics.
+ * - void stopHold(): Stop holding.
+ * - void startRunStats(): Reset the statistics of the run.
  * - void updateStatus(SystemState newStatus): Update the system status.
  * - void Clear(): Reset the core system.
+ * - bool dumpBlackBox(): Write the last probe samples to a crash dump, with the error and the log of the run. Only once.
  * - void update(ProgramManager& __prog): Manage the PWM cycle (defined in TEEKeeper.cpp).
  * - void PIDAutotune(): Start the PID autotune process.
+ * - void startLoadModel(double thickness): Start the core temperature estimator for a workpiece of the given thickness [mm].
+ * - bool startHeatwork(int cone): Start integrating the heatwork toward a cone, false if the cone is unknown.
+ * - void saveOvenModel(): Save the learned model of the oven in the EEPROM, if it changed.
  */
 class CoreSystem {
     private:
         // == 1. Temperature and Control State =======================================================
-        TemperatureProbe probe;
+        ControlZone zones[N_ZONES];
+        uint8_t nextProbe = 0;
         SystemState status = IDLE;
         TemperatureUnit unit = CELSIUS;
         ControlMode mode = NORMAL;
@@ -350,10 +682,7 @@ class CoreSystem {
         unsigned long PWMPeriod = CYCLE_TIME;
 
         // == 4. PID Parameters ======================================================================
-        double last_error = 0;
-        double integral = 0;
         unsigned long nextPWMCycle = 0;
-        unsigned long dutyEnd = 0;
 
         // == 5. Heater Control and Security =========================================================
         bool allowFiringHeater = false; // Security flag, overrides program execution
@@ -372,18 +701,54 @@ class CoreSystem {
         // == 9. Autotune Variables ==================================================================
         bool isTuning = false;
 
+        // == 9a. Door Recovery ======================================================================
+        bool recovering = false;
+        unsigned long recoveryStart = 0;    // [ms]
+
+        // == 9b. Hold Statistics ====================================================================
+        bool holding = false;
+        unsigned long holdStart = 0;        // [ms]
+        unsigned long holdInBand = 0;       // [ms]
+        unsigned long lastHoldCheck = 0;    // [ms]
+        double holdMaxDeviation = 0;
+
+        // == 9c. Run Statistics =====================================================================
+        double peakTemperature = 0;
+        double maxOvershoot = 0;
+        double lastCycleTarget = 0;
+        double energy = 0;                  // [Wh]
+
+        // == 9d. Estimators =========================================================================
+        LoadEstimator load;
+        ThermalKalman kalman;
+        HeatworkIntegrator heatwork;
+        OvenModel oven;
+        double toKelvin(double temp) const;
+
         // == 10. Private Methods ====================================================================
-        double PID(const double error);     // Calculate the PID control signal
+        double PID(ControlZone &zone, const double error);  // Calculate the PID control signal of a zone
+        void fireStages(uint8_t z, unsigned long time);     // Distribute the duty cycle over the heater stages
+        void releaseStages();               // Turn off the stages whose duty cycle has ended
+        void writeAllStages(uint8_t level); // Drive all the heater stages to the same level
+        bool readProbe(uint8_t z, uint8_t p);   // Read a probe of a zone
+        void dropProbe(uint8_t z, uint8_t p, const char* reason); // Exclude a failing probe from the vote
+        void voteZone(uint8_t z, uint8_t p);    // Vote the temperature of a zone, check the probe just read
+        void logEvent(const char* message); // Report an event on the log file
+        void logSample(unsigned long time); // Write a log record, if one is due
+        void recordBlackBox(uint8_t z, uint8_t p, bool measured); // Add the probe sample to the black box
+        void updateMeanTemperature();       // Average the zone temperatures
+        void startFilter();                 // Start the Kalman filter from the mean temperature
         void CriticalError();               // Handle critical errors
 
     public:
         // == 1. Constructors ========================================================================
-        CoreSystem(TemperatureProbe &probe);
-        CoreSystem(TemperatureProbe &probe, double kp, double ki, double kd);
+        CoreSystem();
+        CoreSystem(double kp, double ki, double kd);
+        bool begin();   // Initialize the probes and the heater pins
 
         // == 2. Setters =============================================================================
         void setTarget(double target, bool newInstruction = false);
-        void setUnit(TemperatureUnit _unit) { unit = _unit; }
+        void setUnit(TemperatureUnit _unit);
         void updatePID(double _kp, double _ki, double _kd) { kp = _kp; ki = _ki; kd = _kd; }
         void setKeepLog(bool log) { keepLog = log; }
         void setCurrentTemperature(double temp) { currentTemperature = temp; }
@@ -395,6 +760,19 @@ class CoreSystem {
 
         double TargetTemperature() const { return targetTemperature; }
         double CurrentTemperature() const { return currentTemperature; }
+        double ZoneTemperature(uint8_t z) const { return zones[z].temperature; }
+        double ZoneDutyCycle(uint8_t z) const { return zones[z].dutyCycle; }
+        double DutyCycle() const { return dutyCycle; }
+        bool IsDegraded() const;    // True if any probe has been dropped
+        double CoreTemperature() const { return load.CoreTemperature(); }  // Estimated core temperature of the workpiece
+        bool HasLoadModel() const { return load.IsEnabled(); }
+        double FilteredTemperature() const { return kalman.IsInitialized() ? kalman.Temperature() : currentTemperature; }
+        double HeatingRate() const { return kalman.Rate(); }    // [/min]
+        bool HasHeatwork() const { return heatwork.IsEnabled(); }
+        double HeatworkProgress() const { return heatwork.Progress(); }
+        bool IsConeReached() const { return heatwork.IsReached(); }
+        int Cone() const { return heatwork.Cone(); }
+        const OvenModel& Oven() const { return oven; }
 
         double getKp() const { return kp; }
         double getKi() const { return ki; }
@@ -409,8 +787,19 @@ class CoreSystem {
         bool IsDoorOpen() const { return digitalRead(PIN_DOOR_INTERRUPT); } // Check if the door is open
         bool IsTuning() const { return isTuning; }      // Check if the system is in PID tuning mode
         bool IsOn() const { return allowFiringHeater && fireHeater; } // Check if the heater is on
+        uint8_t ActiveStages() const;   // Heater stages fired in the current PWM cycle, over all the zones
+        bool IsQuietWindow() const;     // True if no heater edge is due within PREFETCH_GUARD
 
         unsigned long lastDoorOpening() const { return lastDoorOpenTime; }
+        bool IsRecovering() const { return recovering; }
+        unsigned long RecoveryStart() const { return recoveryStart; }
+        bool IsHolding() const { return holding; }
+        unsigned long HoldTime() const { return millis() - holdStart; }
+        unsigned long HoldInBandTime() const { return holdInBand; }
+        double HoldMaxDeviation() const { return holdMaxDeviation; }
+        double PeakTemperature() const { return peakTemperature; }
+        double MaxOvershoot() const { return maxOvershoot; }
+        double Energy() const { return energy; }    // [Wh]
 
         // == 4. Heater Control Methods ==============================================================
         void allowFiring();                                             // Allow the heater to turn on
@@ -418,18 +807,31 @@ class CoreSystem {
         void startFiring() { fireHeater = true; }                       // Start the heater
         void startFiring(double target) { targetTemperature = target; fireHeater = true; }
         void stopFiring() { fireHeater = false; }                       // Stop the heater
+        void switchOffHeaters();                                        // Turn off all the heater stages
 
         // == 5. Temperature Reading and Stability ===================================================
-        void ReadTemperature(); // Read the temperature
+        void ReadTemperature(); // Read the temperature of all the zones
+        void sampleProbes();    // Round-robin probe sampler
         void recordDoorOpening() { lastDoorOpenTime = millis(); }         // Record the last door opening time
+        void clearDoorOpening() { lastDoorOpenTime = 0; }                 // Forget the door opening, once closed
+        void startRecovery() { recovering = true; recoveryStart = millis(); } // Full power until the target is in reach
+        void startHold();                                               // Hold the current target
+        void stopHold() { holding = false; }
+        void startRunStats();                                           // Reset the statistics of the run
 
         // == 6. System State Management =============================================================
         void updateStatus(SystemState newStatus) { status = newStatus; } // Update the system status
         void Clear();                                                   // Reset the core system
+        bool dumpBlackBox();                                            // Write the last probe samples to a crash dump
 
         // == 7. PID Control =========================================================================
         void update(ProgramManager& __prog);  // Manage the PWM cycle (defined in TEEKeeper.cpp)
         void PIDAutotune();                  // Start the PID autotune process
+
+        // == 8. Estimators ==========================================================================
+        void startLoadModel(double thickness) { load.begin(thickness, currentTemperature, millis()); }
+        bool startHeatwork(int cone) { return heatwork.begin(cone, millis()); }
+        void saveOvenModel();           // Save the learned oven model in the EEPROM, if it changed
 };
 
 
@@ -0,0 +1,240 @@
+#include "TEEK_estimators.h"
+#include <math.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+// host build (tools/kalman_bench.cpp): the cone table stays in RAM
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t*) (p))
+#define pgm_read_word(p) (*(const uint16_t*) (p))
+#endif
+
+// ==== LOAD ESTIMATOR CLASS =====
+
+// Start the estimator for a load of the given thickness [mm].
+// A null thickness disables the load model.
+void LoadEstimator::begin(double thickness, double chamber, unsigned long time){
+  tau = thickness * LOAD_TAU_PER_MM;
+  core = chamber;
+  lastUpdate = time;
+}
+
+// Advance the estimate to the given time.
+// The first order lag is discretized as dt / (tau + dt), which is stable for any time step,
+// so a late update (i.e. after a long blocking SD access) can't make the estimate diverge.
+void LoadEstimator::update(double chamber, unsigned long time){
+  if(tau <= 0) return;
+
+  double dt = (time - lastUpdate) / 1000.0; // [s]
+  lastUpdate = time;
+  core += (chamber - core) * dt / (tau + dt);
+}
+
+
+// ==== THERMAL KALMAN FILTER CLASS =====
+
+// Start the filter from a reading, with a still oven. The ambient and the size of a degree
+// (1 in C and K, 1.8 in F) convert the model, given in C, to the unit of the readings
+void ThermalKalman::begin(double temp, unsigned long time, double _ambient, double degree){
+  T = temp;
+  rate = 0;
+  ambient = _ambient;
+  heatRate = KALMAN_HEAT_RATE * degree;
+  variance = degree * degree;
+  P00 = KALMAN_R * variance;
+  P01 = 0;
+  P11 = KALMAN_Q_RATE * variance * KALMAN_RATE_TAU;
+  lastUpdate = time;
+  initialized = true;
+}
+
+// Propagate the state and its covariance to the given time: x = F x + B u, P = F P F' + Q dt
+void ThermalKalman::predict(double heat, unsigned long time){
+  double dt = (time - lastUpdate) / 1000.0; // [s]
+  lastUpdate = time;
+  if(dt <= 0) return;
+
+  double a = dt / (KALMAN_RATE_TAU + dt);
+  double modelRate = heatRate * heat - KALMAN_COOLING * (T - ambient);
+
+  // state
+  T += rate * dt;
+  rate += a * (modelRate - rate);
+
+  // covariance, with F = [1 dt; f10 f11]
+  double f10 = -a * KALMAN_COOLING;
+  double f11 = 1 - a;
+  double A00 = P00 + dt * P01;
+  double A01 = P01 + dt * P11;
+  double A10 = f10 * P00 + f11 * P01;
+  double A11 = f10 * P01 + f11 * P11;
+  P00 = A00 + A01 * dt + KALMAN_Q_TEMP * variance * dt;
+  P01 = A00 * f10 + A01 * f11;
+  P11 = A10 * f10 + A11 * f11 + KALMAN_Q_RATE * variance * dt;
+}
+
+// Correct the state with a reading of the probes
+void ThermalKalman::update(double temp){
+  double S = P00 + KALMAN_R * variance;
+  double K0 = P00 / S;
+  double K1 = P01 / S;
+  double y = temp - T;
+
+  T += K0 * y;
+  rate += K1 * y;
+
+  // P = (I - K H) P
+  P11 -= K1 * P01;
+  P01 -= K0 * P01;
+  P00 -= K0 * P00;
+}
+
+
+// ==== HEATWORK INTEGRATOR CLASS =====
+
+// Orton cone table: bending temperature [C] of the self supporting cones,
+// heated at 60 C/h in the last 100 C. Kept in flash, it is only read when a program starts.
+struct ConeTemperature {
+  int8_t cone;
+  int16_t temp;   // [C]
+};
+
+static const ConeTemperature coneTable[] PROGMEM = {
+  {-22,  586}, {-21,  600}, {-20,  626}, {-19,  678}, {-18,  715}, {-17,  738},
+  {-16,  772}, {-15,  791}, {-14,  807}, {-13,  837}, {-12,  861}, {-11,  875},
+  {-10,  903}, { -9,  920}, { -8,  942}, { -7,  976}, { -6,  998}, { -5, 1031},
+  { -4, 1063}, { -3, 1086}, { -2, 1102}, { -1, 1119}, {  1, 1137}, {  2, 1142},
+  {  3, 1152}, {  4, 1162}, {  5, 1186}, {  6, 1222}, {  7, 1239}, {  8, 1249},
+  {  9, 1260}, { 10, 1285}
+};
+
+// Start the integration toward a cone. Returns false if the cone is not in the table.
+bool HeatworkIntegrator::begin(int c, unsigned long time){
+  clear();
+  for(uint8_t i = 0; i < sizeof(coneTable) / sizeof(coneTable[0]); i++){
+    if((int8_t) pgm_read_byte(&coneTable[i].cone) != c) continue;
+
+    cone = c;
+    coneTemp = (int16_t) pgm_read_word(&coneTable[i].temp) + 273.15;
+    target = coneTemp * coneTemp / (HEATWORK_REF_RATE / 3600.0 * HEATWORK_ACTIVATION);
+    lastUpdate = time;
+    return true;
+  }
+  return false;
+}
+
+// Integrate the heatwork up to the given time, with the temperature [K] of the last interval
+void HeatworkIntegrator::update(double kelvin, unsigned long time){
+  if(!IsEnabled()) return;
+
+  double dt = (time - lastUpdate) / 1000.0; // [s]
+  lastUpdate = time;
+  if(kelvin <= 0) return;
+  work += exp(-HEATWORK_ACTIVATION * (1 / kelvin - 1 / coneTemp)) * dt;
+}
+
+// Convert a cone name to its integer encoding: "06" -> -6, "6" -> 6
+int HeatworkIntegrator::parseCone(const char* str){
+  int c = atoi(str);
+  return (str[0] == '0') ? -c : c;
+}
+
+
+// ==== OVEN MODEL CLASS =====
+
+static_assert(OVEN_MODEL_BINS <= 16, "The learned bins of the oven model are a 16 bit mask");
+
+// Forget the learned data, all the bins take the default rates
+void OvenModel::setDefault(){
+  data.magic = OVEN_MODEL_MAGIC;
+  data.heatLearned = 0;
+  data.coolLearned = 0;
+  for(uint8_t b = 0; b < OVEN_MODEL_BINS; b++){
+    data.heat[b] = OVEN_DEFAULT_HEAT_RATE * 10;
+    data.cool[b] = OVEN_DEFAULT_COOL_RATE * 10;
+  }
+  changed = false;
+}
+
+// Use a saved model, if it is one (i.e. not a blank EEPROM)
+bool OvenModel::load(const Data& saved){
+  if(saved.magic != OVEN_MODEL_MAGIC) return false;
+  for(uint8_t b = 0; b < OVEN_MODEL_BINS; b++){
+    if(saved.heat[b] <= 0 || saved.cool[b] <= 0) return false;
+  }
+  data = saved;
+  changed = false;
+  return true;
+}
+
+uint8_t OvenModel::bin(double temp){
+  if(temp <= 0) return 0;
+  uint8_t b = temp / OVEN_MODEL_BIN_WIDTH;
+  return b < OVEN_MODEL_BINS ? b : OVEN_MODEL_BINS - 1;
+}
+
+// Take a sample of the filtered rate. Only the full power and the heaters off phases are used,
+// once settled: the rate then measures what the oven can do, not what the controller asked for.
+void OvenModel::learn(double temp, double rate, double power, unsigned long time){
+  int8_t p = (power >= 1) ? 1 : (power <= 0 ? -1 : 0);
+  if(p != phase){
+    phase = p;
+    phaseStart = time;
+    return;
+  }
+  if(phase == 0 || time - phaseStart < OVEN_MODEL_SETTLE || time - lastSample < OVEN_MODEL_SAMPLE_INTERVAL) return;
+  lastSample = time;
+
+  // a heating oven at full power, or a cooling one with the heaters off
+  if(phase * rate <= 0) return;
+  uint8_t b = bin(temp);
+  uint16_t& learned = (phase > 0) ? data.heatLearned : data.coolLearned;
+  int16_t& value = (phase > 0) ? data.heat[b] : data.cool[b];
+  double sample = fabs(rate) * 10;
+
+  // the first sample of a bin replaces the default
+  if(learned & (1 << b)) value += lround((sample - value) * OVEN_MODEL_GAIN);
+  else value = lround(sample);
+  if(value < 1) value = 1;
+  learned |= (1 << b);
+  changed = true;
+}
+
+// Time to go from a temperature to another at the given rate, limited by the capability of the oven [min].
+// The range is integrated in steps of a quarter of a bin.
+double OvenModel::rampTime(double from, double to, double rate) const{
+  const double step = OVEN_MODEL_BIN_WIDTH / 4.0;
+  bool heating = to > from;
+  double remaining = fabs(to - from);
+  double temp = from;
+  double time = 0;
+  rate = fabs(rate);
+
+  while(remaining > 0){
+    double d = remaining < step ? remaining : step;
+    double mid = heating ? temp + d / 2 : temp - d / 2;
+    double capability = heating ? HeatingRate(mid) : CoolingRate(mid);
+    double r = (rate > 0 && rate < capability) ? rate : capability;
+    time += d / r;
+    temp = heating ? temp + d : temp - d;
+    remaining -= d;
+  }
+  return time;
+}
+
+// False if the rate is faster than what the oven was measured to do, somewhere in the range.
+// Bins never measured are not judged.
+bool OvenModel::canFollow(double from, double to, double rate) const{
+  if(rate == 0) return true;
+  bool heating = to > from;
+  double low = heating ? from : to;
+  double high = heating ? to : from;
+
+  for(uint8_t b = bin(low); b <= bin(high); b++){
+    double temp = (b + 0.5) * OVEN_MODEL_BIN_WIDTH;
+    if(!IsLearned(temp, heating)) continue;
+    if(fabs(rate) > (heating ? HeatingRate(temp) : CoolingRate(temp))) return false;
+  }
+  return true;
+}
@@ -0,0 +1,240 @@
+#ifndef TEEK_ESTIMATORS_H
+#define TEEK_ESTIMATORS_H
+
+#include "TEEK_constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+
+// ===== ESTIMATORS ======================================================
+// Lightweight models of the oven and of its load, updated once per PWM cycle.
+// They only use the measured temperatures and the heater command, and never
+// touch the hardware, so that they can be reused by any control mode.
+
+
+//* CLASS LoadEstimator
+/**
+ * @class LoadEstimator
+ * @brief Estimates the core temperature of the workpiece from the chamber temperature.
+ *
+ * Two-node lumped model: the chamber (measured) heats the load through a single thermal
+ * resistance, so the core of the load follows the chamber as a first order lag
+ *      dTcore/dt = (Tchamber - Tcore) / tau
+ * where the time constant tau grows with the thickness of the load (LOAD_TAU_PER_MM).
+ * The load is assumed to be at the chamber temperature when the estimator is started.
+ * The chamber node is not estimated: it is the measured temperature, which drives the load node.
+ * The only state left is the core of the load, so the two-node model is a single first order lag.
+ *
+ * @private
+ * - double tau: Time constant of the load [s], 0 if the estimator is disabled.
+ * - double core: Estimated core temperature.
+ * - unsigned long lastUpdate: Timestamp of the last update [ms].
+ *
+ * @public
+ * - void begin(double thickness, double chamber, unsigned long time): Start the estimator for a load of the given thickness [mm].
+ * - void update(double chamber, unsigned long time): Advance the estimate to the given time.
+ * - void clear(): Disable the estimator.
+ * - double CoreTemperature(): Get the estimated core temperature.
+ * - bool IsEnabled(): Check if a load model is in use.
+ */
+class LoadEstimator {
+    private:
+        double tau = 0;                 // [s]
+        double core = 0;                // [C/F/K]
+        unsigned long lastUpdate = 0;   // [ms]
+
+    public:
+        void begin(double thickness, double chamber, unsigned long time);
+        void update(double chamber, unsigned long time);
+        void clear() { tau = 0; core = 0; lastUpdate = 0; }
+
+        double CoreTemperature() const { return core; }
+        bool IsEnabled() const { return tau > 0; }
+};
+
+
+//* CLASS ThermalKalman
+/**
+ * @class ThermalKalman
+ * @brief Kalman filter estimating the chamber temperature and its heating rate.
+ *
+ * State x = [T, r], with r = dT/dt. Between two readings the state is propagated with a
+ * small thermal model driven by the heater command u (0..1):
+ *      T' = T + r*dt
+ *      r' = r + a*(KALMAN_HEAT_RATE*u - KALMAN_COOLING*(T - ambient) - r),  a = dt/(KALMAN_RATE_TAU + dt)
+ * so the rate relaxes toward the one the model predicts for the current power, with the lag of
+ * the elements. Each reading of the probes then corrects the state (H = [1 0]).
+ * The 2x2 covariance is kept as three scalars. A predict + update step is 26 multiplications,
+ * 23 additions and 4 divisions: about 8000 cycles of the AVR software float, 0.5 ms at 16 MHz,
+ * once per probe slot (25 ns on a PC, see tools/kalman_bench.cpp).
+ * When a reading is missing, only the prediction runs and the estimate coasts on the model.
+ * The model constants are in C: the filter is started with the ambient temperature and the size of
+ * a degree of the system unit, so that it can restart on a hot oven (i.e. at the end of a program)
+ * and still predict its cooling, in any unit.
+ *
+ * @private
+ * - double T: Estimated temperature.
+ * - double rate: Estimated heating rate [/s].
+ * - double P00, P01, P11: Covariance of the estimate.
+ * - double ambient: Ambient temperature, the oven cools toward it.
+ * - double heatRate: KALMAN_HEAT_RATE in the unit of the filter [/s].
+ * - double variance: Square of the size of a degree, scales the noises given in C^2.
+ * - unsigned long lastUpdate: Timestamp of the last prediction [ms].
+ * - bool initialized: True once the filter has been started with a reading.
+ *
+ * @public
+ * - void begin(double temp, unsigned long time, double ambient, double degree): Start the filter from a reading, with the ambient temperature and the size of a degree [C] in the unit of the readings.
+ * - void predict(double heat, unsigned long time): Propagate the state to the given time, with the heater command (0..1).
+ * - void update(double temp): Correct the state with a reading.
+ * - void clear(): Reset the filter, it will restart from the next reading.
+ * - double Temperature(): Get the estimated temperature.
+ * - double Rate(): Get the estimated heating rate [/min].
+ * - bool IsInitialized(): Check if the filter has been started.
+ */
+class ThermalKalman {
+    private:
+        double T = 0;
+        double rate = 0;                // [/s]
+        double P00 = 0, P01 = 0, P11 = 0;
+        double ambient = KALMAN_AMBIENT;
+        double heatRate = KALMAN_HEAT_RATE;     // [/s]
+        double variance = 1;
+        unsigned long lastUpdate = 0;   // [ms]
+        bool initialized = false;
+
+    public:
+        void begin(double temp, unsigned long time, double ambient, double degree);
+        void predict(double heat, unsigned long time);
+        void update(double temp);
+        void clear() { initialized = false; T = 0; rate = 0; }
+
+        double Temperature() const { return T; }
+        double Rate() const { return rate * 60; }   // [/min], as the ramps of the programs
+        bool IsInitialized() const { return initialized; }
+};
+
+
+//* CLASS HeatworkIntegrator
+/**
+ * @class HeatworkIntegrator
+ * @brief Integrates the time-temperature heatwork of a firing, against the one of an Orton cone.
+ *
+ * The heatwork is measured as the Arrhenius-equivalent time at the temperature of the target cone:
+ *      W = integral of exp(-HEATWORK_ACTIVATION * (1/T - 1/Tcone)) dt       [s], T in K
+ * The cone bends when W reaches the value accumulated by the standard ramp of the cone table
+ * (HEATWORK_REF_RATE, in the last part of the firing) up to Tcone, which is about
+ *      Wcone = Tcone^2 / (HEATWORK_REF_RATE * HEATWORK_ACTIVATION)
+ * so a slower firing, or a soak, reaches the cone at a lower temperature.
+ * Cones are encoded as integers, the "0x" cones being negative (i.e. 06 -> -6, 022 -> -22).
+ *
+ * @private
+ * - int cone: Target cone.
+ * - double coneTemp: Temperature of the target cone at the reference rate [K], 0 if disabled.
+ * - double target: Heatwork needed to bend the target cone [s].
+ * - double work: Accumulated heatwork [s].
+ * - unsigned long lastUpdate: Timestamp of the last update [ms].
+ *
+ * @public
+ * - bool begin(int cone, unsigned long time): Start the integration toward a cone. Returns false if the cone is unknown.
+ * - void update(double kelvin, unsigned long time): Integrate the heatwork up to the given time.
+ * - void clear(): Disable the integration.
+ * - static int parseCone(const char* str): Convert a cone name (i.e. "06") to its integer encoding.
+ * - static void coneName(int cone, char* buff): Write the name of a cone (at least 4 chars buffer).
+ * - int Cone(): Get the target cone.
+ * - double Progress(): Get the accumulated heatwork, as a fraction of the one of the target cone.
+ * - bool IsReached(): Check if the target cone has been reached.
+ * - bool IsEnabled(): Check if the heatwork is being integrated.
+ */
+class HeatworkIntegrator {
+    private:
+        int cone = 0;
+        double coneTemp = 0;            // [K]
+        double target = 0;              // [s]
+        double work = 0;                // [s]
+        unsigned long lastUpdate = 0;   // [ms]
+
+    public:
+        bool begin(int cone, unsigned long time);
+        void update(double kelvin, unsigned long time);
+        void clear() { coneTemp = 0; work = 0; }
+        static int parseCone(const char* str);
+        static void coneName(int cone, char* buff) { sprintf(buff, cone < 0 ? "0%d" : "%d", abs(cone)); }
+
+        int Cone() const { return cone; }
+        double Progress() const { return target > 0 ? work / target : 0; }
+        bool IsReached() const { return IsEnabled() && work >= target; }
+        bool IsEnabled() const { return coneTemp > 0; }
+};
+
+
+//* CLASS OvenModel
+/**
+ * @class OvenModel
+ * @brief Learned heating and cooling capability of the oven, by temperature bin.
+ *
+ * For each bin of OVEN_MODEL_BIN_WIDTH (in C), the model keeps the heating rate at full power and
+ * the natural cooling rate with the heaters off. They are learned from the rate of the Kalman filter,
+ * once the heaters have been at full power (or off) for OVEN_MODEL_SETTLE, with an exponential
+ * average. The bins that have never been measured return the default rates, and are flagged as such,
+ * so that the checks of a program only rely on measured data.
+ * The data is plain, to be saved in the EEPROM by the owner of the model.
+ * All the temperatures are in C, the rates in C/min.
+ *
+ * @private
+ * - Data data: Rates of the bins [0.1 C/min], and the bins learned so far.
+ * - int8_t phase: 1 at full power, -1 with the heaters off, 0 otherwise.
+ * - unsigned long phaseStart: Timestamp of the start of the phase [ms].
+ * - unsigned long lastSample: Timestamp of the last sample [ms].
+ * - bool changed: True if the model has been updated since it was loaded.
+ * - static uint8_t bin(double temp): Bin of a temperature.
+ *
+ * @public
+ * - void setDefault(): Forget the learned data.
+ * - bool load(const Data& saved): Use a saved model. Returns false (and keeps the defaults) if it isn't valid.
+ * - void learn(double temp, double rate, double power, unsigned long time): Take a sample, at the given power (0..1).
+ * - void interrupt(): Restart the settling time (i.e. door open).
+ * - double HeatingRate(double temp): Heating rate at full power.
+ * - double CoolingRate(double temp): Natural cooling rate, positive.
+ * - bool IsLearned(double temp, bool heating): Check if the rate of the bin has been measured.
+ * - double rampTime(double from, double to, double rate): Time to go from a temperature to another [min], at the given rate (0 = as fast as possible).
+ * - bool canFollow(double from, double to, double rate): False if a measured bin in between is slower than the rate.
+ * - bool IsChanged(): Check if the model has to be saved.
+ * - const Data& Raw(): The data to be saved.
+ */
+class OvenModel {
+    public:
+        struct Data {
+            uint16_t magic = 0;
+            uint16_t heatLearned = 0;           // bit mask of the learned bins
+            uint16_t coolLearned = 0;
+            int16_t heat[OVEN_MODEL_BINS];      // [0.1 C/min]
+            int16_t cool[OVEN_MODEL_BINS];      // [0.1 C/min]
+        };
+
+    private:
+        Data data;
+        int8_t phase = 0;
+        unsigned long phaseStart = 0;   // [ms]
+        unsigned long lastSample = 0;   // [ms]
+        bool changed = false;
+        static uint8_t bin(double temp);
+
+    public:
+        OvenModel() { setDefault(); }
+        void setDefault();
+        bool load(const Data& saved);
+        void learn(double temp, double rate, double power, unsigned long time);
+        void interrupt() { phase = 0; }
+
+        double HeatingRate(double temp) const { return data.heat[bin(temp)] / 10.0; }
+        double CoolingRate(double temp) const { return data.cool[bin(temp)] / 10.0; }
+        bool IsLearned(double temp, bool heating) const { return (heating ? data.heatLearned : data.coolLearned) & (1 << bin(temp)); }
+        double rampTime(double from, double to, double rate) const;
+        bool canFollow(double from, double to, double rate) const;
+        bool IsChanged() const { return changed; }
+        const Data& Raw() { changed = false; return data; }
+};
+
+
+#endif
@@ -7,6 +7,9 @@ MainMenuScreen      __mainMenuScreen;       // Main menu
 FileMenuScreen      __fileMenuScreen;       // > Load from SD
 SettingsMenuScreen  __settingsMenuScreen;   // > Settings
 TargetUpdateScreen  __targetUpdateScreen;   // > Settings >> Target update functionality
+PreflightScreen     __preflightScreen;      // > Select from SD >> program analysis before the start
+SdInfoScreen        __sdInfoScreen;         // > Settings >> SD card diagnostics
+HistoryScreen       __historyScreen;        // > History
 
 ExecutionScreen     __executionScreen;      // Program execution screen
 TuneScreen          __tuneScreen;           // Execution tuning screen
@@ -80,7 +83,7 @@ void drawMainMenu(TFT_HX8357& tft) {
     tft.print("TEMP:");
     tft.setTextSize(5);
     tft.setCursor(145, 50);
-    tft.print(__core.CurrentTemperature(), 2);
+    tft.print(__core.FilteredTemperature(), 2);
     tft.setTextSize(3);
     switch(__core.Unit()) {
       case 0: tft.print(" [C]"); break;
@@ -280,7 +283,7 @@ void drawCriticalError(TFT_HX8357& tft, char* message){
 
 //* 1. Main Menu Screen =====================================================================
 // Definition outside the class
-const char* MainMenuScreen::menuItems[3] = {"> Select from SD", "> Settings", "> Stop"};
+const char* MainMenuScreen::menuItems[4] = {"> Select from SD", "> Settings", "> History", "> Stop"};
 
 // Constructor
 MainMenuScreen::MainMenuScreen() : menuIndex(0) {};
@@ -297,7 +300,7 @@ void MainMenuScreen::render(TFT_HX8357& tft) {
   tft.print("TEMP:");
   tft.setTextSize(5);
   tft.setCursor(145, 50);
-  tft.print(__core.CurrentTemperature(), 2);
+  tft.print(__core.FilteredTemperature(), 2);
   tft.setCursor(360,50);
   tft.setTextSize(3);
   switch(__core.Unit()) {
@@ -328,7 +331,7 @@ void MainMenuScreen::render(TFT_HX8357& tft) {
   tft.setTextSize(2);
   tft.setCursor(30, 150);
   for (int i = 0; i < menuCount; i++) {
-    tft.setCursor(30, 150 + i * 50); // Adjust position for each item
+    tft.setCursor(30, 150 + i * 40); // Adjust position for each item
     if (i == menuIndex) {
       tft.setTextColor(TEEK_BLACK, TEEK_YELLOW); // Highlight current selection
     } else {
@@ -360,7 +363,16 @@ void MainMenuScreen::handleSelection(){
     case 1: // "> Settings"
       __GUI.setScreen(&__settingsMenuScreen);
       break;
-    case 2: // "> Stop"
+    case 2: // "> History"
+      if (__sd.begin(PIN_SD_CS) && __historyScreen.Initialise()) {
+        __GUI.setScreen(&__historyScreen);
+      } else {
+        drawSoftError(__screen, (char *) "No run in the history.");
+        delay(2000);
+        __GUI.setScreen(&__mainMenuScreen);
+      }
+      break;
+    case 3: // "> Stop"
       __core.stopFiring();  // Stop firing
       __core.setTarget(0);  // Set target to 0
       __program.clearProgram();   // Reset the program
@@ -381,7 +393,7 @@ void MainMenuScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
     tft.setTextSize(2);
     tft.setCursor(30, 150);
     for (int i = 0; i < menuCount; i++) {
-      tft.setCursor(30, 150 + i * 50); // Adjust position for each item
+      tft.setCursor(30, 150 + i * 40); // Adjust position for each item
       if (i == menuIndex) {
         tft.setTextColor(TEEK_BLACK, TEEK_YELLOW); // Highlight current selection
       } else {
@@ -401,7 +413,7 @@ void MainMenuScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
     tft.setTextSize(5);
     tft.setCursor(145, 50);
     tft.setTextColor(TEEK_BLUE, TEEK_SILVER);
-    tft.print(__core.CurrentTemperature(), 2);
+    tft.print(__core.FilteredTemperature(), 2);
     tft.setTextSize(3);
     lastUpdateTime = millis();
 
@@ -431,7 +443,7 @@ void MainMenuScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
 
 //* 2. SettingsMenuScreen Implementation ==================================================
 
-const char* SettingsMenuScreen::menuItems[5] = {"< Back", "> Target: ", "> Unit: ", "> PID Autotune", "> Keep log: "};
+const char* SettingsMenuScreen::menuItems[6] = {"< Back", "> Target: ", "> Unit: ", "> PID Autotune", "> Keep log: ", "> SD card"};
 
 SettingsMenuScreen::SettingsMenuScreen() : menuIndex(0) {};
 
@@ -500,7 +512,7 @@ void SettingsMenuScreen::handleSelection() {
       break;
 
     case 2: // "> Unit: [C/F/K]"
-      currentUnit = (currentUnit + 1) % 3; // Cycle through the temperature units
+      currentUnit = ((int) __core.Unit() + 1) % 3; // Cycle through the temperature units
       __core.setUnit((TemperatureUnit)currentUnit); // Update the unit in the core system
       __core.setTarget(MIN_TEMPERATURE); // Erase the target temperature
       render(__screen); // Refresh the screen
@@ -522,6 +534,21 @@ void SettingsMenuScreen::handleSelection() {
       render(__screen); // Refresh the screen
       break;
 
+    case 5: // "> SD card"
+      // the survey reads the whole FAT: done once here, not at every render
+      __screen.setTextSize(2);
+      __screen.setTextColor(TEEK_BLUE, TEEK_SILVER);
+      __screen.setCursor(250, 56);
+      __screen.print("Reading card...");
+      if (__sd.begin(PIN_SD_CS) && __logManager.survey()) {
+        __GUI.setScreen(&__sdInfoScreen);
+      } else {
+        drawSoftError(__screen, (char *) "ERROR: SD card not found.");
+        delay(2000);
+        render(__screen);
+      }
+      break;
+
     default:
       render(__screen); // Invalid selection, refresh the screen
       break;
@@ -613,7 +640,7 @@ void TargetUpdateScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
 void CriticalErrorScreen::render(TFT_HX8357& tft) {
   extern CoreSystem __core;
   __core.denyFiring();
-  digitalWrite(PIN_HEATER, LOW);
+  __core.switchOffHeaters();
 
   drawCriticalError(tft);
 }
@@ -782,11 +809,17 @@ void FileMenuScreen::handleSelection() {
       // Load the program from the file
       extern ProgramManager __program;
       if (__program.loadProgram(file)) {  
-        __core.updateStatus(BEGIN);           // start execution
-        __GUI.setScreen(&__executionScreen);  // move to the execution screen
+        if (__program.HasUnit()) __core.setUnit(__program.Unit());   // the program declares its unit
+        // check the program against the oven before the start
+        if (__program.preflight(__core.Oven(), __core.Unit(), __core.FilteredTemperature())) {
+          __GUI.setScreen(&__preflightScreen);
+        } else {
+          drawSoftError(__screen);            // streamed program that can't be read back
+          __program.clearProgram();
+          __GUI.setScreen(&__mainMenuScreen);
+        }
       } else {
-        drawSoftError(__screen, (char*) "Invalid or corrupted program file.");
-        delay(2000);
+        drawSoftError(__screen);              // show the reason reported by the loader
         __GUI.setScreen(&__mainMenuScreen);
         file.close();  // Close the file when done
       }
@@ -808,6 +841,21 @@ ExecutionScreen::ExecutionScreen() {
   // Initialization logic
 }
 
+// Print the temperature of each zone on a single line: "Z1: xxxx  Z2: xxxx  Z3: xxxx"
+// Single zone systems already show it in the TEMP field.
+static void drawZoneTemperatures(TFT_HX8357& tft, uint16_t bgColour){
+  if(N_ZONES < 2) return;
+
+  tft.setTextSize(2);
+  tft.setTextColor(TEEK_BLUE, bgColour);
+  tft.fillRect(30, 180, 450, 20, bgColour);
+  for(uint8_t z = 0; z < N_ZONES; z++){
+    tft.setCursor(30 + z * 145, 180);
+    tft.print("Z"); tft.print(z + 1); tft.print(": ");
+    tft.print(__core.ZoneTemperature(z), 0);
+  }
+}
+
 
 // Implement the render method
 void ExecutionScreen::render(TFT_HX8357& tft) {
@@ -828,7 +876,7 @@ void ExecutionScreen::render(TFT_HX8357& tft) {
   tft.print("TEMP:");
   tft.setTextSize(5);
   tft.setCursor(145, 50);
-  tft.print(__core.CurrentTemperature(), 2);
+  tft.print(__core.FilteredTemperature(), 2);
   tft.setCursor(360,50);
   tft.setTextSize(3);
   switch(__core.Unit()) {
@@ -864,13 +912,14 @@ void ExecutionScreen::render(TFT_HX8357& tft) {
 //    |   TEMP: [Current Temperature] [Unit]
 //    |   Target: [Target Temperature] [Unit]   Status: [ON/OFF]
 //    |
-//    |   System: [RAMPING/STABLE/SOAKING]  [HH:MM:SS, Soaking Time Remaining]
+//    |   System: [RAMPING/STABLE/SOAKING]  [HH:MM:SS, Soaking Time Remaining]  C[Cone] [Heatwork %]
 //    |
 //    |   TODO [MESSAGES FROM THE SYSTEM]
+//    |   Z1: [Zone 1 Temperature]  Z2: [...]   (multi-zone systems only)
 //    |
-//    |   Executing: [Program Name]
-//    |   Instr # [Instruction Index] of [Total Instructions] - [Current Instruction Name]
-//    |   Elapsed: [HH:MM, Elapsed Time] 
+//    |   Executing: [Program Name]    Left: [HH:MM:SS, Estimated Remaining Time]
+//    |   Instr # [Instruction Index] of [Total Instructions] [xIteration/Times] - [Current Instruction Name]
+//    |   Elapsed: [HH:MM, Elapsed Time]    Core: [Estimated Core Temperature] (load model only)
 //    |___________________________________________________________________________________
 //  
 //    ! the first two lines are already displayed by the main menu screen, and don't need
@@ -908,17 +957,33 @@ void ExecutionScreen::render(TFT_HX8357& tft) {
       tft.setTextColor(TEEK_BLUE, bgColour);
     }  
 
+    drawZoneTemperatures(tft, bgColour);
+
+    tft.setTextColor(TEEK_BLUE, bgColour);
     tft.setCursor(30, 210);
-    tft.print("Executing:   "); tft.print(__program.Name());
+    char progName[11];
+    snprintf(progName, sizeof(progName), "%s", __program.Name());
+    if(strlen(__program.Name()) > 10) strcpy(progName + 7, "...");  // truncate the name if it is too long
+    tft.print("Executing: "); tft.print(progName);
+    tft.setCursor(300, 210);
+    tft.print("Left:");
     tft.setCursor(30, 240);
     tft.print("Instr #"); tft.print(__program.InstructionIndex()+1); 
     tft.print(" of "); tft.print(__program.NumOfInstructions());
+    if(__program.RepeatTimes()){  // iteration of the repeat block
+      tft.print(" x"); tft.print(__program.RepeatIteration());
+      tft.print("/"); tft.print(__program.RepeatTimes());
+    }
     char buff[13];
-    snprintf(buff, 13, "%s...", __program.CurrentInstruction().name);
-    tft.print(" - "); tft.print(__program.CurrentInstruction().name);
+    snprintf(buff, 13, "%s...", __program.CurrentInstructionName());
+    tft.print(" - "); tft.print(__program.CurrentInstructionName());
     tft.setCursor(30, 270);
     tft.setTextColor(TEEK_BLUE, bgColour);
     tft.print("Elapsed: ");
+    if(__core.HasLoadModel()){
+      tft.setCursor(270, 270);
+      tft.print("Core: ");
+    }
     // == END OF NORMAL MODE
   }
   else {  // ------------------------------------------------------------------------
@@ -961,14 +1026,15 @@ void ExecutionScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
       case PID_AUTOTUNE: bgColour = TEEK_YELLOW; break;
     } 
 
-    // Update the fields at a fixed interval
-    if(millis()-lastUpdateTime > MIN_TIME_BETWEEN_SCREEN_UPDATES) {
+    // Update the fields at a fixed interval, slower while holding
+    unsigned long updateInterval = __core.IsHolding() ? HOLD_SCREEN_UPDATE_INTERVAL : MIN_TIME_BETWEEN_SCREEN_UPDATES;
+    if(millis()-lastUpdateTime > updateInterval) {
       // update the temperature reading
       tft.fillRect(145, 50, 200, 40, bgColour);
       tft.setTextSize(5);
       tft.setCursor(145, 50);
       tft.setTextColor(TEEK_BLUE, bgColour);
-      tft.print(__core.CurrentTemperature(), 2);
+      tft.print(__core.FilteredTemperature(), 2);
       tft.setTextSize(3);
       lastUpdateTime = millis();
 
@@ -987,7 +1053,12 @@ void ExecutionScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
           tft.setCursor(30, 130);
           tft.print("System:"); // Current temperature behaviour: RAMPING, STABLE, SOAKING
           tft.setCursor(120, 130);
-          if(__core.IsStable()){
+          if(__core.IsHolding()){
+            tft.setTextColor(TEEK_YELLOW, bgColour);
+            tft.print("HOLDING");
+            tft.setTextColor(TEEK_BLUE, bgColour);
+          }
+          else if(__core.IsStable()){
             if(__program.IsSoaking()){
               tft.setTextColor(TEEK_YELLOW, bgColour);
               tft.print("SOAKING");
@@ -1008,15 +1079,22 @@ void ExecutionScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
             tft.setTextColor(TEEK_BLUE, bgColour);            
           }
 
+          // update the zone temperatures
+          drawZoneTemperatures(tft, bgColour);
+
           // update the instruction index
-          if(lastInstructionIndex != __program.InstructionIndex()){
+          if(lastInstructionIndex != __program.InstructionIndex() || lastIteration != __program.RepeatIteration()){
             tft.setCursor(30, 240);
             tft.fillRect(30, 240, 450, 25, bgColour);
             tft.setTextColor(TEEK_BLUE, bgColour);
             tft.print("Instr #"); tft.print(__program.InstructionIndex()+1); 
             tft.print(" of "); tft.print(__program.NumOfInstructions());
+            if(__program.RepeatTimes()){  // iteration of the repeat block
+              tft.print(" x"); tft.print(__program.RepeatIteration());
+              tft.print("/"); tft.print(__program.RepeatTimes());
+            }
             char instrName[13];
-            snprintf(instrName, 12, "%s", __program.CurrentInstruction().name);
+            snprintf(instrName, 12, "%s", __program.CurrentInstructionName());
             // truncate the instruction name if it is too long
             if(strlen(instrName) > 11){
               instrName[12] = '\0';
@@ -1027,6 +1105,7 @@ void ExecutionScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
 
             tft.print(" - "); tft.print(instrName);
             lastInstructionIndex = __program.InstructionIndex();
+            lastIteration = __program.RepeatIteration();
           }
 
         case PID_AUTOTUNE: // ---------------------------------------------------------
@@ -1038,13 +1117,18 @@ void ExecutionScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
 
     // update timers at a 1 sec intervals
     // This update time is also used for time critical events
-    if(millis()-lastTimerUpdate > 1000){
+    if(millis()-lastTimerUpdate > (__core.IsHolding() ? updateInterval : 1000)){
       switch(__core.getControlMode()){
 
         case NORMAL:
           buff[0] = '\0'; // clear the buffer
-          // update the soak timer
-          if(__core.IsStable() && __program.IsSoaking()){
+          // update the hold timer, or the soak timer
+          if(__core.IsHolding()){
+            tft.setCursor(240, 130);
+            timeStampConverter(__core.HoldTime(), buff, 3);
+            tft.print(buff);
+          }
+          else if(__core.IsStable() && __program.IsSoaking()){
             tft.setCursor(240, 130);
             timeStampConverter(__program.remainingSoakTime(), buff, 3);
             tft.setTextColor(TEEK_BLUE, TEEK_YELLOW);  // print the timer with a yellow background
@@ -1059,6 +1143,27 @@ void ExecutionScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
           timeStampConverter(__program.elapsedTime(), buff);
           tft.print(buff);
 
+          // update the estimated remaining time, waits excluded
+          tft.setCursor(366, 210);
+          timeStampConverter(__program.RemainingTime(), buff, 3);
+          tft.print(buff);
+
+          // update the heatwork, as a percentage of the one of the target cone
+          if(__core.HasHeatwork()){
+            char cone[5];
+            HeatworkIntegrator::coneName(__core.Cone(), cone);
+            tft.setCursor(350, 130);
+            tft.print("C"); tft.print(cone); tft.print(" ");
+            tft.print(__core.HeatworkProgress() * 100, 0); tft.print("% ");
+          }
+
+          // update the estimated core temperature of the workpiece
+          if(__core.HasLoadModel()){
+            tft.setCursor(342, 270);
+            tft.print(__core.CoreTemperature(), 0);
+            tft.print("  ");
+          }
+
           // update the system's status
           // update system status ASAP
           tft.setCursor(240, 100);
@@ -1098,7 +1203,7 @@ void ExecutionScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
       }
 
       // update timer timestamp
-      lastTimerUpdate = 0;
+      lastTimerUpdate = millis();
     }
 
   // Handle inputs
@@ -1117,7 +1222,7 @@ void ExecutionScreen::handleSelection() {
   else {
     // if we are expecting an action from the user, move to the next instruction
     extern ProgramManager __program;
-    if(__program.CurrentInstruction().waitForButtonPress){
+    if(__program.CurrentInstruction().WaitForButtonPress()){
       __program.ConfirmButtonPressed();  // confirm the button press
       messageStream[0] = '\0';        // clear the message stream
     }
@@ -1134,7 +1239,7 @@ void ExecutionScreen::handleSelection() {
 TuneScreen::TuneScreen() : menuIndex(0), confirmStop(false) {};
 
 
-const char * TuneScreen::menuItems[4] = {"< Back", "> Target: ", "> Keep log: ", "> Stop"};
+const char * TuneScreen::menuItems[5] = {"< Back", "> Target: ", "> Keep log: ", "> Hold  ", "> Stop"};
 
 void TuneScreen::render(TFT_HX8357& tft){
 
@@ -1155,7 +1260,8 @@ void TuneScreen::render(TFT_HX8357& tft){
     } else {
       tft.setTextColor(TEEK_BLACK, TEEK_SILVER); // Normal text
     }
-    tft.print(menuItems[i]); // Print the menu item
+    if(i == 3 && __core.IsHolding()) tft.print("> Resume");
+    else tft.print(menuItems[i]); // Print the menu item
     switch(i){
     case 1: // "> Target: xxxx.xx"
       tft.print(__core.TargetTemperature(), 0);
@@ -1164,7 +1270,7 @@ void TuneScreen::render(TFT_HX8357& tft){
       if(__core.KeepLog()) tft.print("Yes");
       else tft.print("No ");
       break;
-    case 3:  // "> Stop"
+    case 4:  // "> Stop"
       if(confirmStop) {
         tft.setCursor(320, 100 + i * 35);
         tft.setTextColor(TEEK_SILVER, RED);
@@ -1192,7 +1298,15 @@ void TuneScreen::handleSelection() {
       render(__screen); // Refresh the screen
       break;
 
-    case 3: // "> Stop"
+    case 3: // "> Hold" / "> Resume"
+      // the hold is managed by the state machine, only a running program can be held.
+      // A held program with the door open, or recovering from it, is released once back in HOLD
+      if(__core.Status() == HOLD) __core.updateStatus(EXECUTING);
+      else if(__core.Status() == EXECUTING) __core.updateStatus(HOLD);
+      __GUI.setScreen(&__executionScreen);
+      break;
+
+    case 4: // "> Stop"
       // manage double confirmation
       if(confirmStop) {
         __core.updateStatus(USER_STOP);     // Update the system status
@@ -1214,7 +1328,7 @@ void TuneScreen::handleSelection() {
   }
 
   // Reset the PID autotune confirmation flag
-  if(menuIndex != 3 && confirmStop) {
+  if(menuIndex != 4 && confirmStop) {
     confirmStop = false;
   }
 };
@@ -1234,7 +1348,8 @@ void TuneScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
       } else {
         tft.setTextColor(TEEK_BLACK, TEEK_SILVER); // Normal text
       }
-      tft.print(menuItems[i]); // Print the menu item
+      if(i == 3 && __core.IsHolding()) tft.print("> Resume");
+      else tft.print(menuItems[i]); // Print the menu item
     }
 
     // reset the correct text color just to be sure
@@ -1251,6 +1366,272 @@ void TuneScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
 
 
 
+//* 8. PreflightScreen Implementation ====================================================
+
+const char* PreflightScreen::menuItems[2] = {"< Cancel", "> Start"};
+
+void PreflightScreen::render(TFT_HX8357& tft) {
+  const PreflightReport& report = __program.Preflight();
+  const char units[] = {'C', 'F', 'K'};
+  char unit = units[__core.Unit()];
+
+  // fill screen with the background color
+  tft.fillRect(0, 40, 480, 260, TEEK_SILVER);
+
+  // top menu title
+  tft.setTextColor(TEEK_BLUE, TEEK_SILVER);
+  tft.setTextSize(3);
+  tft.setCursor(30, 50);
+  tft.print("Preflight:");
+
+  tft.setTextSize(2);
+  tft.setTextColor(TEEK_BLACK, TEEK_SILVER);
+  tft.setCursor(30, 90);
+  tft.print(__program.Name());
+
+  // runtime as h:mm, it can be longer than the 24 h of timeStampConverter
+  unsigned long minutes = (report.runtime + 30) / 60;
+  tft.setCursor(30, 115);
+  tft.print("Runtime: ");
+  tft.print(minutes / 60);
+  tft.print(minutes % 60 < 10 ? "h0" : "h");
+  tft.print(minutes % 60);
+  if (report.hasWaits) tft.print(" + waits");
+
+  tft.setCursor(30, 140);
+  tft.print("Peak: ");
+  tft.print(report.peakTarget, 0);
+  tft.print(unit);
+  tft.print("  Max rate: ");
+  tft.print(report.maxRate, 0);
+  tft.print(unit);
+  tft.print("/min");
+
+  // warnings, on the first offending instruction of each check
+  tft.setCursor(30, 165);
+  if (report.overTemperature > 0 || report.unreachableRamp > 0) {
+    tft.setTextColor(RED, TEEK_SILVER);
+    if (report.overTemperature > 0) {
+      tft.print("Instr ");
+      tft.print(report.overTemperature);
+      tft.print(": over max temperature");
+      tft.setCursor(30, 190);
+    }
+    if (report.unreachableRamp > 0) {
+      tft.print("Instr ");
+      tft.print(report.unreachableRamp);
+      tft.print(": ramp too fast for oven");
+    }
+    tft.setTextColor(TEEK_BLACK, TEEK_SILVER);
+  }
+  else if (!report.modelLearned) tft.print("Oven model not learned yet");
+  else tft.print("Checks: OK");
+
+  renderMenu(tft);
+};
+
+void PreflightScreen::renderMenu(TFT_HX8357& tft) {
+  tft.setTextSize(3);
+  for (int i = 0; i < menuCount; i++) {
+    tft.setCursor(30 + i * 220, 240);
+    if (i == menuIndex) tft.setTextColor(TEEK_BLACK, TEEK_YELLOW); // Highlight current selection
+    else tft.setTextColor(TEEK_BLACK, TEEK_SILVER);
+    tft.print(menuItems[i]);
+  }
+  tft.setTextColor(TEEK_BLACK, TEEK_SILVER);
+};
+
+void PreflightScreen::handleSelection() {
+  if (menuIndex == 0) {
+    // "< Cancel": the program is dropped
+    __program.clearProgram();
+    __GUI.setScreen(&__mainMenuScreen);
+  } else {
+    // "> Start"
+    __core.updateStatus(BEGIN);           // start execution
+    __GUI.setScreen(&__executionScreen);  // move to the execution screen
+  }
+  menuIndex = 1;
+};
+
+void PreflightScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
+  int encoderValue = encoder.getValue();
+  if (encoderValue != 0) {
+    menuIndex = ((menuIndex + encoderValue) % menuCount + menuCount) % menuCount;
+    renderMenu(tft);
+  }
+
+  // Handle encoder button press
+  if (encoder.getButton() == ClickEncoder::Clicked) {
+    handleSelection();
+  }
+};
+
+
+
+
+//* 9. SdInfoScreen Implementation ======================================================
+
+void SdInfoScreen::render(TFT_HX8357& tft) {
+  // fill screen with the background color
+  tft.fillRect(0, 40, 480, 260, TEEK_SILVER);
+
+  // top menu title
+  tft.setTextColor(TEEK_BLUE, TEEK_SILVER);
+  tft.setTextSize(3);
+  tft.setCursor(30, 50);
+  tft.print("SD card:");
+
+  tft.setTextSize(2);
+  tft.setTextColor(TEEK_BLACK, TEEK_SILVER);
+  tft.setCursor(30, 90);
+  tft.print("Used: ");
+  tft.print((__logManager.TotalKB() - __logManager.FreeKB()) / 1048576.0, 2);
+  tft.print(" of ");
+  tft.print(__logManager.TotalKB() / 1048576.0, 2);
+  tft.print(" GB");
+
+  tft.setCursor(30, 115);
+  tft.print("Logs: ");
+  tft.print(__logManager.Count());
+  tft.print(", ");
+  tft.print(__logManager.Bytes() / 1048576.0, 2);
+  tft.print(" MB");
+
+  // retention limits, the oldest logs are removed beyond them
+  tft.setCursor(30, 140);
+  tft.print("Kept: max ");
+  tft.print(LOG_MAX_COUNT);
+  tft.print(" logs, ");
+  tft.print(LOG_MAX_BYTES / 1048576UL);
+  tft.print(" MB");
+
+  char line[MAX_CHAR_PER_LINE + 1];
+  snprintf(line, sizeof(line), "Folders: /logs/%03lu - %03lu", (unsigned long) __logManager.FirstShard(), (unsigned long) __logManager.LastShard());
+  tft.setCursor(30, 165);
+  tft.print(line);
+
+  snprintf(line, sizeof(line), "Next log: %05lu", (unsigned long) __logManager.NextSequence());
+  tft.setCursor(30, 190);
+  tft.print(line);
+
+  tft.setTextSize(3);
+  tft.setCursor(30, 240);
+  tft.setTextColor(TEEK_BLACK, TEEK_YELLOW);
+  tft.print("< Back");
+  tft.setTextColor(TEEK_BLACK, TEEK_SILVER);
+};
+
+void SdInfoScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
+  encoder.getValue();   // a single item, the rotation is ignored
+
+  if (encoder.getButton() == ClickEncoder::Clicked) {
+    __GUI.setScreen(&__settingsMenuScreen);
+  }
+};
+
+
+
+
+//* 10. HistoryScreen Implementation ====================================================
+
+bool HistoryScreen::Initialise() {
+  runCount = __logManager.Summaries();
+  runIndex = runCount - 1;    // the newest run
+  return runCount > 0;
+};
+
+void HistoryScreen::render(TFT_HX8357& tft) {
+  const char units[] = {'C', 'F', 'K'};
+  TklSummary run;
+  bool ok = __logManager.readSummary(runIndex, run);
+
+  // fill screen with the background color
+  tft.fillRect(0, 40, 480, 260, TEEK_SILVER);
+
+  // top menu title, and the page
+  tft.setTextColor(TEEK_BLUE, TEEK_SILVER);
+  tft.setTextSize(3);
+  tft.setCursor(30, 50);
+  tft.print("History:");
+  tft.setTextSize(2);
+  tft.setCursor(330, 56);
+  tft.print(runCount - runIndex);
+  tft.print("/");
+  tft.print(runCount);
+
+  tft.setTextColor(TEEK_BLACK, TEEK_SILVER);
+  if (!ok) {
+    tft.setCursor(30, 90);
+    tft.print("Run index unreadable.");
+  } else {
+    char unit = units[run.unit < 3 ? run.unit : 0];
+    char line[MAX_CHAR_PER_LINE + 1];
+
+    tft.setCursor(30, 90);
+    tft.print(run.program);
+
+    snprintf(line, sizeof(line), "Log %05lu  ", (unsigned long) run.sequence);
+    tft.setCursor(30, 115);
+    tft.print(line);
+    switch (run.status) {
+      case TKL_END:       tft.setTextColor(GREEN, TEEK_SILVER); tft.print("Completed"); break;
+      case TKL_USER_STOP: tft.setTextColor(TEEK_BLUE, TEEK_SILVER); tft.print("Stopped"); break;
+      default:            tft.setTextColor(RED, TEEK_SILVER); tft.print("Error"); break;
+    }
+    tft.setTextColor(TEEK_BLACK, TEEK_SILVER);
+
+    // duration as h:mm, a firing can be longer than the 24 h of timeStampConverter
+    unsigned long minutes = (run.duration + 30) / 60;
+    snprintf(line, sizeof(line), "Duration: %luh%02lu", minutes / 60, minutes % 60);
+    tft.setCursor(30, 140);
+    tft.print(line);
+
+    tft.setCursor(30, 165);
+    tft.print("Peak: ");
+    tft.print(run.peak / 10.0, 0);
+    tft.print(unit);
+    tft.print("  Overshoot: ");
+    tft.print(run.overshoot / 10.0, 1);
+    tft.print(unit);
+
+    tft.setCursor(30, 190);
+    tft.print("Energy: ");
+    tft.print(run.energy / 1000.0, 1);
+    tft.print(" kWh");
+  }
+
+  tft.setTextSize(3);
+  tft.setCursor(30, 240);
+  tft.setTextColor(TEEK_BLACK, TEEK_YELLOW);
+  tft.print("< Back");
+  tft.setTextSize(2);
+  tft.setTextColor(TEEK_BLACK, TEEK_SILVER);
+  tft.setCursor(250, 246);
+  tft.print("Turn: older/newer");
+};
+
+void HistoryScreen::update(ClickEncoder& encoder, TFT_HX8357& tft) {
+  // turn clockwise for the older runs
+  int encoderValue = encoder.getValue();
+  if (encoderValue != 0) {
+    long index = (long) runIndex - encoderValue;
+    if (index < 0) index = 0;
+    if (index > runCount - 1) index = runCount - 1;
+    if (index != runIndex) {
+      runIndex = index;
+      render(tft);
+    }
+  }
+
+  if (encoder.getButton() == ClickEncoder::Clicked) {
+    __GUI.setScreen(&__mainMenuScreen);
+  }
+};
+
+
+
+
 //* % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % % %
 
 //* ScreenManager Implementation ==================================
@@ -28,11 +28,15 @@ Current menu structure
 Main Menu
   > Select from SD
     > list of files
+      > preflight: Cancel / Start
+  > History: summaries of the past runs
   > Settings
     > Target
     > Unit
     > Pid Autotune
         > confirm?
+    > Keep log
+    > SD card: usage and logs
   > Stop
 */
 
@@ -108,6 +112,9 @@ inline double MIN_TEMP(int unit) {
 // - FileMenuScreen: list of files in the SD card
 // - // TODO ExecutionScreen: screen to display the program execution
 // - // TODO TuneScreen: screen to tune the system during execution
+// - PreflightScreen: analysis of the loaded program, before its start
+// - SdInfoScreen: usage of the SD card and of the logs
+// - HistoryScreen: summaries of the past runs, from the run index
 
 class BaseScreen {
 public:
@@ -122,8 +129,8 @@ class MainMenuScreen : public BaseScreen {
 private: 
   unsigned long lastUpdateTime = 0;    // Tracks the last time system fields were updated
   const unsigned long updateInterval = MIN_TIME_BETWEEN_SCREEN_UPDATES; // 1000ms update interval
-  static const char* menuItems[3];    // Array of menu items
-  static const int menuCount = 3;     // Number of menu items
+  static const char* menuItems[4];    // Array of menu items
+  static const int menuCount = 4;     // Number of menu items
   int menuIndex = 0;                  // Tracks the current menu selection
 
   void renderMenu(TFT_HX8357& tft, int menuIndex); // Render the menu options
@@ -139,8 +146,8 @@ public:
 // ==== Settings menu screen
 class SettingsMenuScreen : public BaseScreen {
 private: 
-  static const char* menuItems[5];    // Array of menu items
-  static const int menuCount = 5;     // Number of menu items
+  static const char* menuItems[6];    // Array of menu items
+  static const int menuCount = 6;     // Number of menu items
   int menuIndex;
   bool isAdjustingTarget = false;
   bool encoderRotated = false;
@@ -206,6 +213,7 @@ private:
   unsigned long lastTimerUpdate = 0;
   double lastTarget = 0;
   unsigned int lastInstructionIndex = 0;
+  uint8_t lastIteration = 0;
 
 public:
   ExecutionScreen();
@@ -216,8 +224,8 @@ public:
 
 class TuneScreen : public BaseScreen {
   private:
-    static const char* menuItems[4];
-    int menuCount = 4; // Number of menu items - starting from 0
+    static const char* menuItems[5];
+    int menuCount = 5; // Number of menu items - starting from 0
     int menuIndex = 0;
     bool confirmStop = false;
   public:
@@ -229,6 +237,47 @@ class TuneScreen : public BaseScreen {
 
 
 
+// ==== Preflight screen
+// analysis of the loaded program, shown before its start
+class PreflightScreen : public BaseScreen {
+  private:
+    static const char* menuItems[2];
+    static const int menuCount = 2;
+    int menuIndex = 1;                  // "> Start" is selected by default
+
+    void renderMenu(TFT_HX8357& tft);
+    void handleSelection();
+  public:
+    void render(TFT_HX8357& tft) override;
+    void update(ClickEncoder& encoder, TFT_HX8357& tft) override;
+};
+
+
+
+// ==== SD card diagnostics screen
+// usage of the card and of the logs, from the last survey of the log manager
+class SdInfoScreen : public BaseScreen {
+  public:
+    void render(TFT_HX8357& tft) override;
+    void update(ClickEncoder& encoder, TFT_HX8357& tft) override;
+};
+
+
+
+// ==== History screen
+// one run per page, newest first: each page is a single seek in the run index
+class HistoryScreen : public BaseScreen {
+  private:
+    uint16_t runCount = 0;  // Runs in the index
+    uint16_t runIndex = 0;  // Run shown, from 0 the oldest
+  public:
+    void render(TFT_HX8357& tft) override;
+    void update(ClickEncoder& encoder, TFT_HX8357& tft) override;
+    bool Initialise();      // Count the runs and show the newest, false if there is none
+};
+
+
+
 // ==== Screen manager class
 class ScreenManager {
   BaseScreen* currentScreen;
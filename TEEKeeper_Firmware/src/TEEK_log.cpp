@@ -0,0 +1,506 @@
+#include "TEEK_log.h"
+#include <EEPROM.h>
+
+extern SdFat __sd;
+extern char errorStreamChar[ERROR_BUFF_SIZE];
+
+// ==== LOG WRITER CLASS =====
+
+// Start buffering the log file, the sectors are counted from its current position.
+// The file must not be in append mode (FILE_WRITE is not): the partial sector is rewritten in place
+void LogWriter::begin(File& f){
+  file = &f;
+  used = 0;
+  sectorStart = f.curPosition();
+  lastSync = millis();
+  dirty = false;
+  syncRequested = false;
+  maxWriteTime = 0;
+  preallocated = false;
+}
+
+// Reserve a contiguous extent of whole sectors for the log, the file must be empty.
+// The records then go to sectors known in advance, with no cluster allocation while logging
+bool LogWriter::preAllocate(uint32_t size){
+  if(file == nullptr || size == 0 || sectorStart != 0) return false;
+  if(size > LOG_MAX_PREALLOCATE) size = LOG_MAX_PREALLOCATE;
+  size = (size + LOG_SECTOR_SIZE - 1) / LOG_SECTOR_SIZE * LOG_SECTOR_SIZE;
+
+  unsigned long start = micros();
+  preallocated = file->preAllocate(size);
+  unsigned long time = micros() - start;
+  if(time > maxWriteTime) maxWriteTime = time;
+  return preallocated;
+}
+
+// Copy the data into the buffer. Only if the slack is full too (the card was busy for long),
+// a sector is written here, waiting for the card
+size_t LogWriter::write(const uint8_t* data, size_t size){
+  if(file == nullptr) return 0;
+
+  size_t written = 0;
+  while(written < size){
+    if(used == sizeof(buffer) && !writeSector()) break;
+    size_t n = sizeof(buffer) - used;
+    if(n > size - written) n = size - written;
+    memcpy(buffer + used, data + written, n);
+    used += n;
+    written += n;
+    dirty = true;
+  }
+  return written;
+}
+
+// Write the full sector at the head of the buffer, and move the slack to its start
+bool LogWriter::writeSector(){
+  unsigned long start = micros();
+  bool ok = file->seekSet(sectorStart) && file->write(buffer, LOG_SECTOR_SIZE) == LOG_SECTOR_SIZE;
+  unsigned long time = micros() - start;
+  if(time > maxWriteTime) maxWriteTime = time;
+  if(!ok){
+    sprintf(errorStreamChar, "Failed to write log data.\n");
+    return false;
+  }
+
+  used -= LOG_SECTOR_SIZE;
+  memmove(buffer, buffer + LOG_SECTOR_SIZE, used);
+  sectorStart += LOG_SECTOR_SIZE;
+  return true;
+}
+
+// Write the partial sector in its place and sync. It stays in the buffer, and is written
+// again once it is full
+bool LogWriter::flushPartial(){
+  unsigned long start = micros();
+  bool ok = file->seekSet(sectorStart) && file->write(buffer, used) == used && file->sync();
+  unsigned long time = micros() - start;
+  if(time > maxWriteTime) maxWriteTime = time;
+
+  lastSync = millis();
+  dirty = false;
+  syncRequested = false;
+  if(!ok){
+    sprintf(errorStreamChar, "Failed to sync log data.\n");
+    return false;
+  }
+  return true;
+}
+
+// Do at most one SD operation, if the card is ready: a full sector first, then the sync if due.
+// Call it often, out of the critical timings
+bool LogWriter::poll(){
+  if(file == nullptr || __sd.card()->isBusy()) return true;
+
+  if(used >= LOG_SECTOR_SIZE) return writeSector();
+  if(syncRequested || (dirty && millis() - lastSync >= LOG_SYNC_INTERVAL)) return flushPartial();
+  return true;
+}
+
+// Write everything left, waiting for the card, and close the file.
+// The end of the records is the end of the file: the unused part of the extent is freed
+bool LogWriter::close(){
+  if(file == nullptr) return false;
+
+  bool ok = true;
+  while(ok && used >= LOG_SECTOR_SIZE) ok = writeSector();
+  if(ok) ok = flushPartial();
+  if(ok && preallocated) ok = file->truncate() && file->sync();
+  file->close();
+  file = nullptr;
+  used = 0;
+  return ok;
+}
+
+
+// ==== LOG ENCODER CLASS =====
+
+// The header, the name pool and the name table must fill whole blocks
+void LogEncoder::begin(Print& log, uint8_t recordSize){
+  static_assert(TKZ_BLOCK_SIZE == LOG_SECTOR_SIZE, "a compressed block is a sector of the log");
+  out = &log;
+  fields = tkzFields(recordSize);
+  if(fields > sizeof(previous) / sizeof(previous[0])) fields = sizeof(previous) / sizeof(previous[0]);
+  used = 0;
+}
+
+// An item never spans two blocks: the block is padded and the next one starts from zeros,
+// so that it can be decoded on its own
+void LogEncoder::reserve(uint16_t size){
+  if(used != 0 && used + size <= TKZ_BLOCK_SIZE) return;
+  while(used != 0 && used < TKZ_BLOCK_SIZE){
+    out->write((uint8_t) TKZ_END);
+    used++;
+  }
+  out->write((uint8_t) TKZ_BLOCK_MARKER);
+  used = 1;
+  previousTime = 0;
+  memset(previous, 0, sizeof(previous));
+}
+
+// Tag, then the deltas of the time and of each 16 bit field, as zig-zag varints
+void LogEncoder::record(const uint8_t* record){
+  if(out == nullptr) return;
+  reserve(1 + TKZ_VARINT_MAX + 3 * fields);
+
+  TklRecord rec;
+  memcpy(&rec, record, sizeof(rec));
+  uint8_t item[1 + TKZ_VARINT_MAX + 3 * (sizeof(previous) / sizeof(previous[0]))];
+  uint8_t n = 0;
+  item[n++] = rec.flags;
+  n += tkzPutVarint(item + n, tkzZigzag((int32_t) (rec.time - previousTime)));
+  previousTime = rec.time;
+
+  // the fields after the time, skipping the flags and the length bytes of the record
+  for(uint8_t f = 0; f < fields; f++){
+    uint8_t offset = (f < 4) ? 4 + 2 * f : 14 + 2 * (f - 4);
+    uint16_t value;
+    memcpy(&value, record + offset, sizeof(value));
+    n += tkzPutVarint(item + n, tkzZigzag((int16_t) (value - previous[f])));
+    previous[f] = value;
+  }
+
+  out->write(item, n);
+  used += n;
+}
+
+// Tag, absolute time and instruction, then the text. The deltas of the data records skip it
+void LogEncoder::text(uint8_t flags, const char* text, uint8_t length, uint32_t time, uint16_t instruction){
+  if(out == nullptr) return;
+  reserve(1 + 2 * TKZ_VARINT_MAX + 1 + length);
+
+  uint8_t item[2 + 2 * TKZ_VARINT_MAX];
+  uint8_t n = 0;
+  item[n++] = flags;
+  n += tkzPutVarint(item + n, time);
+  n += tkzPutVarint(item + n, instruction);
+  item[n++] = length;
+  out->write(item, n);
+  out->write((const uint8_t*) text, length);
+  used += n + length;
+}
+
+// ==== LOG POLICY CLASS =====
+
+void LogPolicy::sample(double temperature){
+  if(samples == 0 || temperature < minTemperature) minTemperature = temperature;
+  if(samples == 0 || temperature > maxTemperature) maxTemperature = temperature;
+  sumTemperature = (samples == 0) ? temperature : sumTemperature + temperature;
+  if(samples < UINT16_MAX) samples++;
+}
+
+// A record is due on a change past a deadband, also of an excursion that has already come back,
+// on a change of instruction or state, or when the max interval has elapsed
+bool LogPolicy::isDue(double temperature, double target, double duty, uint16_t instruction, uint8_t flags, unsigned long time) const{
+  if(first) return true;
+  unsigned long elapsed = time - lastRecord;
+  if(elapsed >= LOG_MAX_INTERVAL) return true;
+  if(elapsed < LOG_MIN_INTERVAL) return false;
+
+  return instruction != lastInstruction || flags != lastFlags ||
+         fabs(temperature - lastTemperature) >= LOG_DEADBAND_TEMP ||
+         (samples && (maxTemperature - lastTemperature >= LOG_DEADBAND_TEMP || lastTemperature - minTemperature >= LOG_DEADBAND_TEMP)) ||
+         fabs(target - lastTarget) >= LOG_DEADBAND_TARGET ||
+         fabs(duty - lastDuty) >= LOG_DEADBAND_DUTY;
+}
+
+void LogPolicy::recorded(double temperature, double target, double duty, uint16_t instruction, uint8_t flags, unsigned long time){
+  lastTemperature = temperature;
+  lastTarget = target;
+  lastDuty = duty;
+  lastInstruction = instruction;
+  lastFlags = flags;
+  lastRecord = time;
+  first = false;
+  samples = 0;
+}
+
+// ==== LOG MANAGER CLASS =====
+
+// Log sequence number, saved in the EEPROM
+struct LogSequence {
+  uint16_t magic;
+  uint32_t next;
+};
+
+// "/logs/004"
+void LogManager::shardPath(char* path, uint32_t shard){
+  sprintf(path, "/logs/%03lu", (unsigned long) shard);
+}
+
+// Copy the name of the program for a file name: no extension, and only letters, digits and '-'
+void LogManager::programName(char* dest, const char* name){
+  uint8_t length = 0;
+  for(const char* c = name; *c != '\0' && *c != '.' && length < LOG_NAME_PROGRAM_CHARS; c++)
+    dest[length++] = (isalnum(*c) || *c == '-') ? *c : '_';
+  dest[length] = '\0';
+}
+
+// "00421_bisque.csv" is log 421. Only a name starting with 5 digits is a log: the files the
+// logger didn't write ("._00421_bisque.csv" of macOS, notes, ...) are neither counted nor removed
+bool LogManager::logSequence(const char* name, uint32_t& sequence){
+  for(uint8_t i = 0; i < 5; i++){
+    if(!isdigit(name[i])) return false;
+  }
+  sequence = strtoul(name, NULL, 10);
+  return true;
+}
+
+// Count the logs of all the shards, and read the usage of the card.
+// The shards are bounded by the retention, the free space costs a pass on the FAT
+bool LogManager::survey(){
+  surveyed = false;
+  count = 0;
+  bytes = 0;
+  lastSequence = 0;
+  firstShard = UINT32_MAX;
+  lastShard = 0;
+
+  // 512 B sectors: a cluster can be a single sector, half a kB, so the sectors are counted first
+  uint32_t sectorsPerCluster = __sd.sectorsPerCluster();
+  int32_t freeClusters = __sd.freeClusterCount();
+  if(freeClusters < 0){
+    sprintf(errorStreamChar, "Can't read the SD card.");
+    return false;
+  }
+  totalKB = (uint64_t) __sd.clusterCount() * sectorsPerCluster / 2;
+  freeKB = (uint64_t) freeClusters * sectorsPerCluster / 2;
+
+  FsFile root = __sd.open("/logs");
+  FsFile shard;
+  FsFile entry;
+  char name[8];   // the numbers are at the start, a truncated name is enough
+  while(root.isOpen() && shard.openNext(&root, O_RDONLY)){
+    shard.getName(name, sizeof(name));
+    bool isShard = shard.isDir() && isdigit(name[0]) && isdigit(name[1]) && isdigit(name[2]) && name[3] == '\0';
+    if(isShard){
+      uint32_t number = strtoul(name, NULL, 10);
+      if(number < firstShard) firstShard = number;
+      if(number > lastShard) lastShard = number;
+
+      while(entry.openNext(&shard, O_RDONLY)){
+        entry.getName(name, sizeof(name));
+        uint32_t sequence;
+        if(!entry.isDir() && logSequence(name, sequence)){
+          count++;
+          bytes += entry.fileSize();
+          if(sequence > lastSequence) lastSequence = sequence;
+        }
+        entry.close();
+      }
+    }
+    shard.close();
+  }
+  root.close();
+
+  if(firstShard > lastShard) firstShard = lastShard;    // no shard yet
+  surveyed = true;
+  return true;
+}
+
+// Remove the oldest log: the lowest sequence number of the first shard.
+// The shard is removed once empty, and the next one becomes the first.
+// A name too long for a path of LOG_PATH_LENGTH was not written by the logger, it is skipped
+bool LogManager::removeOldest(){
+  char folder[LOG_PATH_LENGTH];
+  char path[LOG_PATH_LENGTH];
+  char oldest[LOG_PATH_LENGTH];
+  char name[LOG_PATH_LENGTH];
+
+  while(firstShard < lastShard || (firstShard == lastShard && count > 0)){
+    shardPath(folder, firstShard);
+    FsFile shard = __sd.open(folder);
+    FsFile entry;
+    uint32_t oldestSequence = UINT32_MAX;
+    uint32_t oldestSize = 0;
+    oldest[0] = '\0';
+
+    while(shard.isOpen() && entry.openNext(&shard, O_RDONLY)){
+      uint32_t sequence;
+      bool isLog = !entry.isDir() && entry.getName(name, sizeof(name)) > 0 && logSequence(name, sequence) &&
+                   snprintf(path, sizeof(path), "%s/%s", folder, name) < (int) sizeof(path);
+      if(isLog && (oldest[0] == '\0' || sequence < oldestSequence)){
+        oldestSequence = sequence;
+        oldestSize = entry.fileSize();
+        strcpy(oldest, path);
+      }
+      entry.close();
+    }
+    shard.close();
+
+    if(oldest[0] != '\0'){
+      if(!__sd.remove(oldest)){
+        sprintf(errorStreamChar, "Failed to remove %s", oldest + strlen(folder) + 1);
+        return false;
+      }
+      if(count > 0) count--;
+      bytes -= min(bytes, oldestSize);
+      freeKB += oldestSize / 1024;
+      return true;
+    }
+
+    // no log left in the shard: remove it if empty, the logs go on in the next one
+    __sd.rmdir(folder);
+    if(firstShard == lastShard) break;
+    firstShard++;
+  }
+  return false;
+}
+
+// Survey the card, then remove the oldest logs while the retention limits are exceeded
+// or the card has no room for the new log
+bool LogManager::prepare(uint32_t logSize){
+  if(!survey()) return false;
+
+  if(logSize > LOG_MAX_PREALLOCATE) logSize = LOG_MAX_PREALLOCATE;
+  uint32_t neededKB = logSize / 1024 + LOG_MIN_FREE_KB;
+  while(count >= LOG_MAX_COUNT || bytes + logSize > LOG_MAX_BYTES || freeKB < neededKB){
+    if(!removeOldest()) break;
+  }
+
+  if(freeKB < neededKB){
+    sprintf(errorStreamChar, "SD card full: %lu kB free.", (unsigned long) freeKB);
+    return false;
+  }
+  return true;
+}
+
+// Next log sequence number, in constant time: the larger of the counter in the EEPROM and of
+// the one on the card, so that a number is never reused when a card moves to another oven or
+// the board is replaced, and of the logs found by the survey, for a card without its counter
+uint32_t LogManager::NextSequence(){
+  LogSequence saved;
+  EEPROM.get(EEPROM_ADDR_LOG_SEQUENCE, saved);
+  uint32_t next = (saved.magic == LOG_SEQUENCE_MAGIC) ? saved.next : 1;
+
+  uint32_t card = 0;
+  FsFile file = __sd.open("/logs/" LOG_SEQUENCE_FILE, O_RDONLY);
+  if(file && file.read(&card, sizeof(card)) == sizeof(card) && card > next) next = card;
+  file.close();
+
+  if(surveyed && lastSequence >= next) next = lastSequence + 1;
+  return next;
+}
+
+// Save the sequence number of the next log, in the EEPROM and on the card
+void LogManager::saveSequence(uint32_t next){
+  LogSequence saved = { LOG_SEQUENCE_MAGIC, next };
+  EEPROM.put(EEPROM_ADDR_LOG_SEQUENCE, saved);   // only the changed bytes are written
+
+  FsFile file = __sd.open("/logs/" LOG_SEQUENCE_FILE, O_WRONLY | O_CREAT);
+  if(file){
+    file.write(&next, sizeof(next));
+    file.close();
+  }
+}
+
+// Create the next log in its shard, never over an existing file
+bool LogManager::create(File& file, const char* name){
+  if(!surveyed && !survey()) return false;
+
+  char program[LOG_NAME_PROGRAM_CHARS + 1];
+  programName(program, name);
+  uint32_t sequence = NextSequence();
+  uint32_t shard = sequence / LOG_SHARD_SIZE;
+
+  char path[LOG_PATH_LENGTH];
+  shardPath(path, shard);
+  if(!__sd.exists(path) && !__sd.mkdir(path)){
+    sprintf(errorStreamChar, "Failed to create log folder.");
+    return false;
+  }
+  sprintf(path + strlen(path), "/%05lu%s%s" LOG_EXTENSION, (unsigned long) sequence, program[0] ? "_" : "", program);
+
+  file = __sd.open(path, O_WRONLY | O_CREAT | O_EXCL);
+  if(!file){
+    sprintf(errorStreamChar, "Failed to create log file.");
+    return false;
+  }
+
+  saveSequence(sequence + 1);
+  if(count == 0) firstShard = shard;
+  if(shard > lastShard) lastShard = shard;
+  lastSequence = sequence;
+  count++;
+  return true;
+}
+
+// Append the summary of a run to the run index: fixed size records, so that any run is one seek away
+bool LogManager::appendSummary(const TklSummary& summary){
+  FsFile index = __sd.open(TKL_INDEX_FILE, O_WRONLY | O_CREAT | O_APPEND);
+  if(!index){
+    sprintf(errorStreamChar, "Failed to open the run index.");
+    return false;
+  }
+  bool ok = index.write(&summary, sizeof(summary)) == sizeof(summary);
+  index.close();
+  return ok;
+}
+
+uint16_t LogManager::Summaries(){
+  FsFile index = __sd.open(TKL_INDEX_FILE, O_RDONLY);
+  if(!index) return 0;
+  uint32_t runs = index.fileSize() / sizeof(TklSummary);
+  index.close();
+  return runs < UINT16_MAX ? runs : UINT16_MAX;
+}
+
+bool LogManager::readSummary(uint16_t i, TklSummary& summary){
+  FsFile index = __sd.open(TKL_INDEX_FILE, O_RDONLY);
+  bool ok = index && index.seekSet((uint32_t) i * sizeof(TklSummary)) &&
+            index.read(&summary, sizeof(summary)) == sizeof(summary);
+  index.close();
+  summary.program[TKL_SUMMARY_NAME - 1] = '\0';
+  return ok;
+}
+
+
+// ==== BLACK BOX CLASS =====
+
+// Freeze the ring and write it to the first free crash dump, oldest sample first.
+// The outcome is only reported on the serial port, if enabled: the error stream holds the error being dumped
+bool BlackBox::dump(const char* error, uint32_t sequence, uint8_t unit){
+  if(frozen) return false;
+  frozen = true;
+
+  TkbHeader header = {};
+  memcpy(header.magic, TKB_MAGIC, sizeof(header.magic));
+  header.version = TKB_VERSION;
+  header.samples = full ? BLACKBOX_SAMPLES : next;
+  header.sampleSize = sizeof(TkbSample);
+  header.unit = unit;
+  header.time = lastTime;
+  header.sequence = sequence;
+  strncpy(header.error, error, TKB_ERROR - 1);
+
+  if(!__sd.exists("/logs") && !__sd.mkdir("/logs")){
+    #ifdef SERIAL_COMMS
+        Serial.println("Failed to create the crash dump folder.");
+    #endif
+    return false;
+  }
+
+  char path[LOG_PATH_LENGTH];
+  FsFile file;
+  for(uint16_t n = 1; n <= BLACKBOX_MAX_DUMPS && !file.isOpen(); n++){
+    sprintf(path, TKB_FILE, (unsigned) n);
+    file = __sd.open(path, O_WRONLY | O_CREAT | O_EXCL);
+  }
+  if(!file.isOpen()){
+    #ifdef SERIAL_COMMS
+        Serial.println("Failed to create the crash dump.");
+    #endif
+    return false;
+  }
+
+  // the ring from the oldest sample: the tail after next, then the head before it
+  bool ok = file.write(&header, sizeof(header)) == sizeof(header);
+  if(full) ok = ok && file.write(samples + next, (BLACKBOX_SAMPLES - next) * sizeof(TkbSample)) == (BLACKBOX_SAMPLES - next) * sizeof(TkbSample);
+  ok = ok && file.write(samples, next * sizeof(TkbSample)) == next * sizeof(TkbSample);
+  ok = file.close() && ok;
+
+  #ifdef SERIAL_COMMS
+      Serial.print(ok ? "Crash dump written to " : "Failed to write the crash dump ");
+      Serial.println(path);
+  #endif
+  return ok;
+}
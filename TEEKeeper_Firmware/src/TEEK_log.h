@@ -0,0 +1,331 @@
+#ifndef TEEK_LOG_H
+#define TEEK_LOG_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+#include "TEEK_constants.h"
+#include "TEEK_pins.h"
+#include "TEEK_logFormat.h"
+
+#ifdef BINARY_LOG
+    #define LOG_EXTENSION TKL_EXTENSION
+#else
+    #define LOG_EXTENSION ".csv"
+#endif
+
+
+// ===== LOG WRITER ======================================================
+// The records of the log are formatted into a sector buffer in RAM, and the SD card is only
+// written a whole sector at a time, when the card is not busy and no heater edge is close.
+// Writing field by field and syncing every record costs a FAT and directory update per
+// PWM cycle.
+//
+// This moves the SD time away from the heater edges, it doesn't remove it: a poll is skipped
+// while the card reports busy, but the sector transfer and the sync it starts still run in
+// the loop. How long they hold it has not been measured on the oven; the end of each log
+// reports the longest loop iteration and the longest SD operation, to compare with a log of
+// the former writer.
+//
+// The sync (size and directory entry of the file) only happens every LOG_SYNC_INTERVAL, or
+// at an important event. The partial sector is then written in its place, and written again
+// once it is full, so that the sector writes stay aligned.
+//
+// The file can be preallocated as a contiguous extent, from the estimated size of the log:
+// the sectors of the records are then known in advance, and no write walks the FAT to allocate
+// a cluster. The unused part of the extent is freed when the log is closed.
+
+
+//* CLASS LogWriter
+/**
+ * @class LogWriter
+ * @brief Print interface to the log file, buffered by sectors.
+ *
+ * @private
+ * - File* file: Log file, nullptr if closed.
+ * - uint8_t buffer[LOG_SECTOR_SIZE + LOG_BUFFER_SLACK]: Sector being filled, and the slack for the records that arrive while the card is busy.
+ * - uint16_t used: Bytes in the buffer.
+ * - uint32_t sectorStart: File position of the first byte of the buffer, a multiple of LOG_SECTOR_SIZE from the start of the records.
+ * - unsigned long lastSync: Timestamp of the last sync [ms].
+ * - bool dirty: True if data has been logged since the last sync.
+ * - bool syncRequested: True if an event asked for a sync.
+ * - unsigned long maxWriteTime: Longest SD operation of the writer [us].
+ * - bool preallocated: True if the file has a preallocated extent, to be truncated at the end.
+ * - bool writeSector(): Writes the full sector at the head of the buffer.
+ * - bool flushPartial(): Writes the partial sector in its place, and syncs.
+ *
+ * @public
+ * - void begin(File& f): Start buffering the log file, from its current position.
+ * - bool preAllocate(uint32_t size): Reserve a contiguous extent for an empty log file. Returns false if it isn't possible, the file then grows as it is written.
+ * - bool IsOpen(): Check if a log file is being written.
+ * - size_t write(uint8_t c), write(const uint8_t* data, size_t size): Print interface, to the buffer.
+ * - void requestSync(): Sync at the next poll, for an important event.
+ * - bool poll(): Write a full sector or sync, if due and if the card is not busy. The operation itself blocks for its duration.
+ * - bool close(): Write the rest of the buffer, free the unused extent, sync and close the file.
+ * - unsigned long MaxWriteTime(): Longest SD operation of the writer [us].
+ */
+class LogWriter : public Print {
+    private:
+        File* file = nullptr;
+        uint8_t buffer[LOG_SECTOR_SIZE + LOG_BUFFER_SLACK];
+        uint16_t used = 0;
+        uint32_t sectorStart = 0;
+        unsigned long lastSync = 0;         // [ms]
+        bool dirty = false;
+        bool syncRequested = false;
+        unsigned long maxWriteTime = 0;     // [us]
+        bool preallocated = false;
+
+        bool writeSector();
+        bool flushPartial();
+
+    public:
+        void begin(File& f);
+        bool preAllocate(uint32_t size);
+        bool IsOpen() const { return file != nullptr; }
+
+        using Print::write;
+        size_t write(uint8_t c) override { return write(&c, 1); }
+        size_t write(const uint8_t* data, size_t size) override;
+
+        void requestSync() { syncRequested = true; }
+        bool poll();
+        bool close();
+        unsigned long MaxWriteTime() const { return maxWriteTime; }
+};
+
+
+// ===== LOG POLICY ======================================================
+// A record is written when the temperature, the target or the duty cycle moved past their
+// deadband since the previous record, when the instruction or the state changed, or after
+// LOG_MAX_INTERVAL. The decision is taken at every probe sample: fast events are logged up to
+// every LOG_MIN_INTERVAL, long stable soaks every LOG_MAX_INTERVAL.
+// Each record carries the min, max and mean temperature of the samples since the previous
+// one, so no excursion between two records is lost.
+
+
+//* CLASS LogPolicy
+/**
+ * @class LogPolicy
+ * @brief Decides when a log record is due, and keeps the temperature window between two records.
+ *
+ * @private
+ * - double lastTemperature, lastTarget, lastDuty: Values of the previous record.
+ * - uint16_t lastInstruction: Instruction of the previous record.
+ * - uint8_t lastFlags: State of the previous record (TKL_HEATER_ON, TKL_STABLE, ...).
+ * - unsigned long lastRecord: Timestamp of the previous record [ms], none if first.
+ * - bool first: True if no record has been written yet.
+ * - double minTemperature, maxTemperature, sumTemperature: Window of the samples since the previous record.
+ * - uint16_t samples: Samples in the window.
+ *
+ * @public
+ * - void begin(): Start a new log, the first record is due at once.
+ * - void sample(double temperature): Add a temperature sample to the window.
+ * - bool isDue(...): Check if a record is due.
+ * - void recorded(...): A record has been written: its values are the new reference, and the window restarts.
+ * - double Min(), Max(), Mean(): Temperature window since the previous record.
+ */
+class LogPolicy {
+    private:
+        double lastTemperature = 0;
+        double lastTarget = 0;
+        double lastDuty = 0;
+        uint16_t lastInstruction = 0;
+        uint8_t lastFlags = 0;
+        unsigned long lastRecord = 0;       // [ms]
+        bool first = true;
+
+        double minTemperature = 0;
+        double maxTemperature = 0;
+        double sumTemperature = 0;
+        uint16_t samples = 0;
+
+    public:
+        void begin() { first = true; samples = 0; }
+        void sample(double temperature);
+        bool isDue(double temperature, double target, double duty, uint16_t instruction, uint8_t flags, unsigned long time) const;
+        void recorded(double temperature, double target, double duty, uint16_t instruction, uint8_t flags, unsigned long time);
+
+        double Min() const { return samples ? minTemperature : lastTemperature; }
+        double Max() const { return samples ? maxTemperature : lastTemperature; }
+        double Mean() const { return samples ? sumTemperature / samples : lastTemperature; }
+};
+
+
+// ===== LOG ENCODER =====================================================
+// Compresses the binary records as they come (see TEEK_logFormat.h): each record is coded as
+// the zig-zag varint deltas of its fields from the previous one, and the blocks are aligned to
+// the sectors of the LogWriter. The state is the previous record and the fill of the block:
+// no record is kept in RAM.
+
+
+//* CLASS LogEncoder
+/**
+ * @class LogEncoder
+ * @brief Delta/varint encoder of the binary log records, in sector aligned blocks.
+ *
+ * @private
+ * - Print* out: Destination, the LogWriter of the log.
+ * - uint8_t fields: 16 bit fields of a record, the time excluded.
+ * - uint32_t previousTime: Time of the previous data record of the block [ms].
+ * - uint16_t previous[]: Fields of the previous data record of the block.
+ * - uint16_t used: Bytes in the current block, 0 if none is open.
+ * - void reserve(uint16_t size): Pad the block and open the next one if the item doesn't fit.
+ *
+ * @public
+ * - void begin(Print& log, uint8_t recordSize): Start encoding, after the header padded to a block.
+ * - void record(const uint8_t* record): Encode a data record (TklRecord and its columns).
+ * - void text(uint8_t flags, const char* text, uint8_t length, uint32_t time, uint16_t instruction): Encode a message or name record.
+ */
+class LogEncoder {
+    private:
+        Print* out = nullptr;
+        uint8_t fields = 0;
+        uint32_t previousTime = 0;          // [ms]
+        uint16_t previous[5 + 2 * N_ZONES + 6];
+        uint16_t used = 0;
+
+        void reserve(uint16_t size);
+
+    public:
+        void begin(Print& log, uint8_t recordSize);
+        void record(const uint8_t* record);
+        void text(uint8_t flags, const char* text, uint8_t length, uint32_t time, uint16_t instruction);
+};
+
+
+// ===== LOG MANAGER =====================================================
+// The logs are sharded in subfolders of /logs by blocks of LOG_SHARD_SIZE sequence numbers
+// ("/logs/004/00421_glaze.csv"): the oven has no clock to shard them by date, and by sequence
+// the first shard always holds the oldest logs. No folder grows past LOG_SHARD_SIZE entries,
+// so the lookups and the scans in it stay short.
+//
+// Before a program starts, the oldest logs are removed until the logs are within LOG_MAX_COUNT
+// and LOG_MAX_BYTES, and the card has room for the new log: a full card is reported before
+// the firing, not through failing writes in the middle of it.
+// Logs written before the sharding stay in /logs, and are not managed.
+
+
+//* CLASS LogManager
+/**
+ * @class LogManager
+ * @brief Naming, retention and space budget of the logs on the SD card.
+ *
+ * @private
+ * - uint16_t count: Number of logs in the shards.
+ * - uint32_t bytes: Size of the logs in the shards [B].
+ * - uint32_t firstShard, lastShard: Range of the shard folders.
+ * - uint32_t lastSequence: Highest sequence number of the logs on the card.
+ * - uint32_t freeKB, totalKB: Free and total space of the card [kB].
+ * - bool surveyed: True if the figures are those of the card in place.
+ * - static void shardPath(char* path, uint32_t shard): Path of a shard folder.
+ * - static void programName(char* dest, const char* name): Program name as part of a file name.
+ * - static bool logSequence(const char* name, uint32_t& sequence): Sequence number of a log file name, false if the name doesn't start with 5 digits (not a log).
+ * - void saveSequence(uint32_t next): Save the sequence number of the next log, in the EEPROM and on the card.
+ * - bool removeOldest(): Remove the log with the lowest sequence number, and its shard once empty. Other files are left alone.
+ *
+ * @public
+ * - bool survey(): Count the logs and read the usage of the card. The card must be started. Reads the whole FAT, up to a couple of seconds on large cards.
+ * - bool prepare(uint32_t logSize): Survey, then remove the oldest logs to keep the retention limits and room for a log of logSize bytes. Returns false if there is no room.
+ * - bool create(File& file, const char* programName): Create the next log, named "NNNNN_program" + LOG_EXTENSION in its shard.
+ * - uint32_t NextSequence(): Sequence number of the next log, the larger of the EEPROM counter, of the card one and of the logs found.
+ * - uint32_t CurrentSequence(): Sequence number of the last log created.
+ * - bool appendSummary(const TklSummary& summary): Append the summary of a run to the run index.
+ * - uint16_t Summaries(): Number of runs in the run index, 0 if there is none.
+ * - bool readSummary(uint16_t index, TklSummary& summary): Read the summary of a run, from 0 the oldest. One seek, no scan.
+ * - getters of the survey: Count(), Bytes(), FreeKB(), TotalKB(), FirstShard(), LastShard(), IsSurveyed().
+ */
+class LogManager {
+    private:
+        uint16_t count = 0;
+        uint32_t bytes = 0;                 // [B]
+        uint32_t firstShard = 0;
+        uint32_t lastShard = 0;
+        uint32_t lastSequence = 0;
+        uint32_t freeKB = 0;                // [kB]
+        uint32_t totalKB = 0;               // [kB]
+        bool surveyed = false;
+
+        static void shardPath(char* path, uint32_t shard);
+        static void programName(char* dest, const char* name);
+        static bool logSequence(const char* name, uint32_t& sequence);
+        void saveSequence(uint32_t next);
+        bool removeOldest();
+
+    public:
+        bool survey();
+        bool prepare(uint32_t logSize);
+        bool create(File& file, const char* programName);
+        uint32_t NextSequence();
+        uint32_t CurrentSequence() const { return lastSequence; }
+
+        bool appendSummary(const TklSummary& summary);
+        uint16_t Summaries();
+        bool readSummary(uint16_t index, TklSummary& summary);
+
+        uint16_t Count() const { return count; }
+        uint32_t Bytes() const { return bytes; }
+        uint32_t FreeKB() const { return freeKB; }
+        uint32_t TotalKB() const { return totalKB; }
+        uint32_t FirstShard() const { return firstShard; }
+        uint32_t LastShard() const { return lastShard; }
+        bool IsSurveyed() const { return surveyed; }
+};
+
+
+// ===== BLACK BOX =======================================================
+// Every probe sample goes in a RAM ring of BLACKBOX_SAMPLES entries, the oldest overwritten:
+// a few stores per sample, no SD access. When the system stops on an error, the ring is frozen
+// and written to /logs/crash_N.bin, at the full rate of the probes, up to the failing sample.
+// The dump needs the card to be started, as it is once a program has been loaded.
+
+
+//* CLASS BlackBox
+/**
+ * @class BlackBox
+ * @brief Ring buffer of the last probe samples, dumped to the SD card on an error.
+ *
+ * @private
+ * - TkbSample samples[BLACKBOX_SAMPLES]: Ring of the samples.
+ * - uint8_t next: Index of the next sample to write, the oldest once the ring is full.
+ * - bool full: True if the ring has wrapped.
+ * - bool frozen: True once dumped, the following samples are ignored.
+ * - uint32_t lastTime: Full time of the newest sample [ms].
+ *
+ * @public
+ * - void record(...): Add a sample to the ring.
+ * - bool dump(const char* error, uint32_t sequence, uint8_t unit): Freeze the ring and write it to the first free /logs/crash_N.bin. Only the first call writes.
+ * - bool IsFrozen(): Check if the ring has been dumped.
+ */
+class BlackBox {
+    private:
+        TkbSample samples[BLACKBOX_SAMPLES];
+        uint8_t next = 0;
+        bool full = false;
+        bool frozen = false;
+        uint32_t lastTime = 0;              // [ms]
+
+    public:
+        void record(unsigned long time, uint8_t probe, double raw, double filtered, double duty, uint8_t heaters, uint8_t state) {
+            if(frozen) return;
+            TkbSample& s = samples[next];
+            s.time = (uint16_t) time;
+            s.raw = isnan(raw) ? TKB_NO_READING : tklTenths(raw);
+            s.filtered = tklTenths(filtered);
+            s.duty = (uint8_t) (duty * 2 + 0.5);
+            s.probe = probe;
+            s.state = state;
+            s.heaters = heaters;
+            lastTime = time;
+            if(++next == BLACKBOX_SAMPLES){
+                next = 0;
+                full = true;
+            }
+        }
+        bool dump(const char* error, uint32_t sequence, uint8_t unit);
+        bool IsFrozen() const { return frozen; }
+};
+
+static_assert(BLACKBOX_SAMPLES <= UINT8_MAX, "The black box is indexed by a byte");
+
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef TEEK_LOG_FORMAT_H
+#define TEEK_LOG_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// ===== BINARY LOG FORMAT (.tkl) ========================================
+// Compact log of a firing, written by the firmware when BINARY_LOG is defined, and converted
+// to CSV on a PC by tools/tkl2csv.cpp. The records are copied as they are, with no text
+// formatting, and the instruction names are only written once.
+// This header is shared by the firmware and by the host converter: no Arduino dependency here.
+//
+// File layout (little endian, as both the AVR and the PC):
+//      TklHeader
+//      name pool       nameBytes, zero terminated names, the first one is the empty name
+//      name table      numOfNames x uint8_t, offset in the pool of the name of each instruction
+//      records         recordSize bytes each
+//
+// A record is a TklRecord, followed by the optional columns flagged in the header, in this order:
+//      TKL_COL_ZONES       int16_t temperature [0.1 deg], uint16_t duty [0.01 %], for each zone
+//      TKL_COL_CORE        int16_t core temperature [0.1 deg]
+//      TKL_COL_HEATWORK    uint16_t heatwork [0.1 % of the target cone]
+//      TKL_COL_ITERATION   uint8_t iteration, uint8_t times of the innermost repeat block
+//      TKL_COL_WINDOW      int16_t min, max, mean temperature [0.1 deg] since the previous record
+//
+// Message and name records (TKL_MESSAGE, TKL_NAME) only carry the time and the instruction:
+// their text, length bytes long, fills the following records, padded with zeros.
+// Streamed programs have no name table, each instruction starts with a name record instead.
+//
+// Compressed logs (version TKL_VERSION_COMPRESSED, firmware built with COMPRESSED_LOG) have the
+// same header, name pool and name table, padded with zeros to TKZ_BLOCK_SIZE. The records follow
+// in blocks of TKZ_BLOCK_SIZE bytes, aligned to the sectors of the card: any block can be decoded
+// on its own. A block starts with TKZ_BLOCK_MARKER, and ends with TKZ_END padding.
+// Each item of a block starts with a tag, the flags of the record:
+//      data record     zig-zag varint deltas from the previous record of the block: the time
+//                      (32 bit), then each 16 bit field of the record (instruction, temperature,
+//                      target, duty, remaining, then the optional columns, the iteration as one
+//                      field). The first record of a block is coded from zeros: its values in full.
+//      TKL_MESSAGE,    varint time, varint instruction, length byte, then the text. The deltas
+//      TKL_NAME        of the data records skip them.
+
+#define TKL_MAGIC       "TKL"
+#define TKL_VERSION     1
+#define TKL_VERSION_COMPRESSED 2
+#define TKL_EXTENSION   ".tkl"
+#define TKL_PROGRAM_NAME 32     // bytes of the program name in the header
+
+// optional columns of the records
+#define TKL_COL_ZONES       0x01
+#define TKL_COL_CORE        0x02
+#define TKL_COL_HEATWORK    0x04
+#define TKL_COL_ITERATION   0x08
+#define TKL_COL_WINDOW      0x10
+
+// flags of a record
+#define TKL_HEATER_ON   0x01    // the heaters are allowed to fire
+#define TKL_STABLE      0x02    // the temperature is stable
+#define TKL_SOAKING     0x04    // the instruction is soaking
+#define TKL_HOLDING     0x08    // the program is held
+#define TKL_MESSAGE     0x40    // event message, the text follows
+#define TKL_NAME        0x80    // name of the instruction, the text follows
+
+struct TklHeader {
+    char magic[3];                  // TKL_MAGIC, not terminated
+    uint8_t version;                // TKL_VERSION
+    uint8_t recordSize;             // [B] TklRecord and the optional columns
+    uint8_t columns;                // TKL_COL_*
+    uint8_t numOfZones;
+    uint8_t unit;                   // TemperatureUnit of the temperatures: 0 C, 1 F, 2 K
+    uint16_t numOfNames;            // entries of the name table, 0 for a streamed program
+    uint16_t nameBytes;             // size of the name pool
+    char program[TKL_PROGRAM_NAME]; // program name, zero terminated
+};
+
+struct TklRecord {
+    uint32_t time;                  // [ms]
+    uint16_t instruction;           // index of the instruction, from 0
+    int16_t temperature;            // [0.1 deg]
+    int16_t target;                 // [0.1 deg]
+    uint16_t duty;                  // [0.01 %]
+    uint8_t flags;                  // TKL_*
+    uint8_t length;                 // [B] text of a message or name record, 0 otherwise
+    uint16_t remaining;             // [min] estimated remaining time of the program
+};
+
+static_assert(sizeof(TklHeader) == 44, "TklHeader must be packed");
+static_assert(sizeof(TklRecord) == 16, "TklRecord must be packed");
+
+
+// ===== RUN INDEX (/logs/index.bin) =====================================
+// One fixed size TklSummary per firing, appended when its log is closed, whatever the log
+// format: the history of the runs is browsed by seeking to index x sizeof(TklSummary),
+// with no need to open the logs. The oven has no clock: the runs are ordered by the
+// sequence number of their log, which also names the log file.
+
+#define TKL_INDEX_FILE  "/logs/index.bin"
+#define TKL_SUMMARY_NAME 28     // bytes of the program name in a summary
+
+// end status of a run
+#define TKL_END         0       // the program ended
+#define TKL_ERROR       1       // stopped by an error
+#define TKL_USER_STOP   2       // stopped by the user
+
+struct TklSummary {
+    uint32_t sequence;              // sequence number of the log
+    uint32_t duration;              // [s]
+    char program[TKL_SUMMARY_NAME]; // program name, zero terminated
+    int16_t peak;                   // [0.1 deg] peak temperature
+    int16_t overshoot;              // [0.1 deg] max temperature over a rising or steady target
+    uint32_t energy;                // [Wh] from the duty cycle and HEATER_POWER_W
+    uint8_t status;                 // TKL_END, TKL_ERROR, TKL_USER_STOP
+    uint8_t unit;                   // TemperatureUnit: 0 C, 1 F, 2 K
+    uint16_t reserved;
+};
+
+static_assert(sizeof(TklSummary) == 48, "TklSummary must be packed");
+
+// ===== CRASH DUMP (/logs/crash_N.bin) ==================================
+// The last BLACKBOX_SAMPLES probe samples, kept in a RAM ring buffer and written when the system
+// stops on an error: the regular log is too sparse to tell a thermocouple glitch or a welded relay.
+// File layout: TkbHeader, then the samples, oldest first. The sample times are the low 16 bits
+// of millis(): they are rebuilt backwards from the full time of the newest one, in the header.
+
+#define TKB_MAGIC       "TKB"
+#define TKB_VERSION     1
+#define TKB_FILE        "/logs/crash_%u.bin"    // N from 1, the first free one
+#define TKB_ERROR       48      // bytes of the error message in the header
+#define TKB_NO_READING  INT16_MIN               // raw value of a failed reading
+
+struct TkbHeader {
+    char magic[3];                  // TKB_MAGIC, not terminated
+    uint8_t version;                // TKB_VERSION
+    uint16_t samples;               // samples in the file
+    uint8_t sampleSize;             // [B] sizeof(TkbSample)
+    uint8_t unit;                   // TemperatureUnit of the temperatures: 0 C, 1 F, 2 K
+    uint32_t time;                  // [ms] millis() of the newest sample
+    uint32_t sequence;              // sequence number of the log of the run, 0 if none
+    char error[TKB_ERROR];          // error message, zero terminated
+};
+
+struct TkbSample {
+    uint16_t time;                  // [ms] low 16 bits of millis()
+    int16_t raw;                    // [0.1 deg] reading of the sampled probe, TKB_NO_READING if none
+    int16_t filtered;               // [0.1 deg] Kalman estimate of the chamber
+    uint8_t duty;                   // [0.5 %] duty cycle, mean of the zones
+    uint8_t probe;                  // index of the sampled probe: zone x PROBES_PER_ZONE + probe
+    uint8_t state;                  // SystemState
+    uint8_t heaters;                // heater stages switched on, bit zone x HEATER_STAGES + stage
+};
+
+static_assert(sizeof(TkbHeader) == 64, "TkbHeader must be packed");
+static_assert(sizeof(TkbSample) == 10, "TkbSample must be packed");
+
+// Size of a record with the given columns
+inline uint8_t tklRecordSize(uint8_t columns, uint8_t zones) {
+    uint8_t size = sizeof(TklRecord);
+    if (columns & TKL_COL_ZONES) size += 4 * zones;
+    if (columns & TKL_COL_CORE) size += 2;
+    if (columns & TKL_COL_HEATWORK) size += 2;
+    if (columns & TKL_COL_ITERATION) size += 2;
+    if (columns & TKL_COL_WINDOW) size += 6;
+    return size;
+}
+
+// Compressed blocks
+#define TKZ_BLOCK_SIZE      512     // [B] a sector of the card
+#define TKZ_BLOCK_MARKER    0xB0    // first byte of a block, never a tag
+#define TKZ_END             0xFF    // padding at the end of a block, never a tag
+#define TKZ_VARINT_MAX      5       // [B] longest varint of a 32 bit value
+
+// 16 bit fields of a record with the given columns, the time excluded
+inline uint8_t tkzFields(uint8_t recordSize) {
+    return 5 + (recordSize - sizeof(TklRecord)) / 2;
+}
+
+// Zig-zag coding: small negative and positive deltas both give small unsigned values
+inline uint32_t tkzZigzag(int32_t value) {
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+inline int32_t tkzUnzigzag(uint32_t value) {
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+// Write a varint, 7 bits per byte from the lowest, the high bit set on all but the last byte.
+// Returns the bytes written
+inline uint8_t tkzPutVarint(uint8_t* p, uint32_t value) {
+    uint8_t n = 0;
+    while (value >= 0x80) {
+        p[n++] = (uint8_t) value | 0x80;
+        value >>= 7;
+    }
+    p[n++] = (uint8_t) value;
+    return n;
+}
+
+// Scaled value of a column, saturated to its type
+inline int16_t tklTenths(double value) {
+    double v = value * 10;
+    if (v > INT16_MAX) return INT16_MAX;
+    if (v < INT16_MIN) return INT16_MIN;
+    return (int16_t) (v < 0 ? v - 0.5 : v + 0.5);
+}
+
+
+#endif
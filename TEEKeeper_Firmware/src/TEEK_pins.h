@@ -28,8 +28,27 @@
 #endif
 
 
-// == MAX31855 Select pin
-#define PIN_PROBE_CS 17
+// == Control zones
+// Each zone has its own MAX31855 probe and its own heater, and is controlled independently.
+// Set N_ZONES to the number of zones actually wired to the board (1 to 3).
+#define N_ZONES 1
+
+// == MAX31855 Select pins
+// Each zone can be fitted with up to 3 redundant probes (A, B, C), which are voted together.
+// Set PROBES_PER_ZONE to the number of probes actually wired to each zone.
+#define PROBES_PER_ZONE 1
+#define PIN_PROBE_CS 17                 // Zone 1 (top), probe A
+#define PIN_PROBE_CS_B 42               // Zone 1, probe B
+#define PIN_PROBE_CS_C 43               // Zone 1, probe C
+#define PIN_PROBE_CS_Z2 16              // Zone 2 (middle), probe A
+#define PIN_PROBE_CS_Z2_B 44            // Zone 2, probe B
+#define PIN_PROBE_CS_Z2_C 45            // Zone 2, probe C
+#define PIN_PROBE_CS_Z3 15              // Zone 3 (bottom), probe A
+#define PIN_PROBE_CS_Z3_B 46            // Zone 3, probe B
+#define PIN_PROBE_CS_Z3_C 47            // Zone 3, probe C
+#define PROBE_CS_PINS { {PIN_PROBE_CS,    PIN_PROBE_CS_B,    PIN_PROBE_CS_C},    \
+                        {PIN_PROBE_CS_Z2, PIN_PROBE_CS_Z2_B, PIN_PROBE_CS_Z2_C}, \
+                        {PIN_PROBE_CS_Z3, PIN_PROBE_CS_Z3_B, PIN_PROBE_CS_Z3_C} }
 
 // == SD Card PINS
 #define PIN_SD_CS 18
@@ -42,7 +61,21 @@
 #define PIN_ENCODER_S2  3
 #define PIN_ENCODER_KEY 4
 
-// Heater control pin
-#define PIN_HEATER 5
+// == Heater control PINS
+// Each heater stage drives an independent element bank through its own SSR.
+// Set HEATER_STAGES to the number of banks per zone actually wired to the board.
+#define HEATER_STAGES 1                 // Number of independent heater stages (1 or 2)
+#define PIN_HEATER_STAGE_1 5            // Zone 1, stage 1 (lead bank)
+#define PIN_HEATER_STAGE_2 6            // Zone 1, stage 2 (boost bank)
+#define PIN_HEATER_Z2_STAGE_1 7         // Zone 2, stage 1
+#define PIN_HEATER_Z2_STAGE_2 8         // Zone 2, stage 2
+#define PIN_HEATER_Z3_STAGE_1 9         // Zone 3, stage 1
+#define PIN_HEATER_Z3_STAGE_2 10        // Zone 3, stage 2
+#define HEATER_STAGE_PINS { {PIN_HEATER_STAGE_1,    PIN_HEATER_STAGE_2},    \
+                            {PIN_HEATER_Z2_STAGE_1, PIN_HEATER_Z2_STAGE_2}, \
+                            {PIN_HEATER_Z3_STAGE_1, PIN_HEATER_Z3_STAGE_2} }
+
+// Heater control pin (single heater systems)
+#define PIN_HEATER PIN_HEATER_STAGE_1
 
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#ifndef TEEK_PROGRAM_FORMAT_H
+#define TEEK_PROGRAM_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// ===== COMPILED PROGRAM FORMAT (.tkp) ==================================
+// Binary image of a program, produced on a PC by tools/tkpc.cpp from a CSV schedule.
+// The firmware loads it with a few block reads and a CRC check, with no text parsing.
+// This header is shared by the firmware and by the host compiler: no Arduino dependency here.
+//
+// File layout (little endian, as both the AVR and the PC):
+//      TkpHeader
+//      TkpRepeat  x numOfRepeats
+//      name pool  nameBytes, zero terminated names, the first one is the empty name
+//      TkpRecord  x numOfInstructions
+// The CRC32 covers everything after the header.
+
+#define TKP_MAGIC       "TKP"
+#define TKP_VERSION     1
+#define TKP_EXTENSION   ".tkp"
+
+// wait flags of a record, the same bits as Instruction::flags
+#define TKP_WAIT_DOOR_OPEN      0x01
+#define TKP_WAIT_BUTTON_PRESS   0x02
+
+struct TkpHeader {
+    char magic[3];                  // TKP_MAGIC, not terminated
+    uint8_t version;                // TKP_VERSION
+    uint8_t unit;                   // TemperatureUnit of the program: 0 C, 1 F, 2 K
+    uint8_t numOfRepeats;
+    uint16_t numOfInstructions;
+    uint16_t nameBytes;             // size of the name pool
+    uint16_t thickness;             // [0.1 mm] workpiece thickness, 0 = no load model
+    int8_t cone;                    // target cone, 0 = none (i.e. 06 -> -6)
+    uint8_t coreSoak;               // 1 if the soaks are timed on the core temperature
+    uint8_t reserved[2];
+    uint32_t crc;                   // CRC32 of the rest of the file
+};
+
+struct TkpRepeat {
+    uint16_t first;                 // index of the first instruction, from 0
+    uint16_t last;                  // index of the last instruction, from 0
+    uint8_t times;                  // number of executions
+    uint8_t reserved;
+};
+
+// same layout as Instruction, so that the records can be read straight into the program
+struct TkpRecord {
+    int16_t target;                 // [0.1 C/F/K]
+    int16_t rate;                   // [0.1 C/min]
+    uint16_t soak;                  // [min]
+    uint8_t nameOffset;             // position of the name in the name pool
+    uint8_t flags;                  // TKP_WAIT_DOOR_OPEN | TKP_WAIT_BUTTON_PRESS
+};
+
+static_assert(sizeof(TkpHeader) == 20, "TkpHeader must be packed");
+static_assert(sizeof(TkpRepeat) == 6, "TkpRepeat must be packed");
+static_assert(sizeof(TkpRecord) == 8, "TkpRecord must be packed");
+
+// CRC32 (IEEE 802.3, reflected), bit by bit: slower than a table, but without 1 kB of table.
+// Chain the calls to checksum a file in blocks, starting from 0.
+inline uint32_t tkpCrc32(uint32_t crc, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*) data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (uint8_t b = 0; b < 8; b++) crc = (crc >> 1) ^ (0xEDB88320UL & (0UL - (crc & 1)));
+    }
+    return ~crc;
+}
+
+
+#endif
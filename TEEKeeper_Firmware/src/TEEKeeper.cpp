@@ -16,6 +16,10 @@
 
 // == Global variables
 File *__file = nullptr; // Log file pointer
+LogWriter __logWriter;  // Buffered writer of the log file
+LogManager __logManager;  // Naming and retention of the logs
+LogPolicy __logPolicy;    // Adaptive rate of the log records
+BlackBox __blackBox;      // Last probe samples, dumped on an error
 
 //* 0. Setup functions =====================================================================
 bool TEEK_Setup(){
@@ -28,16 +32,13 @@ bool TEEK_Setup(){
     Timer1.attachInterrupt(timerIsr);       // Attach the encoder service instruction
     __encoder.setAccelerationEnabled(true); // Enable acceleration for the encoder
 
-    // Initialize the temperature probe
-    if(!__probe.Sensor().begin()){
-        sprintf(errorStreamChar, "Could not initialize the temperature probe.\n");
+    // Initialize the temperature probes and the heaters (normally off)
+    if(!__core.begin()){
         return false;
     }
 
     // Define the remaining pins
     pinMode(PIN_SD_CS, OUTPUT);     // SD PIN - Chip Select
-    pinMode(PIN_HEATER, OUTPUT);    // Heater - ON/OFF
-    digitalWrite(PIN_HEATER, LOW);  // normally off
 
     pinMode(PIN_DOOR_INTERRUPT, INPUT);  // Door interrupt pin
     attachInterrupt(digitalPinToInterrupt(PIN_DOOR_INTERRUPT), doorInterrupt, CHANGE);
@@ -50,12 +51,9 @@ bool TEEK_Setup(){
         double kd = EEPROM.get(sizeof(double) * EEPROM_ADDR_KD, kd);
 
         // Update the CORE with the loaded PID values
-        __core = CoreSystem(__probe, kp, ki, kd);
-    }  
-    else {
-        // Initialize the core system with the default values
-        __core = CoreSystem(__probe);
+        __core.updatePID(kp, ki, kd);
     }
+    // otherwise the core system keeps the default values
 
     return true;
 };
@@ -78,7 +76,7 @@ bool TEEK_Setup(){
  * - In NORMAL mode, it performs the following steps:
  *   - Checks if the duty cycle has ended and turns off the heater if necessary.
  *   - Starts the next PWM cycle, reads the temperature, and calculates the error.
- *   - Updates the duty cycle using the PID controller and manages the heater state.
+ *   - Updates the duty cycle using the PID controller and splits it over the heater stages.
  *   - Checks for stability and updates the log if logging is enabled.
  * - In PID_AUTOTUNE mode, it performs the following steps:
  *   - Initializes autotune parameters if not already tuning.
@@ -90,20 +88,18 @@ bool TEEK_Setup(){
  * 
  * @note This function assumes the presence of external variables and functions such as
  *       millis(), digitalWrite(), probe.readTemp(), denyFiring(), updateStatus(), updateLog(),
- *       PID(), EEPROM.put(), and constants like PIN_HEATER, PWMPeriod, MAX_TEMP_ERROR,
+ *       PID(), EEPROM.put(), and constants like HEATER_STAGE_PINS, PWMPeriod, MAX_TEMP_ERROR,
  *       MIN_STABLE_CYCLES, TARGET_TEMP_FOR_AUTOTUNE, MIN_N_OSCILLATIONS, AUTOTUNE_TIMEOUT,
  *       EEPROM_ADDR_KP, EEPROM_ADDR_KI, EEPROM_ADDR_KD.
  */
 void CoreSystem::update(ProgramManager& __prog) {
 
-    // Poll the temperature probe at a fixed interval
-    if(millis() - lastTempReading> POLL_PROBE_INTERVAL){
-        ReadTemperature();
-    }
+    // Sample the temperature probes, one per time slot
+    sampleProbes();
 
-    //! the polling does not interfere with the temperature control loop
-    // The temperature control polls the temperature probe indipendently,
-    // following the PWM cycle time
+    //! the sampling does not interfere with the temperature control loop
+    // The temperature control uses the latest reading of each zone, which is
+    // never older than N_ZONES sampling slots
 
     // TEMPERATURE CONTROL LOOP
     //if the system is not allowed to fire the heater, then we should not do anything
@@ -117,34 +113,66 @@ void CoreSystem::update(ProgramManager& __prog) {
         if(fireHeater == true){
             unsigned long time = millis();
 
-            // if duty cycle has ended
-            if(millis() > dutyEnd){
-                // turn off the heater
-                digitalWrite(PIN_HEATER, LOW);
-            }
+            // if the duty cycle of a stage has ended, turn it off
+            releaseStages();
 
             // if the time has come to start the next cycle
             if(millis()>nextPWMCycle){
-                // read the temperature
-                ReadTemperature();
+                double dutySum = 0;
+                double maxError = 0;
+                double filtered = FilteredTemperature();
+
+                // recovery boost: full power until the lag of the oven alone will bring the temperature
+                // into the band, where the PID takes over. The PID doesn't run during the boost, so the
+                // integral keeps its value from before the door opening and doesn't wind up.
+                if(recovering && filtered + HeatingRate() / 60 * KALMAN_RATE_TAU >= targetTemperature - RECOVERY_BAND){
+                    recovering = false;
+                }
 
-                // Compute the PID values
-                double error = targetTemperature - currentTemperature;
-                dutyCycle = PID(error);
+                for(uint8_t z = 0; z < N_ZONES; z++){
+                    // Compute the PID values of the zone, pulling it toward the mean temperature.
+                    // The zone is measured as its offset from the mean, applied to the filtered mean,
+                    // so the control and the stability check don't react to the noise of single samples
+                    double error = targetTemperature - (zones[z].temperature - currentTemperature + filtered);
+                    double balance = ZONE_BALANCE_GAIN * (currentTemperature - zones[z].temperature);
+                    if(recovering) zones[z].dutyCycle = 100;
+                    else PID(zones[z], error + balance);
+                    zones[z].last_error = error + balance;
+
+                    // split the duty cycle over the heater stages and turn them on
+                    fireStages(z, time);
+
+                    dutySum += zones[z].dutyCycle;
+                    if(abs(error) > maxError) maxError = abs(error);
+                }
+                dutyCycle = dutySum / N_ZONES;
 
-                // calculate the end of the duty cycle
-                dutyEnd = time + (dutyCycle * PWMPeriod / 100);
+                // advance the core temperature estimate of the workpiece
+                load.update(currentTemperature, time);
 
                 // calculate the start of the next cycle
                 nextPWMCycle = time + PWMPeriod;
 
-                // turn on the heater
-                digitalWrite(PIN_HEATER, HIGH);
-
-                last_error = error;
+                // time-in-band statistics of the hold
+                if(holding){
+                    double deviation = abs(targetTemperature - filtered);
+                    if(deviation <= MAX_TEMP_ERROR) holdInBand += time - lastHoldCheck;
+                    if(deviation > holdMaxDeviation) holdMaxDeviation = deviation;
+                    lastHoldCheck = time;
+                }
 
-                // check on stability   
-                if(abs(error) < MAX_TEMP_ERROR && isStable == false){
+                // statistics of the run, for its summary in the run index.
+                // No overshoot is counted while the target falls faster than the oven cools
+                if(filtered > peakTemperature) peakTemperature = filtered;
+                if(targetTemperature >= lastCycleTarget && filtered - targetTemperature > maxOvershoot)
+                    maxOvershoot = filtered - targetTemperature;
+                lastCycleTarget = targetTemperature;
+                energy += HEATER_POWER_W * dutyCycle / 100.0 * PWMPeriod / 3600000.0;
+
+                // check on stability, all the zones must be within the tolerance.
+                // Out of the band the stability is lost: a ramp starts with no error and would
+                // otherwise keep it latched while the kiln falls behind the setpoint
+                if(maxError < MAX_TEMP_ERROR && isStable == false){
                     stabilityCounter++;
                     if(stabilityCounter == MIN_STABLE_CYCLES){
                         isStable = true;
@@ -152,12 +180,11 @@ void CoreSystem::update(ProgramManager& __prog) {
                 }
                 else{
                     stabilityCounter = 0;
+                    if(maxError >= MAX_TEMP_ERROR) isStable = false;
                 }
 
-                // update log
-                if(keepLog && __prog.IsSelected())
-                    updateLog(*__file, (char*)__prog.CurrentInstruction().name, time, //...
-                                currentTemperature, targetTemperature, dutyCycle);
+                // update log, if the target or the duty cycle moved enough for a record
+                logSample(time);
             }
         }
     }
@@ -179,16 +206,15 @@ void CoreSystem::update(ProgramManager& __prog) {
             __autPar.lastToggleTime = millis(); // Timestamp
 
             __autPar.heaterState = true; // Start with heater on
-            digitalWrite(PIN_HEATER, HIGH);
+            writeAllStages(HIGH);
         } else {
             unsigned long currentTime = millis();
-            ReadTemperature();
 
             // Monitor temperature and toggle heater
             if (__autPar.heaterState && currentTemperature >= TARGET_TEMP_FOR_AUTOTUNE) {
                 // Heater off
                 __autPar.heaterState = false;
-                digitalWrite(PIN_HEATER, LOW);
+                writeAllStages(LOW);
                 __autPar.lastToggleTime = currentTime;
 
                 // Record max temperature
@@ -198,7 +224,7 @@ void CoreSystem::update(ProgramManager& __prog) {
             } else if (!__autPar.heaterState && currentTemperature <= (TARGET_TEMP_FOR_AUTOTUNE - 0.5)) {
                 // Heater on
                 __autPar.heaterState = true;
-                digitalWrite(PIN_HEATER, HIGH);
+                writeAllStages(HIGH);
                 __autPar.lastToggleTime = currentTime;
 
                 // Record min temperature
@@ -272,7 +298,6 @@ void CoreSystem::update(ProgramManager& __prog) {
  * 
  * @param sys Reference to the CoreSystem object.
  * @param prog Reference to the ProgramManager object.
- * @param sens Reference to the TemperatureProbe object.
  * @return true if the system state was managed successfully.
  * @return false if an error occurred and the system needs user intervention.
  * 
@@ -286,7 +311,7 @@ void CoreSystem::update(ProgramManager& __prog) {
  * - HOLD: Hold the current temperature for a known or unknown period.
  * - ERROR: Manage errors and stop the system.
  */
-bool manageSystemState(CoreSystem& sys, ProgramManager& prog, TemperatureProbe& sens) {
+bool manageSystemState(CoreSystem& sys, ProgramManager& prog) {
     
   // check for the status of the system
   switch(sys.Status()){
@@ -306,11 +331,20 @@ bool manageSystemState(CoreSystem& sys, ProgramManager& prog, TemperatureProbe&
     // BEGIN: program has been selected, initialize and start the execution
     case BEGIN:                     
         // load the first instruction from the file 
-        sys.setTarget(prog.CurrentInstruction().target, true);
+        sys.setTarget(prog.CurrentInstruction().Target(), true);
 
         // create & initialize log file
         prog.setProgStartTime(millis());
 
+        // start the core temperature estimator, if the program describes its load
+        sys.startLoadModel(prog.LoadThickness());
+
+        // integrate the heatwork, if the program is fired to a cone
+        if(prog.Cone() != 0) sys.startHeatwork(prog.Cone());
+
+        // peak, overshoot and energy of the run, for the run index
+        sys.startRunStats();
+
         // begin execution
         sys.updateStatus(EXECUTING); // update program status
 
@@ -318,26 +352,49 @@ bool manageSystemState(CoreSystem& sys, ProgramManager& prog, TemperatureProbe&
         sys.allowFiring();           // enable heating 
 
         if(sys.KeepLog()) {          // if logging is enabled
-            __file = createLog();    // create the log file
-            beginLog(*__file, prog); // write the header
+            uint32_t logSize = logSizeEstimate(prog);
+            __file = createLog(prog.Name(), logSize);    // create the log file
+            if(__file != nullptr){
+                __logWriter.begin(*__file);
+                __logWriter.preAllocate(logSize);  // contiguous file, if the card allows
+            }
+            beginLog(__logWriter, prog);  // write the header
+            __logPolicy.begin();          // the first record is due at once
         }
+        __maxLoopTime = 0;           // the loop latency is reported at the end of the log
 
         break;
 
     // EXECUTING: manage the execution of a program
     case EXECUTING:  
-        return programExecution(sys, prog, sens);
+        // if the program has just been released from a hold, restart its clock and report the hold
+        if(sys.IsHolding()){
+            sys.stopHold();
+            prog.resumeRamp();
+            prog.resumeSoakTimer();
+
+            if(sys.KeepLog()) {
+                char message[64];
+                snprintf(message, sizeof(message), "EVENT: Hold released after %lu s, %lu s in band, max dev %d",
+                        sys.HoldTime() / 1000, sys.HoldInBandTime() / 1000, (int) sys.HoldMaxDeviation());
+                updateLog(__logWriter, message, prog.elapsedTime());
+            }
+        }
+        return programExecution(sys, prog);
         break;
 
     // END: program has finished, close the log file and go to IDLE
     case END:     // write the end of the log file and close it
-        if(sys.KeepLog()) closeLog(*__file, prog);
+        if(sys.KeepLog() && __logWriter.IsOpen()) closeLog(__logWriter, prog, END);
+
+        // keep what the firing taught about the oven
+        sys.saveOvenModel();
         
         // free the memory
         prog.clearProgram();
 
         // go to IDLE
-        digitalWrite(PIN_HEATER, LOW); // turn off the heater
+        sys.switchOffHeaters();        // turn off the heater
         sys.Clear();                   // reset the core system
         delay(1000);                   // wait for the system to stabilize
         break;
@@ -347,10 +404,12 @@ bool manageSystemState(CoreSystem& sys, ProgramManager& prog, TemperatureProbe&
         // if the door has just been opened, timestamp the event
         if (sys.lastDoorOpening() == 0){
             sys.recordDoorOpening(); // timestamp the door opening
+            prog.pauseRamp();        // the setpoint and the soak wait for the recovery
+            prog.pauseSoakTimer();
 
             // report on the log file
             if(sys.KeepLog()) {
-                updateLog(*__file, (char *)"EVENT: Door opened", prog.elapsedTime());
+                updateLog(__logWriter, (char *)"EVENT: Door opened", prog.elapsedTime());
             }
         }
         else {
@@ -360,8 +419,8 @@ bool manageSystemState(CoreSystem& sys, ProgramManager& prog, TemperatureProbe&
                 
                 // Update the log file
                 if(sys.KeepLog()) {
-                    updateLog(*__file, errorStreamChar, prog.elapsedTime());
-                    closeLog(*__file, prog);
+                    updateLog(__logWriter, errorStreamChar, prog.elapsedTime());
+                    closeLog(__logWriter, prog, ERROR);
                     __file = nullptr;
                 }
                 
@@ -373,42 +432,73 @@ bool manageSystemState(CoreSystem& sys, ProgramManager& prog, TemperatureProbe&
         break;
 
     // RECOVER: recover the state of the system after the door has been closed
-    case RECOVER: // report that the door has been closed on the log file
-        if(sys.KeepLog()) {
-            updateLog(*__file, (char *) "EVENT: Door closed", prog.elapsedTime());
-        };
+    // The heaters are boosted until the target is in reach, then the PID brings the temperature
+    // into the band. Until then the ramp and the soak timer stay frozen.
+    // A program held before the door was opened goes back to HOLD, still frozen: only the
+    // operator releases a hold.
+    case RECOVER:
+        // if the door has just been closed, start the recovery
+        if(sys.lastDoorOpening() != 0){
+            sys.clearDoorOpening();
+            sys.startRecovery();
+
+            // report that the door has been closed on the log file
+            if(sys.KeepLog()) {
+                updateLog(__logWriter, (char *) "EVENT: Door closed", prog.elapsedTime());
+            }
+        }
 
-        // TODO: implement the recovery process
-        // // wait for the system to stabilize
-        //if(sys.IsStable()){
-        //    sys.updateStatus(EXECUTING);
-        //}
-        sys.updateStatus(EXECUTING);
+        // the recovery is over when the boost has ended and the temperature is in the band
+        if(!sys.IsRecovering() && abs(sys.TargetTemperature() - sys.FilteredTemperature()) <= RECOVERY_BAND){
+            if(!sys.IsHolding()){
+                prog.resumeRamp();
+                prog.resumeSoakTimer();
+            }
 
-    // HOLD: hold the current temperature for a known or unknown period of time
-    case HOLD:    // TODO: implement the HOLD state 
+            if(sys.KeepLog()) {
+                char message[40];
+                snprintf(message, sizeof(message), "EVENT: Recovered in %lu s", (millis() - sys.RecoveryStart()) / 1000);
+                updateLog(__logWriter, message, prog.elapsedTime());
+            }
+            sys.updateStatus(sys.IsHolding() ? HOLD : EXECUTING);
+        }
+        break;
+
+    // HOLD: hold the current temperature for a known or unknown period of time.
+    // The operator starts and releases the hold from the tune screen. The PID keeps the current
+    // target, while the ramp and the soak timer are frozen.
+    case HOLD:
+        if(!sys.IsHolding()){
+            sys.startHold();
+            prog.pauseRamp();
+            prog.pauseSoakTimer();
+
+            if(sys.KeepLog()) {
+                updateLog(__logWriter, (char *)"EVENT: Hold started", prog.elapsedTime());
+            }
+        }
         break;
 
     // USER_STOP: the user has stopped the program for whatever reason
     case USER_STOP:
         if (sys.KeepLog()) {
-            updateLog(*__file, (char *)"EVENT: User stopped the program", prog.elapsedTime());
+            updateLog(__logWriter, (char *)"EVENT: User stopped the program", prog.elapsedTime());
+            closeLog(__logWriter, prog, USER_STOP);     // END finds the log closed
         }
         sys.updateStatus(END);
         break;
     
     // ERROR: manage errors and stop the system
     case ERROR:   // manage errors
-        digitalWrite(PIN_HEATER, LOW); // turn off the heater
+        sys.switchOffHeaters(); // turn off the heater
+        sys.dumpBlackBox();     // the last probe samples, once, while the error stream holds the error
         // write errorstream on log file
         if(sys.KeepLog()) {
-            updateLog(*__file, errorStreamChar, prog.elapsedTime());    // write the error message
-            closeLog(*__file, prog);    // close the log file
+            updateLog(__logWriter, errorStreamChar, prog.elapsedTime());    // write the error message
+            closeLog(__logWriter, prog, ERROR);    // close the log file
             __file = nullptr;        // free the memory
         }
 
-        // TODO: implement data dump, eventually?
-
         // free the memory
         prog.clearProgram();
         sprintf(errorStreamChar, " "); // clear the error stream
@@ -439,16 +529,27 @@ bool manageSystemState(CoreSystem& sys, ProgramManager& prog, TemperatureProbe&
  * 
  * @param sys Reference to the CoreSystem object, which manages the core functionalities.
  * @param prog Reference to the ProgramManager object, which manages the sequence of instructions.
- * @param sens Reference to the TemperatureProbe object, which provides temperature readings.
  * 
  * @return true if the function executed successfully, false if it is waiting for a condition to be met.
  */
-bool programExecution(CoreSystem& sys, ProgramManager& prog, TemperatureProbe& sens) {
+bool programExecution(CoreSystem& sys, ProgramManager& prog) {
+
+    // streamed program: read the next instruction away from the heater edges, so the SD access
+    // doesn't add jitter to the PWM. If the current one is missing, it can't wait.
+    if(prog.IsStreaming() && (!prog.IsWindowReady() || (prog.IsPrefetchPending() && sys.IsQuietWindow()))){
+        if(!prog.prefetch()){
+            sys.updateStatus(ERROR);
+            return false;
+        }
+    }
+
+    // remaining time of the program, for the screen and the log
+    prog.updateEstimate(sys.Oven(), sys.Unit(), sys.FilteredTemperature());
     
     // if the instruction is done, move to the next one
     if(prog.isInstructionDone()){
         // eventually, for the door opening too
-        if(prog.CurrentInstruction().waitForButtonPress){
+        if(prog.CurrentInstruction().WaitForButtonPress()){
   
             // update the message buffer
             if(messageStream[0] == '\0') sprintf(messageStream, "Press the button to continue.");
@@ -462,14 +563,14 @@ bool programExecution(CoreSystem& sys, ProgramManager& prog, TemperatureProbe& s
 
             return false;
         }
-        else if (prog.CurrentInstruction().waitForDoorOpen){
+        else if (prog.CurrentInstruction().WaitForDoorOpen()){
             doorInterrupt(); // poll the door status
             // TODO maybe this needs a better implementation?
         }
         else {
             // move to the next instruction
             if(prog.nextInstruction()){
-                sys.setTarget(prog.CurrentInstruction().target, true);
+                sys.setTarget(prog.CurrentInstruction().Target(), true);
                 return true;
             }   
             else{
@@ -480,27 +581,52 @@ bool programExecution(CoreSystem& sys, ProgramManager& prog, TemperatureProbe& s
         }   
     }
     else {
-        
-        // if the instruction has a ramp coefficient, compute the ramp target
-        if(prog.CurrentInstruction().tempVariationRate != 0){
 
-            // if we are far from the target temperature, compute the ramp
-            if(abs(sys.CurrentTemperature() - prog.CurrentInstruction().target) > 2*MAX_TEMP_ERROR){
-            
-            double newtarget = sys.CurrentTemperature() + prog.CurrentInstruction().tempVariationRate * (millis() - prog.InstrStartTime())/60000;
-            sys.setTarget(newtarget, true);
-            }
-            else {
-                // if we are near the target temperature, we can stop ramping
-                prog.rampCompleted();   
+        // when firing to a cone, the last soak ends as soon as the heatwork of the cone is reached
+        if(prog.IsLastInstruction() && prog.IsSoaking() && sys.IsConeReached()){
+            char cone[5];
+            HeatworkIntegrator::coneName(sys.Cone(), cone);
+            sprintf(messageStream, "Cone %s reached.", cone);
+            if(sys.KeepLog()){
+                char message[48];
+                snprintf(message, sizeof(message), "EVENT: Cone %s heatwork reached, soak ended", cone);
+                updateLog(__logWriter, message, prog.elapsedTime());
             }
+            prog.resumeSoakTimer();     // the cone ends the soak, wherever the core is
+            prog.endSoak();
+            return true;
         }
 
+        // with a core soak, the core of the workpiece has to be at the target too: the soak timer
+        // only runs while the estimated core is in band, so the soak starts and ends on the core
+        bool coreReached = true;
+        if(prog.IsCoreSoak() && sys.HasLoadModel())
+            coreReached = abs(prog.CurrentInstruction().Target() - sys.CoreTemperature()) < MAX_TEMP_ERROR;
+        if(prog.IsSoaking()){
+            if(coreReached) prog.resumeSoakTimer();
+            else prog.pauseSoakTimer();
+        }
+        
+        // a new instruction starts its ramp from the current temperature
+        if(prog.IsRampPending()){
+            prog.startRamp(sys.FilteredTemperature());
+            sys.setTarget(prog.Setpoint(), true);
+            return true;
+        }
+
+        // follow the setpoint trajectory of the ramp
+        bool ramping = prog.IsRamping();
+        if(ramping) sys.setTarget(prog.Setpoint(), false);
+        else sys.setTarget(prog.CurrentInstruction().Target(), false);
+
         // if the temperature has not been reached yet
-        if (!prog.IsTargetReached()){
+        // (tracking the ramp is not enough to start the soak, its end must have been reached)
+        if (!prog.IsTargetReached() && !ramping){
 
-            // if the temperature is stable, start the soak timer
-            if(sys.IsStable() && !prog.IsSoaking()){
+            // if the temperature is stable at the target, and the core is at the target for a core soak,
+            // start the soak timer. A kiln lagging behind the end of the ramp is not in the band yet
+            bool inBand = fabs(prog.CurrentInstruction().Target() - sys.FilteredTemperature()) < MAX_TEMP_ERROR;
+            if(sys.IsStable() && inBand && coreReached && !prog.IsSoaking()){
                 prog.startSoakTimer();
                 return true;
             }
@@ -523,22 +649,25 @@ bool programExecution(CoreSystem& sys, ProgramManager& prog, TemperatureProbe& s
  * creating and managing log files, and updating logs with process information or error messages.
  * 
  * Functions:
- * - createLog:     Creates a new log file. If the file already exists, creates a new one with an incremented index.
+ * - createLog:     Creates a new log file, named after the next sequence number and the program, in its shard folder.
  * - beginLog:      Prints the header of the log file.
  * - updateLog:     Updates the log file with process information or error messages.
- * - closeLog:      Prints the end of the log file and frees the memory.
+ * - closeLog:      Prints the end of the log file, frees the memory and appends the summary of the run to the run index.
  */
 
 // --------------------------------------------------------------------------------------------
 
 // Create log
 /**
- * @brief Creates a new log file in the "logs" folder. If a file already exists with the name "log_x.csv",
- *        the function increments the index (x) until it finds an available file name.
+ * @brief Creates a new log file in the "logs" folder, named "NNNNN_program.csv" (or .tkl) from the next
+ *        log sequence number and the name of the program, in the shard folder of its number. The oldest
+ *        logs are removed first, to keep the retention limits and room on the card for the new log.
  * 
- * @return A pointer to the created File object. If the SD card is not present or a file cannot be created, returns NULL.
+ * @param programName Name of the running program, may be empty.
+ * @param size Estimated size of the log [B].
+ * @return A pointer to the created File object. If the SD card is not present, is full or a file cannot be created, returns NULL.
  */
-File* createLog() {
+File* createLog(const char* programName, uint32_t size) {
     static File logFile; // Use static to keep memory usage under control
 
     // Check if the SD card is available
@@ -563,23 +692,9 @@ File* createLog() {
         };
     }
 
-    // Generate a unique log file name in the format "log_x.csv"
-    char logName[16]; // Enough space for "log_65535.csv\0"
-    uint16_t logIndex = 0;
-    do {
-        snprintf(logName, sizeof(logName), "log_%d.csv", logIndex++); // Create file name
-    } while (__sd.exists(logName) && logIndex < 65535); // Ensure the file does not already exist, limit index to 65535
-
-    if (logIndex >= 65535) { 
-        // overwrite the last log
-        logIndex = 0;
-        snprintf(logName, sizeof(logName), "log_%d.csv", logIndex);
-    }
-
-    // Create the log file in write mode
-    logFile = __sd.open(logName, FILE_WRITE); // Open the file for writing
-    if (!logFile) { // Check if file creation was successful
-        drawSoftError(__screen, (char*)"Failed to create log file.");
+    // Make room for the log, then create it in its shard
+    if (!__logManager.prepare(size) || !__logManager.create(logFile, programName)) {
+        drawSoftError(__screen, errorStreamChar);
         delay(2000);
         __core.setKeepLog(false); // disable logging
         return NULL;
@@ -592,19 +707,125 @@ File* createLog() {
 
 // --------------------------------------------------------------------------------------------
 
+// Estimated size of the log of a program [B], from the runtime of its preflight: a record per
+// PWM cycle, with a margin for the waits, the holds and the door openings. The log policy
+// writes far less on stable segments, the unused space is freed when the log is closed
+uint32_t logSizeEstimate(ProgramManager& prog) {
+#ifdef BINARY_LOG
+    uint32_t record = tklRecordSize(TKL_COL_ZONES | TKL_COL_CORE | TKL_COL_HEATWORK | TKL_COL_ITERATION | TKL_COL_WINDOW, N_ZONES);
+#else
+    uint32_t record = LOG_CSV_RECORD_BYTES;
+#endif
+    double cycles = prog.Preflight().runtime * LOG_PREALLOCATE_MARGIN * 1000.0 / (CYCLE_TIME);
+    return cycles * record + LOG_SECTOR_SIZE;  // and the header
+}
+
+// --------------------------------------------------------------------------------------------
+
+#ifdef BINARY_LOG
+// Binary log (see TEEK_logFormat.h): the records are copied, not formatted
+static uint8_t logColumns = 0;              // optional columns of the records
+static unsigned int loggedName = 0xFFFF;    // last instruction of a streamed program whose name was logged
+#ifdef COMPRESSED_LOG
+static LogEncoder logEncoder;               // delta/varint coding of the records, in sector blocks
+#endif
+
+// Write a 16 bit column, little endian as the AVR
+static uint8_t* putColumn(uint8_t* p, uint16_t value) {
+    memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+
+// Write a message or name record, its text fills the following records
+static void logText(LogWriter& log, uint8_t flags, const char* text, unsigned long time) {
+    size_t length = strlen(text);
+    if(length > 255) length = 255;
+
+#ifdef COMPRESSED_LOG
+    logEncoder.text(flags, text, length, time, __program.InstructionIndex());
+#else
+    uint8_t size = tklRecordSize(logColumns, N_ZONES);
+    TklRecord rec = {};
+    rec.time = time;
+    rec.instruction = __program.InstructionIndex();
+    rec.flags = flags;
+    rec.length = length;
+    log.write((const uint8_t*) &rec, sizeof(rec));
+    for(uint8_t i = sizeof(rec); i < size; i++) log.write((uint8_t) 0);
+
+    log.write((const uint8_t*) text, length);
+    for(size_t i = length; i % size != 0; i++) log.write((uint8_t) 0);
+#endif
+}
+#endif
+
 // Print the header of the log file
-bool beginLog(File &log, ProgramManager& __prog) {    
-    if(!log) {
+bool beginLog(LogWriter &log, ProgramManager& __prog) {    
+    if(!log.IsOpen()) {
         sprintf(errorStreamChar, "ERROR: log file not found.\n");
         __core.setKeepLog(false);
         return false;
     }
+
+#ifdef BINARY_LOG
+    TklHeader header = {};
+    memcpy(header.magic, TKL_MAGIC, 3);
+#ifdef COMPRESSED_LOG
+    header.version = TKL_VERSION_COMPRESSED;
+#else
+    header.version = TKL_VERSION;
+#endif
+    header.columns = (N_ZONES > 1 ? TKL_COL_ZONES : 0) | (__core.HasLoadModel() ? TKL_COL_CORE : 0) |
+                     (__core.HasHeatwork() ? TKL_COL_HEATWORK : 0) | (__prog.NumOfRepeats() ? TKL_COL_ITERATION : 0) |
+                     TKL_COL_WINDOW;
+    header.numOfZones = N_ZONES;
+    header.recordSize = tklRecordSize(header.columns, N_ZONES);
+    header.unit = __core.Unit();
+    strncpy(header.program, __prog.Name(), TKL_PROGRAM_NAME - 1);
+
+    // the names are written once: the pool, and the name of each instruction.
+    // A streamed program doesn't hold them all, it logs the name of each instruction as it starts
+    bool nameTable = !__prog.IsStreaming();
+    header.numOfNames = nameTable ? __prog.NumOfInstructions() : 0;
+    header.nameBytes = nameTable ? __prog.NamePoolUsed() : 1;
+    log.write((const uint8_t*) &header, sizeof(header));
+    log.write((const uint8_t*) __prog.NamePool(), header.nameBytes);
+    for(unsigned int i = 0; i < header.numOfNames; i++) log.write(__prog.GetInstruction(i).nameOffset);
+
+#ifdef COMPRESSED_LOG
+    // the blocks of records start at a sector of the file
+    for(uint32_t n = sizeof(header) + header.nameBytes + header.numOfNames; n % TKZ_BLOCK_SIZE != 0; n++) log.write((uint8_t) 0);
+    logEncoder.begin(log, header.recordSize);
+#endif
+
+    logColumns = header.columns;
+    loggedName = 0xFFFF;
+#else
     // write the program name
     log.print("Program: ");     log.println(__prog.Name());
 
-    // write the header
-    log.println("Time,Name,Temperature,Target,DutyCycle");
-    log.println("[ms],[],[C],[C],[%]");
+    // write the header, with the temperature and duty cycle of each zone
+    log.print("Time,Name,Temperature,Target,DutyCycle,Min,Max,Mean");
+    if(N_ZONES > 1){
+        for(uint8_t z = 1; z <= N_ZONES; z++){
+            log.print(",T"); log.print(z); log.print(",D"); log.print(z);
+        }
+    }
+    if(__core.HasLoadModel()) log.print(",Core");
+    if(__core.HasHeatwork()) log.print(",Heatwork");
+    if(__prog.NumOfRepeats()) log.print(",Iteration");
+    log.print(",Remaining");
+    log.println();
+    log.print("[ms],[],[C],[C],[%],[C],[C],[C]");
+    if(N_ZONES > 1){
+        for(uint8_t z = 1; z <= N_ZONES; z++) log.print(",[C],[%]");
+    }
+    if(__core.HasLoadModel()) log.print(",[C]");
+    if(__core.HasHeatwork()) log.print(",[%]");
+    if(__prog.NumOfRepeats()) log.print(",[]");
+    log.print(",[hh:mm:ss]");
+    log.println();
+#endif
 
     return true;
 };
@@ -613,16 +834,59 @@ bool beginLog(File &log, ProgramManager& __prog) {
 
 // Update the log file with process info
 // Update log with process data (name, time, temperature, target, duty cycle)
-bool updateLog(File &log, const char* name, unsigned long time, double temp, double target, double duty) {
+// The record only goes into the sector buffer, the SD card is written by LogWriter::poll()
+bool updateLog(LogWriter &log, const char* name, unsigned long time, double temp, double target, double duty) {
     // Check if the file is valid and open
-
-
-    if (!log.isOpen()) {
+    if (!log.IsOpen()) {
         sprintf(errorStreamChar, "Log file not found or not open.\n");
         __core.setKeepLog(false);
         return false;
     }
 
+#ifdef BINARY_LOG
+    if(__program.IsStreaming() && __program.InstructionIndex() != loggedName){
+        loggedName = __program.InstructionIndex();
+        logText(log, TKL_NAME, name, time);
+    }
+
+    uint8_t record[sizeof(TklRecord) + 4 * N_ZONES + 12];
+    TklRecord rec = {};
+    rec.time = time;
+    rec.instruction = __program.InstructionIndex();
+    rec.temperature = tklTenths(temp);
+    rec.target = tklTenths(target);
+    rec.duty = duty * 100 + 0.5;
+    rec.flags = (__core.IsOn() ? TKL_HEATER_ON : 0) | (__core.IsStable() ? TKL_STABLE : 0) |
+                (__program.IsSoaking() ? TKL_SOAKING : 0) | (__core.IsHolding() ? TKL_HOLDING : 0);
+    unsigned long remaining = __program.RemainingTime() / (MINUTE);
+    rec.remaining = remaining < 0xFFFF ? remaining : 0xFFFF;
+    memcpy(record, &rec, sizeof(rec));
+
+    // optional columns, in the order of the format
+    uint8_t* p = record + sizeof(rec);
+    if(logColumns & TKL_COL_ZONES){
+        for(uint8_t z = 0; z < N_ZONES; z++){
+            p = putColumn(p, tklTenths(__core.ZoneTemperature(z)));
+            p = putColumn(p, __core.ZoneDutyCycle(z) * 100 + 0.5);
+        }
+    }
+    if(logColumns & TKL_COL_CORE) p = putColumn(p, tklTenths(__core.CoreTemperature()));
+    if(logColumns & TKL_COL_HEATWORK) p = putColumn(p, __core.HeatworkProgress() * 1000 + 0.5);
+    if(logColumns & TKL_COL_ITERATION){
+        *p++ = __program.RepeatIteration();
+        *p++ = __program.RepeatTimes();
+    }
+    if(logColumns & TKL_COL_WINDOW){
+        p = putColumn(p, tklTenths(__logPolicy.Min()));
+        p = putColumn(p, tklTenths(__logPolicy.Max()));
+        p = putColumn(p, tklTenths(__logPolicy.Mean()));
+    }
+#ifdef COMPRESSED_LOG
+    logEncoder.record(record);
+#else
+    log.write(record, p - record);
+#endif
+#else
     // Format the timestamp
     char buff[9];
     timeStampConverter(time, buff, 3); // Converts the time to a formatted string
@@ -637,13 +901,32 @@ bool updateLog(File &log, const char* name, unsigned long time, double temp, dou
     log.print(target,0); // Target temperature with no decimal places
     log.print(",");    
     log.print(duty, 2); // Duty cycle with 2 decimal places
-    log.println();     // End the line
-
-    // Ensure the data is written to the SD card
-    if (!log.sync()) {
-        sprintf(errorStreamChar, "Failed to sync log data.\n");
-        return false;
+    log.print(",");     // Temperature window since the previous record
+    log.print(__logPolicy.Min(), 2);  log.print(",");
+    log.print(__logPolicy.Max(), 2);  log.print(",");
+    log.print(__logPolicy.Mean(), 2);
+    if(N_ZONES > 1){   // Temperature and duty cycle of each zone
+        for(uint8_t z = 0; z < N_ZONES; z++){
+            log.print(",");  log.print(__core.ZoneTemperature(z), 2);
+            log.print(",");  log.print(__core.ZoneDutyCycle(z), 2);
+        }
+    }
+    if(__core.HasLoadModel()){   // Estimated core temperature of the workpiece
+        log.print(",");  log.print(__core.CoreTemperature(), 2);
+    }
+    if(__core.HasHeatwork()){   // Heatwork, as a percentage of the one of the target cone
+        log.print(",");  log.print(__core.HeatworkProgress() * 100, 1);
     }
+    if(__program.NumOfRepeats()){   // Iteration of the innermost repeat block, i.e. "2/3"
+        log.print(",");
+        if(__program.RepeatTimes()){
+            log.print(__program.RepeatIteration()); log.print("/"); log.print(__program.RepeatTimes());
+        }
+    }
+    timeStampConverter(__program.RemainingTime(), buff, 3);  // Estimated remaining time, waits excluded
+    log.print(",");  log.print(buff);
+    log.println();     // End the line
+#endif
 
     return true;
 }
@@ -652,14 +935,18 @@ bool updateLog(File &log, const char* name, unsigned long time, double temp, dou
 // --------------------------------------------------------------------------------------------
 
 // Update log with a message (i.e. error message)
-bool updateLog(File& log, const char* message, unsigned long time) {
+// Messages are events: the log is synced at the next poll
+bool updateLog(LogWriter& log, const char* message, unsigned long time) {
     // Check if the file is open
-    if (!log || !log.isOpen()) {
+    if (!log.IsOpen()) {
         sprintf(errorStreamChar, "Log file not found or not open.\n");
         __core.setKeepLog(false);
         return false;
     }
 
+#ifdef BINARY_LOG
+    logText(log, TKL_MESSAGE, message, time);
+#else
     // Format the timestamp
     char buff[9];
     timeStampConverter(time, buff, 3); // Converts the time to a formatted string
@@ -668,34 +955,53 @@ bool updateLog(File& log, const char* message, unsigned long time) {
     log.print(buff);  // Write the timestamp
     log.print(",");   // Separate fields with a comma
     log.println(message); // Write the message
+#endif
 
-    // Ensure the data is written to the SD card
-    if (!log.sync()) {
-        sprintf(errorStreamChar, "Failed to sync log data.\n");
-        return false;
-    }
+    // Ensure the event reaches the SD card soon
+    log.requestSync();
 
     return true;
 }
 // --------------------------------------------------------------------------------------------
 
 // Print the end of the log file and free the memory
-bool closeLog(File &log, ProgramManager& __prog) {
-    if(!log) {
+bool closeLog(LogWriter &log, ProgramManager& __prog, SystemState status) {
+    if(!log.IsOpen()) {
         sprintf(errorStreamChar, "log file not found.\n");
         return false;
     }
 
     // write the end of the log file
-    log.println("End of the program.");
     char buff[9];
     timeStampConverter(__prog.elapsedTime(), buff, 3);
+#ifdef BINARY_LOG
+    char message[64];
+    snprintf(message, sizeof(message), "End of the program. Elapsed time: %s", buff);
+    logText(log, TKL_MESSAGE, message, __prog.elapsedTime());
+    snprintf(message, sizeof(message), "Max loop time: %lu us, max log write: %lu us", __maxLoopTime, log.MaxWriteTime());
+    logText(log, TKL_MESSAGE, message, __prog.elapsedTime());
+#else
+    log.println("End of the program.");
     log.print("Elapsed time: "); log.println(buff);
+    log.print("Max loop time: "); log.print(__maxLoopTime / 1000.0, 1); log.println(" ms");
+    log.print("Max log write: "); log.print(log.MaxWriteTime() / 1000.0, 1); log.println(" ms");
     log.println("Have a nice day! :)");
+#endif
 
-    log.close(); // close the file
+    log.close(); // write the rest of the log and close the file
     __file = nullptr; // free the memory
-    return true;
+
+    // summary of the run, for the history
+    TklSummary summary = {};
+    summary.sequence = __logManager.CurrentSequence();
+    summary.duration = __prog.elapsedTime() / 1000;
+    strncpy(summary.program, __prog.Name(), TKL_SUMMARY_NAME - 1);
+    summary.peak = tklTenths(__core.PeakTemperature());
+    summary.overshoot = tklTenths(__core.MaxOvershoot());
+    summary.energy = __core.Energy() + 0.5;
+    summary.status = (status == ERROR) ? TKL_ERROR : (status == USER_STOP) ? TKL_USER_STOP : TKL_END;
+    summary.unit = __core.Unit();
+    return __logManager.appendSummary(summary);
 };
 
 //* ========================================= Auxiliary functions ==============================
@@ -746,7 +1052,7 @@ void doorInterrupt(){
   // HIGH == door open
   if(digitalRead(PIN_DOOR_INTERRUPT) == HIGH){
     __core.denyFiring(); // prevent the heater from turning on
-    digitalWrite(PIN_HEATER, LOW);      // turn off the heater
+    __core.switchOffHeaters();  // turn off the heater
 
     // if the system is executing a program, pause the execution
     if(__program.IsSelected()){
@@ -763,13 +1069,14 @@ void doorInterrupt(){
      __core.updateStatus(EXECUTING);
 
       // if the door action was expected, move to the next instruction
-      if(__program.CurrentInstruction().waitForDoorOpen){
+      // (not while held: the program waits for the operator, the door was opened to inspect the load)
+      if(__program.CurrentInstruction().WaitForDoorOpen() && !__core.IsHolding()){
         __program.nextInstruction();
-        
+        __core.clearDoorOpening();
       }
       else {
         // if the door action was not expected, recover the system temperature
-        __core.updateStatus(RECOVER); // TODO: implement the recover state
+        __core.updateStatus(RECOVER);
       }
 
     }
@@ -20,6 +20,8 @@
 #include "TEEK_pins.h"
 #include "TEEK_dataStructures.h"
 #include "TEEK_graphics.h"  // ScreenManager class definition
+#include "TEEK_log.h"       // Sector buffered log writer
+#include "TEEK_logFormat.h" // Binary log format
 
 
 
@@ -32,9 +34,13 @@ extern char messageStream[ERROR_BUFF_SIZE];
 
 
 extern ProgramManager   __program;  // Program manager
-extern TemperatureProbe __probe;    // Temperature probe
 extern CoreSystem       __core;     // Core management (PID, PWM, etc.)
 extern File *           __file;     // Data log file / generic file pointer
+extern LogWriter        __logWriter; // Buffered writer of the log file
+extern LogManager       __logManager; // Naming and retention of the logs
+extern LogPolicy        __logPolicy; // Adaptive rate of the log records
+extern BlackBox         __blackBox; // Last probe samples, dumped on an error
+extern unsigned long    __maxLoopTime;  // [us] longest iteration of the main loop
 extern TFT_HX8357       __screen;   // TFT screen
 extern ClickEncoder     __encoder;  // Rotary encoder
 extern SdFat            __sd;       // SD card handler
@@ -47,17 +53,18 @@ extern AutotuneParameters   __autPar; // Autotune parameters wrapper
 
 
 // -- Program execution
-bool manageSystemState(CoreSystem &__core, ProgramManager &__Program, TemperatureProbe &__Probe);
-bool programExecution(CoreSystem &__core, ProgramManager &__Program, TemperatureProbe &__Probe);
+bool manageSystemState(CoreSystem &__core, ProgramManager &__Program);
+bool programExecution(CoreSystem &__core, ProgramManager &__Program);
 
 
 // -- Log file management
-File *createLog();
-bool beginLog(File &log, ProgramManager &__prog);
-bool updateLog(File &log, const char* name, unsigned long time, double temp, double target, double duty);
-bool updateLog(File &log, const char* message, unsigned long time);
-bool endLog(File &log);
-bool closeLog(File &log, ProgramManager &__prog);
+File *createLog(const char* programName, uint32_t size);
+uint32_t logSizeEstimate(ProgramManager &prog);
+bool beginLog(LogWriter &log, ProgramManager &__prog);
+bool updateLog(LogWriter &log, const char* name, unsigned long time, double temp, double target, double duty);
+bool updateLog(LogWriter &log, const char* message, unsigned long time);
+bool endLog(LogWriter &log);
+bool closeLog(LogWriter &log, ProgramManager &__prog, SystemState status);
 
 
 // -- Auxiliary functions
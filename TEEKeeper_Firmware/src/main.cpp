@@ -8,8 +8,7 @@ TFT_HX8357 __screen; // TFT screen
 
 // == TEEKeeper components
 ProgramManager      __program;          // Program manager
-TemperatureProbe    __probe;            // Temperature sensor
-CoreSystem          __core(__probe);    // Core system
+CoreSystem          __core;             // Core system (zones, probes and heaters)
 SdFat               __sd;               // SD card 
 AutotuneParameters  __autPar;           // Autotune parameters wrapper
 extern ScreenManager __GUI;            // Screen manager
@@ -17,6 +16,7 @@ extern ScreenManager __GUI;            // Screen manager
 // == Global variables
 char errorStreamChar[ERROR_BUFF_SIZE]; // Error message buffer
 char messageStream[ERROR_BUFF_SIZE];   // Message buffer
+unsigned long __maxLoopTime = 0;       // [us] longest iteration of the loop, reported in the log
 
 void setup(){
     TEEK_Setup(); // Setup & initialize the system
@@ -35,10 +35,16 @@ void setup(){
 };
 
 void loop(){
+    unsigned long start = micros();
 
     __core.update(__program);                           // PWM cycle manager
-    manageSystemState(__core, __program, __probe);      // Program execution manager
+    manageSystemState(__core, __program);               // Program execution manager
     __GUI.updateGraphics(__core, __screen, __encoder);  // Update the GUI
+    if(__core.IsQuietWindow()) __logWriter.poll();      // Write the log to the SD, away from the heater edges
+
+    // worst case latency of the control loop
+    unsigned long time = micros() - start;
+    if(time > __maxLoopTime) __maxLoopTime = time;
     delay(1);
 };  
 
@@ -0,0 +1,136 @@
+// csv_bench - timing of the CSV program parser against the one it replaced
+//
+// Parses the same instruction rows with CsvLayout::parseRow (src/TEEK_csv.h) and with the former
+// parseCSVLine of ProgramManager, copied below as it was: each field copied into a 16 bytes
+// buffer, then converted. Both get a fresh copy of the line for each row, as the firmware reads
+// it into its line buffer. The rows are well formed: the former parser read past the end of a
+// row missing its flags.
+//
+// Build (from the tools folder):
+//      g++ -std=c++11 -O2 -Wall -I../src -o csv_bench csv_bench.cpp ../src/TEEK_csv.cpp
+//
+// Usage:
+//      csv_bench [rows]
+
+#include "TEEK_constants.h"
+#include "TEEK_csv.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// ===== FORMER PARSER (ProgramManager::parseCSVLine, before the tokenizer) =====
+
+static const char* extractField(const char* line, char* buffer, size_t bufferSize) {
+    size_t i = 0;
+    while (*line != ',' && *line != '\0' && i < bufferSize - 1) {
+        buffer[i++] = *line++;
+    }
+    buffer[i] = '\0'; // Null-terminate the buffer
+    if (*line == ',') line++; // Consume the comma
+    return line;
+}
+
+static bool parseCSVLine(
+    const char* line,
+    char* name, size_t nameSize,
+    double* target, unsigned long* holdTime, double* rampRate,
+    bool* waitForDoorOpen, bool* waitForButtonPress) {
+
+    char tempBuffer[16];
+    size_t tempIndex = 0;
+    const char* ptr = line;
+
+    while (*ptr != ',' && *ptr != '\0') {
+        if (tempIndex < nameSize - 1) {
+            name[tempIndex++] = *ptr++;
+        } else {
+            return false; // Name too long
+        }
+    }
+    name[tempIndex] = '\0';
+    if (*ptr++ != ',') return false;
+
+    ptr = extractField(ptr, tempBuffer, sizeof(tempBuffer));
+    *target = atof(tempBuffer);
+    ptr = extractField(ptr, tempBuffer, sizeof(tempBuffer));
+    *holdTime = atol(tempBuffer);
+    ptr = extractField(ptr, tempBuffer, sizeof(tempBuffer));
+    *rampRate = atof(tempBuffer);
+
+    *waitForDoorOpen = (*ptr == '1');
+    ptr += 2;
+    *waitForButtonPress = (*ptr == '1');
+    return true;
+}
+
+
+// ===== BENCHMARK =====
+
+static const char* const rows[] = {
+    "Candle,90,120,50,0,0",
+    "Bisque ramp,600,0,100,0,0",
+    "Body,1000,30,150,0,1",
+    "Glaze,1240,15,60,1,0",
+    "Cool,800,0,-150,0,0",
+    "Anneal 1/2 blade,815.5,45,222.2,0,0",
+};
+
+int main(int argc, char** argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 5000000;
+    const size_t n = sizeof(rows) / sizeof(rows[0]);
+    char line[128];
+    double sum = 0;     // keeps the compiler from dropping the parsing
+
+    // both parsers must read the same values
+    CsvLayout layout;
+    unsigned int mismatches = 0;
+    for (size_t r = 0; r < n; r++) {
+        char name[MAX_INSTR_NAME_LENGHT];
+        double target = 0, rate = 0;
+        unsigned long hold = 0;
+        bool door = false, button = false;
+        strcpy(line, rows[r]);
+        parseCSVLine(line, name, sizeof(name), &target, &hold, &rate, &door, &button);
+        CsvRow row;
+        CsvError error;
+        strcpy(line, rows[r]);
+        if (!layout.parseRow(line, row, error, MAX_INSTR_NAME_LENGHT) || strcmp(row.name, name) != 0 || row.target != target ||
+            row.hold != hold || row.rate != rate || row.waitForDoorOpen != door || row.waitForButtonPress != button) {
+            printf("mismatch:      %s\n", rows[r]);
+            mismatches++;
+        }
+    }
+
+    // former parser
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        strcpy(line, rows[i % n]);
+        char name[MAX_INSTR_NAME_LENGHT];
+        double target = 0, rate = 0;
+        unsigned long hold = 0;
+        bool door = false, button = false;
+        parseCSVLine(line, name, sizeof(name), &target, &hold, &rate, &door, &button);
+        sum += target + hold + rate + door + button + name[0];
+    }
+    double before = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+
+    // tokenizer, legacy column order
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        strcpy(line, rows[i % n]);
+        CsvRow row;
+        CsvError error;
+        layout.parseRow(line, row, error, MAX_INSTR_NAME_LENGHT);
+        sum += row.target + row.hold + row.rate + row.waitForDoorOpen + row.waitForButtonPress + row.name[0];
+    }
+    double after = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+
+    printf("rows:          %zu (sum %g)\n", count, sum);
+    printf("parseCSVLine:  %.1f ns per row\n", before);
+    printf("parseRow:      %.1f ns per row (%.2fx)\n", after, before / after);
+    printf("mismatches:    %u of %zu rows\n", mismatches, n);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+// fuzz_csv - fuzzing target of the CSV program parser (src/TEEK_csv.h)
+//
+// The input is split in lines, as the firmware reads a program: the first one goes to
+// CsvLayout::parseHeader, the following ones to CsvTokenizer and CsvLayout::parseRow, each in
+// its own exact size buffer so that any read or write past the line is caught by the sanitizers.
+// Besides the crashes, the target aborts on a broken invariant: a field outside of its line, a
+// position past the end of the line, an accepted row with values the packed instruction can't
+// hold, a name too long or a unit other than C, F, K.
+//
+// Build with libFuzzer (from the tools folder):
+//      clang++ -std=c++11 -g -O1 -fsanitize=fuzzer,address,undefined -I../src -o fuzz_csv fuzz_csv.cpp ../src/TEEK_csv.cpp
+//      ./fuzz_csv corpus/
+//
+// Without clang, the standalone driver runs the target on the given files, or on random lines
+// built from CSV tokens:
+//      g++ -std=c++11 -g -O1 -fsanitize=address,undefined -DFUZZ_STANDALONE -I../src -o fuzz_csv fuzz_csv.cpp ../src/TEEK_csv.cpp
+//      ./fuzz_csv [iterations] [seed]
+//      ./fuzz_csv program.csv...
+
+#include "TEEK_constants.h"
+#include "TEEK_csv.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define CHECK(condition) do { if (!(condition)) { fprintf(stderr, "invariant broken: %s\n", #condition); abort(); } } while (0)
+
+// Tokenize a line, and check that every field lies in it
+static void tokenize(const char* text, size_t size) {
+    std::vector<char> buffer(text, text + size);
+    buffer.push_back('\0');
+    char* line = buffer.data();
+    size_t length = strlen(line);
+
+    CsvTokenizer tok;
+    tok.begin(line);
+    char* value;
+    unsigned int fields = 0;
+    while (tok.next(value)) {
+        CHECK(value >= line && value <= line + length);
+        CHECK(value + strlen(value) <= line + length);
+        CHECK(tok.Field() == fields % 256);
+        fields++;
+    }
+    CHECK(fields >= 1);
+}
+
+// Parse a row, and check what an accepted row holds
+static void parseRow(const CsvLayout& layout, const char* text, size_t size) {
+    std::vector<char> buffer(text, text + size);
+    buffer.push_back('\0');
+    char* line = buffer.data();
+    size_t length = strlen(line);
+
+    CsvRow row;
+    CsvError error;
+    if (!layout.parseRow(line, row, error, MAX_INSTR_NAME_LENGHT)) {
+        CHECK(error.message != nullptr && error.message[0] != '\0');
+        return;
+    }
+    CHECK(row.name >= line && row.name + strlen(row.name) <= line + length);
+    CHECK(strlen(row.name) < MAX_INSTR_NAME_LENGHT);
+    CHECK(std::isfinite(row.target) && fabs(row.target) <= INT16_MAX / 10);
+    CHECK(std::isfinite(row.rate) && fabs(row.rate) <= INT16_MAX / 10);
+    CHECK(row.hold <= UINT16_MAX);
+    CHECK(row.unit >= CSV_NO_UNIT && row.unit <= 2);
+    CHECK(layout.HasUnit() || row.unit == CSV_NO_UNIT);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    const char* text = reinterpret_cast<const char*>(data);
+    const char* end = text + size;
+    CsvLayout layout;
+    bool header = true;
+
+    while (text < end) {
+        const char* eol = static_cast<const char*>(memchr(text, '\n', end - text));
+        size_t length = (eol ? eol : end) - text;
+
+        tokenize(text, length);
+        if (header) {
+            std::vector<char> buffer(text, text + length);
+            buffer.push_back('\0');
+            layout.parseHeader(buffer.data());
+            header = false;
+        }
+        else {
+            std::vector<char> buffer(text, text + length);
+            buffer.push_back('\0');
+            if (!CsvTokenizer::isSkippable(buffer.data())) parseRow(layout, text, length);
+        }
+        text += length + (eol ? 1 : 0);
+    }
+    return 0;
+}
+
+
+#ifdef FUZZ_STANDALONE
+// Random programs from the tokens of the CSV programs, and random bytes
+static const char* const tokens[] = {
+    ",", ",", ",", "\"", "\"\"", " ", "\t", "\r", "#", "@", "0", "1", "-", ".", "e", "9",
+    "100", "1e9", "3276.7", "3276.8", "-3276.7", "65535", "65536", "0.5", "nan", "inf", "-inf", "0x1p3",
+    "Name", "Target [C]", "temp", "Hold", "soak", "Rate", "ramp", "Door", "Button", "Unit",
+    "C", "f", "K", "X", "\" \"", "\"C\"", "\"a,b\"", "Bisque", "averyveryveryverylonginstructionname"
+};
+
+static const char* const headers[] = {
+    "name,target,hold,rate,door,button,unit", "Unit,Rate,Hold,Temp,Name", "name,target,hold,rate"
+};
+
+int main(int argc, char** argv) {
+    // files: run each of them once
+    if (argc > 1 && strspn(argv[1], "0123456789") != strlen(argv[1])) {
+        for (int i = 1; i < argc; i++) {
+            FILE* in = fopen(argv[i], "rb");
+            if (!in) {
+                fprintf(stderr, "%s: cannot open the file\n", argv[i]);
+                return 2;
+            }
+            std::vector<uint8_t> input;
+            int c;
+            while ((c = fgetc(in)) != EOF) input.push_back(c);
+            fclose(in);
+            LLVMFuzzerTestOneInput(input.data(), input.size());
+        }
+        printf("%d files, no invariant broken\n", argc - 1);
+        return 0;
+    }
+
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    srand(argc > 2 ? strtoul(argv[2], NULL, 10) : 1);
+
+    std::vector<uint8_t> input;
+    for (unsigned long i = 0; i < iterations; i++) {
+        input.clear();
+        int lines = 1 + rand() % 4;
+        if (rand() % 2) {
+            const char* header = headers[rand() % (sizeof(headers) / sizeof(headers[0]))];
+            input.insert(input.end(), header, header + strlen(header));
+            input.push_back('\n');
+        }
+        for (int l = 0; l < lines; l++) {
+            // a row of fields, each of a few tokens or random bytes
+            int fields = 1 + rand() % 9;
+            for (int f = 0; f < fields; f++) {
+                if (f > 0) input.push_back(',');
+                int items = rand() % 3;
+                for (int t = 0; t < items; t++) {
+                    if (rand() % 8 == 0) input.push_back(rand() % 256);
+                    else {
+                        const char* token = tokens[rand() % (sizeof(tokens) / sizeof(tokens[0]))];
+                        input.insert(input.end(), token, token + strlen(token));
+                    }
+                }
+            }
+            input.push_back('\n');
+        }
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    printf("%lu inputs, no invariant broken\n", iterations);
+    return 0;
+}
+#endif
@@ -0,0 +1,82 @@
+// kalman_bench - host benchmark of the ThermalKalman filter of the firmware
+//
+// Runs the filter of src/TEEK_estimators.cpp on a simulated firing: a ramp, a soak and a free
+// cooling, sampled every PROBE_SAMPLE_SLOT ms with the noise of a MAX31855, one reading in ten
+// missing. Reports the time of a predict + update step, and the error of the estimate against
+// the simulated temperature, next to the one of the raw readings.
+// On the AVR double is a 32 bit software float: the cost of a step there is estimated from its
+// operation count, in the doc of ThermalKalman (src/TEEK_estimators.h).
+//
+// Build (from the tools folder):
+//      g++ -std=c++11 -O2 -Wall -I../src -o kalman_bench kalman_bench.cpp ../src/TEEK_estimators.cpp
+//
+// Usage:
+//      kalman_bench [steps]
+
+#include "TEEK_estimators.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+struct Sample {
+    unsigned long time;     // [ms]
+    double truth;           // [C]
+    double reading;         // [C], NaN if missing
+    double heat;            // heater command, 0..1
+};
+
+// Ramp at 100 C/h to 1000 C, soak, then cool with the heaters off
+static std::vector<Sample> simulate(size_t steps) {
+    std::mt19937 rng(42);
+    std::normal_distribution<double> noise(0, sqrt(KALMAN_R));
+    std::vector<Sample> samples(steps);
+    double temp = 20;
+    for (size_t i = 0; i < steps; i++) {
+        double t = i * PROBE_SAMPLE_SLOT / 1000.0;  // [s]
+        double heat;
+        if (temp < 1000 && i < steps / 2) { temp += 100.0 / 3600 * PROBE_SAMPLE_SLOT / 1000.0; heat = 0.6; }
+        else if (i < steps * 3 / 4) heat = 0.4;
+        else { temp -= KALMAN_COOLING * (temp - 20) * PROBE_SAMPLE_SLOT / 1000.0; heat = 0; }
+        samples[i].time = (unsigned long) (t * 1000);
+        samples[i].truth = temp;
+        samples[i].reading = (i % 10 == 9) ? NAN : temp + noise(rng);
+        samples[i].heat = heat;
+    }
+    return samples;
+}
+
+int main(int argc, char** argv) {
+    size_t steps = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    if (steps < 2) steps = 2;
+    std::vector<Sample> samples = simulate(steps);
+
+    ThermalKalman kalman;
+    kalman.begin(samples[0].reading, samples[0].time, KALMAN_AMBIENT, 1);
+    double errorFilter = 0, errorRaw = 0;
+    size_t readings = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 1; i < steps; i++) {
+        const Sample& s = samples[i];
+        kalman.predict(s.heat, s.time);
+        if (!std::isnan(s.reading)) kalman.update(s.reading);
+        // the error sums are cheap next to the step, and keep the compiler from dropping it
+        double e = kalman.Temperature() - s.truth;
+        errorFilter += e * e;
+        if (!std::isnan(s.reading)) {
+            errorRaw += (s.reading - s.truth) * (s.reading - s.truth);
+            readings++;
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    printf("steps:            %zu (%.1f h of firing)\n", steps, steps * PROBE_SAMPLE_SLOT / 3600000.0);
+    printf("predict + update: %.1f ns per step\n", ns / (steps - 1));
+    printf("RMS error:        %.3f C filtered, %.3f C raw\n", sqrt(errorFilter / (steps - 1)), sqrt(errorRaw / readings));
+    printf("final rate:       %.2f C/min\n", kalman.Rate());
+    return 0;
+}
@@ -0,0 +1,320 @@
+// tkl2csv - TEEKeeper binary log converter
+//
+// Converts a binary log (.tkl, see src/TEEK_logFormat.h), written by the firmware built with
+// BINARY_LOG, into a CSV file with one column per field. The instruction names are resolved
+// from the name table, or from the name records of a streamed program, and the messages are
+// written as "time,message" lines, as in the CSV logs of the firmware.
+// Compressed logs (COMPRESSED_LOG) are decoded as a stream, a block at a time.
+// Crash dumps (/logs/crash_N.bin) are converted too, one line per probe sample.
+//
+// Build (from the tools folder):
+//      g++ -std=c++11 -O2 -Wall -I../src -o tkl2csv tkl2csv.cpp
+//
+// Usage:
+//      tkl2csv 00042_glaze.tkl [00042_glaze.csv]     (to the standard output if no CSV file is given)
+//      tkl2csv crash_1.bin [crash_1.csv]
+
+#include "TEEK_logFormat.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const char* fileName = "";
+
+static bool fail(const char* message) {
+    fprintf(stderr, "%s: %s\n", fileName, message);
+    return false;
+}
+
+static uint16_t column16(const uint8_t*& p) {
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return value;
+}
+
+// Check the header, and read the names: the name table, else the first (empty) name of the pool
+static bool readNames(const TklHeader& header, const uint8_t* data, size_t size, std::vector<std::string>& names) {
+    if (memcmp(header.magic, TKL_MAGIC, 3) != 0) return fail("Not a TEEKeeper log");
+    if (header.version != TKL_VERSION && header.version != TKL_VERSION_COMPRESSED) return fail("Unsupported log version");
+    if (header.recordSize != tklRecordSize(header.columns, header.numOfZones)) return fail("Invalid record size");
+    if (header.nameBytes == 0 || size < (size_t) header.nameBytes + header.numOfNames) return fail("Truncated header");
+
+    std::string pool(reinterpret_cast<const char*>(data), header.nameBytes);
+    pool.back() = '\0';
+    for (unsigned int i = 0; i < header.numOfNames; i++) {
+        uint8_t offset = data[header.nameBytes + i];
+        names.push_back(offset < pool.size() ? pool.c_str() + offset : "");
+    }
+    return true;
+}
+
+// Header of the CSV, as the one of the firmware
+static void printColumns(TklHeader& header, FILE* out) {
+    const char unit = "CFK"[header.unit < 3 ? header.unit : 0];
+    header.program[TKL_PROGRAM_NAME - 1] = '\0';
+    fprintf(out, "Program: %s\n", header.program);
+    fprintf(out, "Time,Name,Temperature,Target,DutyCycle");
+    if (header.columns & TKL_COL_WINDOW) fprintf(out, ",Min,Max,Mean");
+    if (header.columns & TKL_COL_ZONES)
+        for (int z = 1; z <= header.numOfZones; z++) fprintf(out, ",T%d,D%d", z, z);
+    if (header.columns & TKL_COL_CORE) fprintf(out, ",Core");
+    if (header.columns & TKL_COL_HEATWORK) fprintf(out, ",Heatwork");
+    if (header.columns & TKL_COL_ITERATION) fprintf(out, ",Iteration");
+    fprintf(out, ",Remaining,Heater,Stable,Soaking,Holding\n");
+    fprintf(out, "[ms],[],[%c],[%c],[%%]", unit, unit);
+    if (header.columns & TKL_COL_WINDOW) fprintf(out, ",[%c],[%c],[%c]", unit, unit, unit);
+    if (header.columns & TKL_COL_ZONES)
+        for (int z = 1; z <= header.numOfZones; z++) fprintf(out, ",[%c],[%%]", unit);
+    if (header.columns & TKL_COL_CORE) fprintf(out, ",[%c]", unit);
+    if (header.columns & TKL_COL_HEATWORK) fprintf(out, ",[%%]");
+    if (header.columns & TKL_COL_ITERATION) fprintf(out, ",[]");
+    fprintf(out, ",[min],[],[],[],[]\n");
+}
+
+// A message is printed, a name is stored for the following records
+static void printText(const TklRecord& rec, const std::string& text, std::vector<std::string>& names, FILE* out) {
+    if (rec.flags & TKL_MESSAGE) fprintf(out, "%lu,\"%s\"\n", (unsigned long) rec.time, text.c_str());
+    else {
+        if (names.size() <= rec.instruction) names.resize(rec.instruction + 1);
+        names[rec.instruction] = text;
+    }
+}
+
+// A data record, TklRecord and its columns, as a CSV line
+static void printRecord(const TklHeader& header, const std::vector<std::string>& names, const uint8_t* record, FILE* out) {
+    TklRecord rec;
+    memcpy(&rec, record, sizeof(rec));
+    const char* name = rec.instruction < names.size() ? names[rec.instruction].c_str() : "";
+    fprintf(out, "%lu,\"%s\",%.1f,%.1f,%.2f", (unsigned long) rec.time, name,
+            rec.temperature / 10.0, rec.target / 10.0, rec.duty / 100.0);
+    const uint8_t* p = record + sizeof(rec);
+
+    // the window follows the other columns in the record, but is printed next to the temperature
+    if (header.columns & TKL_COL_WINDOW) {
+        const uint8_t* w = record + header.recordSize - 6;
+        int16_t low = column16(w), high = column16(w), mean = column16(w);
+        fprintf(out, ",%.1f,%.1f,%.1f", low / 10.0, high / 10.0, mean / 10.0);
+    }
+    if (header.columns & TKL_COL_ZONES) {
+        for (int z = 0; z < header.numOfZones; z++) {
+            int16_t temp = column16(p);
+            uint16_t duty = column16(p);
+            fprintf(out, ",%.1f,%.2f", temp / 10.0, duty / 100.0);
+        }
+    }
+    if (header.columns & TKL_COL_CORE) fprintf(out, ",%.1f", (int16_t) column16(p) / 10.0);
+    if (header.columns & TKL_COL_HEATWORK) fprintf(out, ",%.1f", column16(p) / 10.0);
+    if (header.columns & TKL_COL_ITERATION) {
+        if (p[1]) fprintf(out, ",%u/%u", p[0], p[1]);
+        else fprintf(out, ",");
+        p += 2;
+    }
+    fprintf(out, ",%u,%d,%d,%d,%d\n", rec.remaining, !!(rec.flags & TKL_HEATER_ON), !!(rec.flags & TKL_STABLE),
+            !!(rec.flags & TKL_SOAKING), !!(rec.flags & TKL_HOLDING));
+}
+
+static bool convert(const std::vector<uint8_t>& data, FILE* out) {
+    TklHeader header;
+    if (data.size() < sizeof(header)) return fail("Not a TEEKeeper log");
+    memcpy(&header, data.data(), sizeof(header));
+    std::vector<std::string> names;
+    if (!readNames(header, data.data() + sizeof(header), data.size() - sizeof(header), names)) return false;
+    size_t pos = sizeof(header) + header.nameBytes + header.numOfNames;
+    printColumns(header, out);
+
+    // records
+    unsigned long count = 0;
+    while (pos + header.recordSize <= data.size()) {
+        TklRecord rec;
+        memcpy(&rec, data.data() + pos, sizeof(rec));
+        pos += header.recordSize;
+
+        // messages and names, the text fills the following records
+        if (rec.flags & (TKL_MESSAGE | TKL_NAME)) {
+            if (pos + rec.length > data.size()) break;
+            std::string text(reinterpret_cast<const char*>(data.data()) + pos, rec.length);
+            pos += (rec.length + header.recordSize - 1) / header.recordSize * header.recordSize;
+            printText(rec, text, names, out);
+            continue;
+        }
+
+        printRecord(header, names, data.data() + pos - header.recordSize, out);
+        count++;
+    }
+    if (pos != data.size()) fprintf(stderr, "%s: warning: truncated record at the end of the log\n", fileName);
+    fprintf(stderr, "%s: %lu records\n", fileName, count);
+    return true;
+}
+
+// Read a varint from a block, false past its end
+static bool getVarint(const uint8_t* block, size_t size, size_t& pos, uint32_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 7 * TKZ_VARINT_MAX; shift += 7) {
+        if (pos >= size) return false;
+        uint8_t byte = block[pos++];
+        value |= (uint32_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Compressed log: streamed a block at a time, each block is decoded on its own
+static bool convertCompressed(FILE* in, FILE* out) {
+    std::vector<uint8_t> head(TKZ_BLOCK_SIZE);
+    size_t size = fread(head.data(), 1, head.size(), in);
+    TklHeader header;
+    if (size < sizeof(header)) return fail("Not a TEEKeeper log");
+    memcpy(&header, head.data(), sizeof(header));
+
+    // the header and the names fill whole blocks
+    size_t headerBytes = sizeof(header) + header.nameBytes + header.numOfNames;
+    head.resize((headerBytes + TKZ_BLOCK_SIZE - 1) / TKZ_BLOCK_SIZE * TKZ_BLOCK_SIZE);
+    size += fread(head.data() + size, 1, head.size() - size, in);
+    std::vector<std::string> names;
+    if (!readNames(header, head.data() + sizeof(header), size - sizeof(header), names)) return false;
+    printColumns(header, out);
+
+    const uint8_t fields = tkzFields(header.recordSize);
+    std::vector<uint8_t> record(header.recordSize);
+    uint8_t block[TKZ_BLOCK_SIZE];
+    unsigned long count = 0, blocks = 0;
+    bool truncated = false;
+
+    while ((size = fread(block, 1, sizeof(block), in)) > 0) {
+        if (block[0] != TKZ_BLOCK_MARKER) return fail("Invalid block");
+        blocks++;
+
+        // the first record of the block is coded from zeros
+        std::fill(record.begin(), record.end(), 0);
+        size_t pos = 1;
+        while (pos < size && block[pos] != TKZ_END) {
+            size_t start = pos;
+            uint8_t tag = block[pos++];
+            uint32_t value;
+            TklRecord rec = {};
+            rec.flags = tag;
+
+            if (tag & (TKL_MESSAGE | TKL_NAME)) {
+                uint32_t instruction;
+                if (!getVarint(block, size, pos, rec.time) || !getVarint(block, size, pos, instruction) ||
+                    pos >= size || pos + 1 + block[pos] > size) {
+                    pos = start;
+                    break;
+                }
+                rec.instruction = instruction;
+                uint8_t length = block[pos++];
+                printText(rec, std::string(reinterpret_cast<const char*>(block) + pos, length), names, out);
+                pos += length;
+                continue;
+            }
+
+            // the deltas of the time and of each 16 bit field, skipping the flags and the length bytes
+            uint32_t time;
+            memcpy(&time, record.data(), sizeof(time));
+            if (!getVarint(block, size, pos, value)) { pos = start; break; }
+            time += tkzUnzigzag(value);
+            memcpy(record.data(), &time, sizeof(time));
+            record[12] = tag;
+            bool complete = true;
+            for (uint8_t f = 0; f < fields && complete; f++) {
+                size_t offset = (f < 4) ? 4 + 2 * f : 14 + 2 * (f - 4);
+                uint16_t field;
+                memcpy(&field, record.data() + offset, sizeof(field));
+                complete = getVarint(block, size, pos, value);
+                field += (uint16_t) tkzUnzigzag(value);
+                memcpy(record.data() + offset, &field, sizeof(field));
+            }
+            if (!complete) { pos = start; break; }
+            printRecord(header, names, record.data(), out);
+            count++;
+        }
+        // only the last block can end in the middle of an item, if the log wasn't closed
+        if (pos < size && block[pos] != TKZ_END) truncated = true;
+    }
+    if (truncated) fprintf(stderr, "%s: warning: truncated record at the end of the log\n", fileName);
+    fprintf(stderr, "%s: %lu records in %lu blocks\n", fileName, count, blocks);
+    return true;
+}
+
+// Crash dump: the sample times are rebuilt from their 16 bit deltas, and placed by the full time
+// of the newest one. A truncated dump lacks the newest samples: its times start from 0
+static bool convertCrash(const std::vector<uint8_t>& data, FILE* out) {
+    static const char* states[] = {"IDLE", "BEGIN", "EXECUTING", "END", "DOOR_OPEN", "RECOVER", "HOLD", "ERROR", "TUNING", "USER_STOP"};
+    TkbHeader header;
+    if (data.size() < sizeof(header)) return fail("Truncated header");
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.version != TKB_VERSION || header.sampleSize != sizeof(TkbSample)) return fail("Unsupported crash dump version");
+    size_t samples = header.samples;
+    if (data.size() < sizeof(header) + samples * sizeof(TkbSample)) {
+        samples = (data.size() - sizeof(header)) / sizeof(TkbSample);
+        fprintf(stderr, "%s: truncated, %zu samples of %u, times from the first one\n", fileName, samples, header.samples);
+    }
+    bool complete = samples == header.samples;
+
+    std::vector<TkbSample> ring(samples);
+    if (samples) memcpy(ring.data(), data.data() + sizeof(header), samples * sizeof(TkbSample));
+    std::vector<uint32_t> times(samples);
+    for (size_t i = 1; i < samples; i++) times[i] = times[i - 1] + (uint16_t) (ring[i].time - ring[i - 1].time);
+    if (complete && samples) {
+        uint32_t start = header.time - times[samples - 1];
+        for (uint32_t& time : times) time += start;
+    }
+
+    header.error[TKB_ERROR - 1] = '\0';
+    fprintf(out, "Crash dump: %s\n", header.error);
+    if (header.sequence) fprintf(out, "Log: %05lu\n", (unsigned long) header.sequence);
+    const char unit = "CFK"[header.unit < 3 ? header.unit : 0];
+    fprintf(out, "Time,Probe,Raw,Filtered,DutyCycle,State,Heaters\n");
+    fprintf(out, "[ms],[],[%c],[%c],[%%],[],[]\n", unit, unit);
+    for (size_t i = 0; i < samples; i++) {
+        const TkbSample& s = ring[i];
+        fprintf(out, "%lu,%u,", (unsigned long) times[i], s.probe);
+        if (s.raw != TKB_NO_READING) fprintf(out, "%.1f", s.raw / 10.0);
+        fprintf(out, ",%.1f,%.1f,%s,0x%02X\n", s.filtered / 10.0, s.duty / 2.0,
+                s.state < sizeof(states) / sizeof(states[0]) ? states[s.state] : "?", s.heaters);
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s log.tkl [log.csv]\n", argv[0]);
+        return 2;
+    }
+
+    fileName = argv[1];
+    FILE* in = fopen(fileName, "rb");
+    if (!in) {
+        fprintf(stderr, "%s: cannot open the file\n", fileName);
+        return 2;
+    }
+    FILE* out = stdout;
+    if (argc == 3 && !(out = fopen(argv[2], "w"))) {
+        fprintf(stderr, "%s: cannot create the file\n", argv[2]);
+        fclose(in);
+        return 2;
+    }
+
+    // the compressed logs are streamed, the others are read at once
+    TklHeader header = {};
+    bool read = fread(&header, sizeof(header), 1, in) == 1;
+    bool compressed = read && header.version == TKL_VERSION_COMPRESSED;
+    bool crash = read && memcmp(header.magic, TKB_MAGIC, 3) == 0;
+    rewind(in);
+    bool ok;
+    if (compressed && !crash) ok = convertCompressed(in, out);
+    else {
+        std::vector<uint8_t> data;
+        uint8_t block[4096];
+        size_t n;
+        while ((n = fread(block, 1, sizeof(block), in)) > 0) data.insert(data.end(), block, block + n);
+        ok = crash ? convertCrash(data, out) : convert(data, out);
+    }
+    fclose(in);
+    if (out != stdout && fclose(out) != 0) ok = false;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,254 @@
+// tkpc - TEEKeeper program compiler
+//
+// Compiles a CSV program into the binary .tkp format loaded by the firmware (see src/TEEK_programFormat.h),
+// or just checks it when no output file is given, to validate a library of programs on a PC.
+//
+// Build (from the tools folder):
+//      g++ -std=c++11 -O2 -Wall -I../src -o tkpc tkpc.cpp ../src/TEEK_csv.cpp
+//
+// Usage:
+//      tkpc [-u C|F|K] program.csv [program.tkp]
+//
+// The CSV is parsed by the same code as in the firmware (src/TEEK_csv.h): a header line naming the
+// columns, then one instruction per line
+//      name,target,hold [min],rate [/min],waitForDoorOpen (0|1),waitForButtonPress (0|1)[,unit (C|F|K)]
+// the program options as "@key,value" lines (@thickness, @coresoak, @cone, @repeat), blank lines
+// and '#' comments. The unit (-u, or the one of the first row, default C) is the one of the
+// compiled program, the oven switches to it.
+
+#include "TEEK_constants.h"
+#include "TEEK_programFormat.h"
+#include "TEEK_csv.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct Program {
+    TkpHeader header;
+    std::vector<TkpRepeat> repeats;
+    std::string names = std::string(1, '\0');   // the first name is the empty one
+    std::vector<TkpRecord> records;
+    CsvLayout layout;
+    bool hasUnit = false;               // unit given, or taken from the first row
+};
+
+static const char* fileName = "";
+static int lineNumber = 0;
+static int column = 0;
+
+static bool fail(const char* message, const char* detail = "") {
+    if (lineNumber > 0 && column > 0) fprintf(stderr, "%s:%d:%d: %s%s\n", fileName, lineNumber, column, message, detail);
+    else if (lineNumber > 0) fprintf(stderr, "%s:%d: %s%s\n", fileName, lineNumber, message, detail);
+    else fprintf(stderr, "%s: %s%s\n", fileName, message, detail);
+    column = 0;
+    return false;
+}
+
+// Split a line into its fields, as the firmware does
+static std::vector<std::string> splitFields(char* line) {
+    std::vector<std::string> fields;
+    CsvTokenizer tok;
+    char* value;
+    tok.begin(line);
+    while (tok.next(value)) fields.push_back(value);
+    return fields;
+}
+
+// Parse a number, the whole field must be used
+static bool parseNumber(const std::string& field, double& value) {
+    char* end;
+    value = strtod(field.c_str(), &end);
+    return !field.empty() && *end == '\0' && std::isfinite(value);
+}
+
+// Store a name in the pool, sharing identical names as the firmware does
+static bool internName(Program& prog, const std::string& name, uint8_t& offset) {
+    if (name.empty()) {
+        offset = 0;
+        return true;
+    }
+    for (size_t i = 1; i < prog.names.size(); i += strlen(prog.names.c_str() + i) + 1) {
+        if (name == prog.names.c_str() + i) {
+            offset = i;
+            return true;
+        }
+    }
+    if (prog.names.size() + name.size() + 1 > INSTR_NAME_POOL_SIZE) return false;
+    offset = prog.names.size();
+    prog.names += name;
+    prog.names += '\0';
+    return true;
+}
+
+static bool parseOption(Program& prog, const std::vector<std::string>& fields) {
+    const std::string& key = fields[0];
+    double value;
+
+    if (key == "@thickness") {
+        if (fields.size() != 2 || !parseNumber(fields[1], value) || value < 0 || value > 6553.5)
+            return fail("Invalid thickness");
+        prog.header.thickness = lround(value * 10);
+    }
+    else if (key == "@coresoak") {
+        if (fields.size() != 2 || (fields[1] != "0" && fields[1] != "1")) return fail("Invalid coresoak, 0 or 1");
+        prog.header.coreSoak = fields[1] == "1";
+    }
+    else if (key == "@cone") {
+        if (fields.size() != 2 || !parseNumber(fields[1], value)) return fail("Invalid cone");
+        int cone = (fields[1][0] == '0') ? -(int) value : (int) value;
+        if (cone < -22 || cone == 0 || cone > 10) return fail("Unknown cone ", fields[1].c_str());
+        prog.header.cone = cone;
+    }
+    else if (key == "@repeat") {
+        double first, last, times;
+        if (fields.size() != 4 || !parseNumber(fields[1], first) || !parseNumber(fields[2], last) ||
+            !parseNumber(fields[3], times) || first < 1 || last < first || times < 1 || times > 255)
+            return fail("Invalid repeat, @repeat,first,last,times");
+        if (prog.repeats.size() >= MAX_REPEAT_BLOCKS) return fail("Too many repeat blocks");
+        TkpRepeat block = {};
+        block.first = first - 1;
+        block.last = last - 1;
+        block.times = times;
+        prog.repeats.push_back(block);
+    }
+    else return fail("Unknown option ", key.c_str());
+    return true;
+}
+
+static bool parseInstruction(Program& prog, char* line) {
+    CsvRow row;
+    CsvError error;
+    if (!prog.layout.parseRow(line, row, error, MAX_INSTR_NAME_LENGHT)) {
+        column = error.position;
+        return fail(error.message);
+    }
+
+    // rows with their unit are converted to the unit of the program
+    if (prog.layout.HasUnit()) {
+        if (!prog.hasUnit) {
+            prog.header.unit = (row.unit == CSV_NO_UNIT) ? 0 : row.unit;
+            prog.hasUnit = true;
+        }
+        if (row.unit != CSV_NO_UNIT) {
+            row.target = convertTemperature(row.target, row.unit, prog.header.unit, false);
+            row.rate = convertTemperature(row.rate, row.unit, prog.header.unit, true);
+            if (fabs(row.target) > INT16_MAX / 10 || fabs(row.rate) > INT16_MAX / 10) return fail("Value out of range");
+        }
+    }
+
+    TkpRecord record = {};
+    record.target = lround(row.target * 10);
+    record.rate = lround(row.rate * 10);
+    record.soak = row.hold;
+    record.flags = (row.waitForDoorOpen ? TKP_WAIT_DOOR_OPEN : 0) | (row.waitForButtonPress ? TKP_WAIT_BUTTON_PRESS : 0);
+    if (!internName(prog, row.name, record.nameOffset)) return fail("Instruction names exceed the name pool");
+    prog.records.push_back(record);
+    return true;
+}
+
+static bool parseProgram(FILE* in, Program& prog) {
+    char line[256];
+    bool ok = true;
+
+    while (fgets(line, sizeof(line), in)) {
+        lineNumber++;
+        size_t length = strcspn(line, "\n");
+        if (line[length] != '\n' && !feof(in)) {
+            for (int c = fgetc(in); c != EOF && c != '\n'; c = fgetc(in));
+            ok = fail("Line too long");
+            continue;
+        }
+        if (length > 127) fprintf(stderr, "%s:%d: warning: line too long for the CSV loader of the firmware\n", fileName, lineNumber);
+        if (lineNumber == 1) {
+            if (!prog.layout.parseHeader(line)) printf("%s: header not recognized, legacy column order\n", fileName);
+            continue;
+        }
+        if (CsvTokenizer::isSkippable(line)) continue;
+
+        if (line[0] == '@') ok &= parseOption(prog, splitFields(line));
+        else ok &= parseInstruction(prog, line);
+    }
+
+    lineNumber = 0;
+    if (prog.records.empty()) return fail("Empty program");
+    if (prog.records.size() > UINT16_MAX) return fail("Too many instructions");
+    for (size_t i = 0; i < prog.repeats.size(); i++) {
+        const TkpRepeat& a = prog.repeats[i];
+        if (a.last >= prog.records.size()) ok = fail("Repeat block past the end of the program");
+        for (size_t j = 0; j < i; j++) {
+            const TkpRepeat& b = prog.repeats[j];
+            bool disjoint = a.last < b.first || b.last < a.first;
+            bool nested = (a.first >= b.first && a.last <= b.last) || (b.first >= a.first && b.last <= a.last);
+            if (!disjoint && !nested) ok = fail("Overlapping repeat blocks");
+        }
+    }
+    return ok;
+}
+
+static bool writeProgram(const char* path, Program& prog) {
+    TkpHeader& h = prog.header;
+    memcpy(h.magic, TKP_MAGIC, 3);
+    h.version = TKP_VERSION;
+    h.numOfRepeats = prog.repeats.size();
+    h.numOfInstructions = prog.records.size();
+    h.nameBytes = prog.names.size();
+
+    uint32_t crc = 0;
+    crc = tkpCrc32(crc, prog.repeats.data(), prog.repeats.size() * sizeof(TkpRepeat));
+    crc = tkpCrc32(crc, prog.names.data(), prog.names.size());
+    crc = tkpCrc32(crc, prog.records.data(), prog.records.size() * sizeof(TkpRecord));
+    h.crc = crc;
+
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        fprintf(stderr, "%s: cannot create the file\n", path);
+        return false;
+    }
+    fwrite(&h, sizeof(h), 1, out);
+    fwrite(prog.repeats.data(), sizeof(TkpRepeat), prog.repeats.size(), out);
+    fwrite(prog.names.data(), 1, prog.names.size(), out);
+    fwrite(prog.records.data(), sizeof(TkpRecord), prog.records.size(), out);
+    return fclose(out) == 0;
+}
+
+int main(int argc, char** argv) {
+    Program prog;
+    prog.header = TkpHeader();
+
+    int arg = 1;
+    if (arg + 1 < argc && strcmp(argv[arg], "-u") == 0) {
+        const char* units = "CFK";
+        const char* unit = strchr(units, toupper(argv[arg + 1][0]));
+        if (!unit || argv[arg + 1][1] != '\0') {
+            fprintf(stderr, "Unknown unit %s, C, F or K\n", argv[arg + 1]);
+            return 2;
+        }
+        prog.header.unit = unit - units;
+        prog.hasUnit = true;
+        arg += 2;
+    }
+    if (argc - arg < 1 || argc - arg > 2) {
+        fprintf(stderr, "Usage: %s [-u C|F|K] program.csv [program.tkp]\n", argv[0]);
+        return 2;
+    }
+
+    fileName = argv[arg];
+    FILE* in = fopen(fileName, "r");
+    if (!in) {
+        fprintf(stderr, "%s: cannot open the file\n", fileName);
+        return 2;
+    }
+    bool ok = parseProgram(in, prog);
+    fclose(in);
+    if (!ok) return 1;
+
+    if (argc - arg == 2 && !writeProgram(argv[arg + 1], prog)) return 1;
+    printf("%s: %zu instructions, %zu repeat blocks, %zu bytes of names\n",
+           fileName, prog.records.size(), prog.repeats.size(), prog.names.size());
+    return 0;
+}